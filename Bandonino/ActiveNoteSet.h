@@ -0,0 +1,141 @@
+#ifndef ACTIVENOTESET_H
+#define ACTIVENOTESET_H
+
+#include <stdint.h>
+
+// A bit per MIDI note (0 to 127)
+struct NoteMask {
+  uint64_t mBits[2] = { 0, 0 };
+
+  bool contains(int midiNote) const {
+    return (mBits[midiNote >> 6] >> (midiNote & 63)) & 1;
+  }
+
+  bool empty() const {
+    return (mBits[0] | mBits[1]) == 0;
+  }
+
+  int size() const {
+    return __builtin_popcountll(mBits[0]) + __builtin_popcountll(mBits[1]);
+  }
+
+  // The notes in this mask that aren't in other
+  NoteMask without(const NoteMask& other) const {
+    NoteMask mask;
+    mask.mBits[0] = mBits[0] & ~other.mBits[0];
+    mask.mBits[1] = mBits[1] & ~other.mBits[1];
+    return mask;
+  }
+
+  bool operator==(const NoteMask& other) const {
+    return mBits[0] == other.mBits[0] && mBits[1] == other.mBits[1];
+  }
+  bool operator!=(const NoteMask& other) const {
+    return !(*this == other);
+  }
+
+  // Calls fn(midiNote) for each note, lowest first. Only the notes in the mask are visited.
+  template<typename Fn>
+  void forEach(Fn&& fn) const {
+    for (int word = 0; word != 2; ++word) {
+      for (uint64_t bits = mBits[word]; bits; bits &= bits - 1)
+        fn(word * 64 + __builtin_ctzll(bits));
+    }
+  }
+
+  // Fills notes (which needs space for size() notes) in ascending order, and returns how many
+  int getNotes(int notes[]) const {
+    int numNotes = 0;
+    forEach([&](int midiNote) {
+      notes[numNotes++] = midiNote;
+    });
+    return numNotes;
+  }
+};
+
+// The notes sounding on one side. Notes are reference counted, as more than one key can play the
+// same note. The mask says which notes are sounding, and the version changes whenever a note starts
+// or stops (but not when only a count changes), so users can tell if anything has changed since
+// they last looked without scanning.
+class ActiveNoteSet {
+public:
+  // Returns true if the note has just started
+  bool add(int midiNote) {
+    if (midiNote < 0 || midiNote > 127)
+      return false;
+    if (mCounts[midiNote] != 255)
+      ++mCounts[midiNote];
+    if (mCounts[midiNote] != 1)
+      return false;
+    setBit(midiNote);
+    return true;
+  }
+
+  // Returns true if the note has just stopped. Notes that aren't sounding are ignored.
+  bool remove(int midiNote) {
+    if (midiNote < 0 || midiNote > 127 || mCounts[midiNote] == 0)
+      return false;
+    if (--mCounts[midiNote] != 0)
+      return false;
+    clearBit(midiNote);
+    return true;
+  }
+
+  void setCount(int midiNote, int count) {
+    if (midiNote < 0 || midiNote > 127)
+      return;
+    count = count < 0 ? 0 : (count > 255 ? 255 : count);
+    if (count && !mCounts[midiNote])
+      setBit(midiNote);
+    else if (!count && mCounts[midiNote])
+      clearBit(midiNote);
+    mCounts[midiNote] = (uint8_t)count;
+  }
+
+  void clear() {
+    mMask.forEach([this](int midiNote) {
+      mCounts[midiNote] = 0;
+    });
+    if (!mMask.empty())
+      ++mVersion;
+    mMask = NoteMask();
+  }
+
+  int getCount(int midiNote) const {
+    return midiNote < 0 || midiNote > 127 ? 0 : mCounts[midiNote];
+  }
+
+  bool contains(int midiNote) const {
+    return getCount(midiNote) != 0;
+  }
+
+  const NoteMask& getMask() const {
+    return mMask;
+  }
+
+  uint32_t getVersion() const {
+    return mVersion;
+  }
+
+  template<typename Fn>
+  void forEach(Fn&& fn) const {
+    mMask.forEach(fn);
+  }
+
+private:
+  void setBit(int midiNote) {
+    mMask.mBits[midiNote >> 6] |= uint64_t(1) << (midiNote & 63);
+    ++mVersion;
+  }
+
+  void clearBit(int midiNote) {
+    mMask.mBits[midiNote >> 6] &= ~(uint64_t(1) << (midiNote & 63));
+    ++mVersion;
+  }
+
+  NoteMask mMask;
+  uint8_t mCounts[128] = {};
+  uint32_t mVersion = 0;
+};
+
+#endif
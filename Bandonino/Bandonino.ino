@@ -8,7 +8,14 @@
 #include "State.h"
 #include "Menu.h"
 #include "Metronome.h"
+#include "ClockPll.h"
+#include "DisplayFlush.h"
 #include "Bellows.h"
+#include "KeyScan.h"
+#include "MidiOut.h"
+#include "Mpe.h"
+#include "PressureFilter.h"
+#include "ResponseCurve.h"
 
 // We don't have a State.cpp file, so put these here
 BigState gBigState;
@@ -18,6 +25,14 @@ State gPrevState;
 // Config
 // This is the wait (microseconds) between writing to the column and then reading from the rows.
 const int sKeyReadDelayTime = 3;
+// Scan whole row groups using port reads (see KeyScan.h), rather than a digitalRead per key
+const bool sUseFastKeyScan = true;
+// Scan the keys from a timer interrupt, with the changes queued up for playAllKeys. This uses the
+// port reads, and replaces the scanning in the loop.
+const bool sUseTimerKeyScan = true;
+// How long the bellows can be stationary before the notes are stopped. If they start moving again
+// within this time, only the notes that differ between the directions are restarted.
+const uint32_t sReversalHoldMillis = 150;
 
 bool runHardwareTest = false;
 bool showKeys = false;
@@ -25,6 +40,16 @@ bool showBellows = false;
 bool flashLED = true;
 bool showRot = false;
 bool showPlayingNotes = false;
+bool showKeyScanTiming = false;
+bool showKeyTrace = false;  // Captures raw scans when a key changes, for replaying through KeyDebouncer offline
+bool showNoteTrace = false;  // Prints each note started, as recordings for Tools/LayoutOptimiser
+bool showNoteLatency = false;  // Scan to USB flush latency of the notes
+bool showMidiOut = false;  // MIDI messages sent and suppressed by the output scheduler
+bool showMidiClock = false;  // Tempo and jitter of the incoming MIDI clock
+bool showReversals = false;  // Prints the MIDI messages sent/saved by each reversal
+bool showDisplayFlush = false;  // Bytes and time per display transfer, and the time taken to start one
+bool showSettingsWriter = false;  // Settings saved in the background, and the longest they held up the loop
+bool showPressureFilter = false;  // Records the raw pressure, then prints it and how each filter performs on it
 
 //====================================================================================================
 // Rotary encoder pins and library configuration
@@ -42,15 +67,6 @@ void initInputPins(const byte pins[], byte pinCount, uint8_t mode) {
     pinMode(pins[iPin], mode);
 }
 
-//====================================================================================================
-void initKeys(byte activeKeys[], int keyCount) {
-  for (int iKey = 0; iKey != keyCount; ++iKey)
-    activeKeys[iKey] = 0;
-}
-
-// Used to force a periodic sync
-const int SYNC_VALUE = -1234;
-
 //====================================================================================================
 inline int convertFractionToMidi(float frac) {
   return std::clamp((int)(128 * frac), 0, 127);
@@ -67,9 +83,19 @@ void setup() {
 
   Serial.println("========= Starting Bandon.ino ==========");
 
-  Serial.println("Loading gSettings from gSettings.json");
-  if (!gSettings.readFromCard())
-    Serial.println("Failed to load gSettings");
+  // Before the settings, which select one of them
+  loadNoteLayouts();
+
+  // If the power went while the image was being replaced, only the new copy will be there. If
+  // there's no image, the settings are in JSON from an older build.
+  Serial.println("Loading gSettings");
+  if (!gSettings.readImageFromCard() && !gSettings.readImageFromCard(SETTINGS_TEMP_FILENAME)) {
+    if (gSettings.readFromCard())
+      markSettingsDirty();
+    else
+      Serial.println("Failed to load gSettings");
+  }
+  loadSettingsSlots();
 
   syncNoteLayout();
 
@@ -78,9 +104,8 @@ void setup() {
   initInputPins(PinInputs::columnPinsRight, PinInputs::columnCounts[RIGHT], INPUT);
   initInputPins(PinInputs::rowPinsLeft, PinInputs::rowCounts[LEFT], INPUT);
   initInputPins(PinInputs::rowPinsRight, PinInputs::rowCounts[RIGHT], INPUT);
-
-  initKeys(gBigState.mActiveKeysLeft, PinInputs::keyCounts[LEFT]);
-  initKeys(gBigState.mActiveKeysRight, PinInputs::keyCounts[RIGHT]);
+  if (sUseFastKeyScan || sUseTimerKeyScan)
+    initKeyScan();
 
   pinMode(LED_BUILTIN, OUTPUT);
   pinMode(ROTARY_ENCODER_BUTTON_PIN, INPUT_PULLUP);
@@ -91,6 +116,9 @@ void setup() {
   attachInterrupt(digitalPinToInterrupt(ROTARY_PIN2), tickRotaryEncoderISR, CHANGE);
 
   initMenu();
+
+  if (sUseTimerKeyScan)
+    startKeyScanTimer(gSettings.keyScanRate);
 }
 
 //====================================================================================================
@@ -108,35 +136,79 @@ void loop() {
   // Periodically force the pan/volume to be sent, in case the receiving device wasn't plugged in when we last sent it!
   static uint32_t lastMidiSyncTime = 0;
   if (gState.mLoopStartTimeMillis > lastMidiSyncTime + 1000) {
-    for (int side = 0; side != 2; ++side) {
-      gPrevState.mMidiPans[side] = SYNC_VALUE;
-      gPrevState.mMidiVolumes[side] = SYNC_VALUE;
-      gPrevState.mMidiInstruments[side] = SYNC_VALUE;
-    }
+    resendMidiControls();
     lastMidiSyncTime = gState.mLoopStartTimeMillis;
   }
 
+  // Loading a slot or preset (in the menu last loop) takes effect here, before anything uses the
+  // settings
+  applySettingsChanges();
+
   // Inputs needs to be processed before the menus
   readRotaryEncoder();
 
   readAllKeys();
 
+  // Get the notes out before the menu and display work, which can take a while
+  bool immediateNotes = gSettings.immediateNotes != 0;
+  static bool prevImmediateNotes = immediateNotes;
+  if (immediateNotes != prevImmediateNotes)
+    gBigState.mNoteLatency.reset();  // So that the figures are for one mode
+  prevImmediateNotes = immediateNotes;
+  if (immediateNotes)
+    updateNotes();
+
   updateMenu();
+  // The frame drawn by the menu goes out in the background
+  updateDisplayFlush();
 
   syncNoteLayout();
 
+  if (!immediateNotes)
+    updateNotes();
+
+  updateMetronome();
+
+  // Last, so that anything changed this loop is included
+  updateSettingsWriter(gBigState.mPlayingNotes[LEFT].getMask().empty() &&
+                       gBigState.mPlayingNotes[RIGHT].getMask().empty() &&
+                       gBigState.activeKeys(LEFT) == 0 && gBigState.activeKeys(RIGHT) == 0);
+
+  if (runHardwareTest)
+    hardwareTest();
+}
+
+//====================================================================================================
+void updateNotes() {
+  if (isMpeZoneChangePending()) {
+    stopAllNotes();
+    updateMpeZones();
+  }
+
+  updateEffectiveNotes();
+
   updateVolumes();
 
   updateMidi();
 
   playAllKeys();
 
-  usbMIDI.send_now();
+  flushMidi();
+}
 
-  updateMetronome();
+// The scan times of the key events that were played, waiting to be flushed
+const int MAX_PENDING_NOTE_TIMES = 16;
+uint32_t sPendingNoteTimes[MAX_PENDING_NOTE_TIMES];
+int sNumPendingNoteTimes = 0;
 
-  if (runHardwareTest)
-    hardwareTest();
+//====================================================================================================
+void flushMidi() {
+  flushMidiOut();
+
+  uint32_t timeMicros = micros();
+  for (int i = 0; i != sNumPendingNoteTimes; ++i)
+    gBigState.mNoteLatency.add(timeMicros - sPendingNoteTimes[i]);
+  sNumPendingNoteTimes = 0;
 }
 
 //====================================================================================================
@@ -150,51 +222,96 @@ void convertBalanceToLevels(int balance, int levels[2]) {
   }
 }
 
+// Smooths the pressure from the load cell, and predicts it between samples
+PressureFilter sPressureFilter;
+// Standard deviation of the load cell noise, in pressure units
+const float sPressureNoise = 0.01f;
+
+// Raw pressure samples recorded for showPressureFilter. 400 samples is about 5s.
+const int PRESSURE_TRACE_LENGTH = 400;
+float sPressureTrace[PRESSURE_TRACE_LENGTH];
+uint32_t sPressureTraceTimes[PRESSURE_TRACE_LENGTH];
+int sPressureTraceLength = 0;
+
+// Compiled from gSettings.responseCurves, and rebuilt when they change
+ResponseCurve sResponseCurves[2];
+
+//====================================================================================================
+void updatePressure() {
+  sPressureFilter.setType(gSettings.pressureFilter);
+  sPressureFilter.setSmoothing(gSettings.pressureSmoothing / 100.0f);
+  sPressureFilter.setNoise(sPressureNoise);
+
+  if (updateBellows()) {
+    trackBellowsZero(gBigState.activeKeys(LEFT) == 0 && gBigState.activeKeys(RIGHT) == 0);
+    sPressureFilter.addSample(gState.mRawPressure, gState.mLoadSampleTimeMicros);
+    if (showPressureFilter && sPressureTraceLength != PRESSURE_TRACE_LENGTH) {
+      sPressureTrace[sPressureTraceLength] = gState.mRawPressure;
+      sPressureTraceTimes[sPressureTraceLength] = gState.mLoadSampleTimeMicros;
+      ++sPressureTraceLength;
+    }
+  }
+  gState.mPressure = sPressureFilter.getPressure(micros(), gSettings.pressurePrediction != 0);
+  gState.mPressureRate = sPressureFilter.getRate();
+}
+
+//====================================================================================================
+void printPressureFilterReport() {
+  Serial.println("Pressure trace (us, pressure)");
+  for (int i = 0; i != sPressureTraceLength; ++i)
+    Serial.printf("%lu, %f\n", (unsigned long)sPressureTraceTimes[i], sPressureTrace[i]);
+
+  // Reading the output at 1kHz, roughly as the loop does
+  for (int type = 0; type != PRESSURE_FILTER_NUM; ++type) {
+    for (int predict = 0; predict != 2; ++predict) {
+      PressureFilter filter;
+      filter.setType(type);
+      filter.setSmoothing(gSettings.pressureSmoothing / 100.0f);
+      filter.setNoise(sPressureNoise);
+      PressureFilterReport report = measurePressureFilter(
+        filter, sPressureTrace, sPressureTraceTimes, sPressureTraceLength, 1000, predict != 0);
+      Serial.printf("Pressure filter %-7s predict %d: latency %4.1fms noise %4.2f largest step %6.4f\n",
+                    gPressureFilterNames[type], predict, report.mLatencyMillis, report.mNoise, report.mMaxStep);
+    }
+  }
+}
+
+//====================================================================================================
+// Sends the pressure to each sounding note on the side. With MPE each note has its own channel, so
+// channel pressure does the same job.
+void sendPolyPressure(int side, int pressure) {
+  if (isMpeEnabled()) {
+    sendMpePressure(side, pressure);
+    return;
+  }
+  gBigState.mPlayingNotes[side].forEach([side, pressure](int midiNote) {
+    sendMidiPolyPressure(midiNote, pressure, gSettings.midiChannels[side], gSettings.polyPressureThreshold);
+  });
+}
+
 //====================================================================================================
 void updateVolumes() {
   if (gSettings.forceBellows == 0) {
-    updateBellows();
+    updatePressure();
 
     // Send the pressure to modulate volume
     gState.mAbsPressure = std::min(fabsf(gState.mPressure), 1.0f);  //Absolute Channel Pressure
 
-    float deadzone = gSettings.deadzone / 100.0f;
-    float cleanAbsPressure = std::max((gState.mAbsPressure - deadzone) / (1.0f - deadzone), 0.0f);
-
-    float a25 = gSettings.attack25 / 100.0f;
-    float a50 = gSettings.attack50 / 100.0f;
-    float a75 = gSettings.attack75 / 100.0f;
-
-    if (cleanAbsPressure < 0.25f) {
-      gState.mModifiedPressure = (cleanAbsPressure * a25) / 0.25f;
-    } else if (cleanAbsPressure < 0.5f) {
-      gState.mModifiedPressure = a25 + ((cleanAbsPressure - 0.25f) * (a50 - a25)) / 0.25f;
-    } else if (cleanAbsPressure < 0.75f) {
-      gState.mModifiedPressure = a50 + ((cleanAbsPressure - 0.5f) * (a75 - a50)) / 0.25f;
-    } else {
-      gState.mModifiedPressure = a75 + ((cleanAbsPressure - 0.75f) * (1.0f - a75)) / 0.25f;
+    // Shape the response for each side. The bellows are only stopped when both sides are silent.
+    for (int side = 0; side != 2; ++side) {
+      sResponseCurves[side].update(gSettings.responseCurves[side]);
+      gState.mModifiedPressures[side] = sResponseCurves[side].apply(gState.mAbsPressure);
     }
+    gState.mModifiedPressure = std::max(gState.mModifiedPressures[LEFT], gState.mModifiedPressures[RIGHT]);
 
-    // Handle bellows reversals
-    if (gState.mModifiedPressure == 0) {  //Bellows stopped
+    if (gState.mModifiedPressure == 0)  //Bellows stopped
       gState.mBellowsState = BELLOWS_STATE_STATIONARY;
-      if (gPrevState.mModifiedPressure != 0) {  //Bellows were not previously stopped
-        stopAllNotes();                 //All Notes Off
-      }
-    } else {                       //Bellows not stopped
-      if (gState.mPressure < 0) {  //Pull
-        gState.mBellowsState = BELLOWS_STATE_OPENING;
-        if (gPrevState.mPressure >= 0) {  //Pull and Previously Push or stopped
-          stopAllNotes();                 //All Notes Off
-        }
-      }
-      if (gState.mPressure > 0) {  //Push
-        gState.mBellowsState = BELLOWS_STATE_CLOSING;
-        if (gPrevState.mPressure <= 0) {  //Push and Previously Pull or stopped
-          stopAllNotes();                 //All Notes Off
-        }
-      }
-    }
+    else if (gState.mPressure < 0)  //Pull
+      gState.mBellowsState = BELLOWS_STATE_OPENING;
+    else if (gState.mPressure > 0)  //Push
+      gState.mBellowsState = BELLOWS_STATE_CLOSING;
+
+    updatePlayingBellowsState();
 
     // If the quantized volume is zero, force that to show as no bellows movement
     if (gState.mMidiVolumes[LEFT] == 0 && gState.mMidiVolumes[RIGHT] == 0)
@@ -202,71 +319,112 @@ void updateVolumes() {
 
   } else {
     gState.mModifiedPressure = 1.0f;
+    gState.mModifiedPressures[LEFT] = gState.mModifiedPressures[RIGHT] = 1.0f;
     gState.mAbsPressure = 1.0f;
 
     gState.mBellowsState = gSettings.forceBellows == 1 ? BELLOWS_STATE_OPENING : BELLOWS_STATE_CLOSING;
+    updatePlayingBellowsState();
   }
 
   int levels[2];
   convertBalanceToLevels(gSettings.balance, levels);
 
+  // MidiOut drops values that haven't changed, so these can be sent every frame
   for (int side = 0; side != 2; ++side) {
-    if (gSettings.expressions[side] == EXPRESSION_VOLUME) {
-      float volume = gState.mModifiedPressure * levels[side] / 100.0f;
+    if (gSettings.expressions[side] == EXPRESSION_VOLUME && isMpeEnabled()) {
+      // Each note gets the pressure, and the zone volume just has the balance
+      sendMpePressure(side, std::min((int)(128 * gState.mModifiedPressures[side]), 127));
+      gState.mMidiVolumes[side] = std::min((int)(128 * levels[side] / 100.0f), 127);
+    } else if (gSettings.expressions[side] == EXPRESSION_VOLUME) {
+      float volume = gState.mModifiedPressures[side] * levels[side] / 100.0f;
       gState.mMidiVolumes[side] = std::min((int)(128 * volume), 127);
+    } else if (gSettings.expressions[side] == EXPRESSION_POLY_PRESSURE) {
+      float pressure = gState.mModifiedPressures[side] * levels[side] / 100.0f;
+      sendPolyPressure(side, std::min((int)(128 * pressure), 127));
+      gState.mMidiVolumes[side] = 127;
     } else {
       gState.mMidiVolumes[side] = 127;
     }
 
-    if (gState.mMidiVolumes[side] != gPrevState.mMidiVolumes[side])
-      usbMIDI.sendControlChange(0x07, gState.mMidiVolumes[side], gSettings.midiChannels[side]);
+    sendMidiContinuousControl(0x07, gState.mMidiVolumes[side], getSideMidiChannel(side));
   }
 }
 
+// Most incoming messages handled per loop, so a flood from the computer can't hold up the keys.
+// A 24 PPQN clock at 300 beats per minute is only a few ticks per loop.
+const int MAX_MIDI_READS_PER_LOOP = 8;
+uint32_t sNumMidiReadsDeferred = 0;
+
 //====================================================================================================
-void updateMidi() {
-  // MIDI Controllers should discard incoming MIDI messages.
-  while (usbMIDI.read()) {
-    // read & ignore incoming messages
+void readMidiInput() {
+  // Only the clock (for the metronome) is used - everything else is discarded
+  uint32_t timeMicros = micros();
+  for (int i = 0; i != MAX_MIDI_READS_PER_LOOP; ++i) {
+    if (!usbMIDI.read())
+      return;
+    handleMidiClockMessage(usbMIDI.getType(), timeMicros);
   }
+  ++sNumMidiReadsDeferred;
+}
 
+//====================================================================================================
+void updateMidi() {
+  readMidiInput();
+  updateSideMidiControls();
+}
+
+//====================================================================================================
+// Pan and program for each side. MidiOut drops the values that haven't changed.
+void updateSideMidiControls() {
   int pans[2] = { -gSettings.stereo, gSettings.stereo };
 
   // Pan control (coarse). 0 is supposedly hard left, 64 center, 127 is hard right
   // That's weird, as it means there's a different range on left and right!
   for (int side = 0; side != 2; ++side) {
     gState.mMidiPans[side] = 64 + (pans[side] * 63) / 100;
-    if (gState.mMidiPans[side] != gPrevState.mMidiPans[side]) {
-      usbMIDI.sendControlChange(10, gState.mMidiPans[side], gSettings.midiChannels[side]);
-      if (gPrevState.mMidiPans[side] != SYNC_VALUE)
-        Serial.printf("Pan %d = %d\n", side, gState.mMidiPans[side]);
-    }
+    if (gState.mMidiPans[side] != gPrevState.mMidiPans[side])
+      Serial.printf("Pan %d = %d\n", side, gState.mMidiPans[side]);
+    sendMidiControlChange(10, gState.mMidiPans[side], getSideMidiChannel(side));
 
     gState.mMidiInstruments[side] = gSettings.midiInstruments[side];
-    if (gState.mMidiInstruments[side] != gPrevState.mMidiInstruments[side]) {
-      if (gState.mMidiInstruments[side] != -1)
-        usbMIDI.sendProgramChange(gState.mMidiInstruments[side], gSettings.midiChannels[side]);
-    }
+    if (gState.mMidiInstruments[side] != -1)
+      sendMidiProgramChange(gState.mMidiInstruments[side], getSideMidiChannel(side));
   }
 }
 
 //====================================================================================================
-void playNote(int midiNote, byte velocity, const int midiChannel, byte playingNotes[]) {
+// Sends on the side's channel, or with MPE, on the note's own channel
+void sendSideNoteOn(int side, int midiNote, int velocity) {
+  if (isMpeEnabled())
+    startMpeNote(side, midiNote, velocity);
+  else
+    sendMidiNoteOn(midiNote, velocity, gSettings.midiChannels[side]);
+}
+
+//====================================================================================================
+void sendSideNoteOff(int side, int midiNote, int velocity) {
+  if (isMpeEnabled())
+    stopMpeNote(side, midiNote, velocity);
+  else
+    sendMidiNoteOff(midiNote, velocity, gSettings.midiChannels[side]);
+}
+
+//====================================================================================================
+void playNote(int midiNote, byte velocity, int side, ActiveNoteSet& playingNotes) {
   if (midiNote > 0 && midiNote <= 127) {
-    usbMIDI.sendNoteOn(midiNote, velocity, midiChannel);
+    sendSideNoteOn(side, midiNote, velocity);
     if (velocity > 0) {
-      ++playingNotes[midiNote];
+      playingNotes.add(midiNote);
     }
   }
 }
 
 //====================================================================================================
-void stopNote(int midiNote, byte velocity, const int midiChannel, byte playingNotes[]) {
+void stopNote(int midiNote, byte velocity, int side, ActiveNoteSet& playingNotes) {
   if (midiNote > 0 && midiNote <= 127) {
-    if (playingNotes[midiNote] > 0)
-      --playingNotes[midiNote];
-    if (playingNotes[midiNote] <= 0)
-      usbMIDI.sendNoteOff(midiNote, velocity, midiChannel);
+    playingNotes.remove(midiNote);
+    if (!playingNotes.contains(midiNote))
+      sendSideNoteOff(side, midiNote, velocity);
   }
 }
 
@@ -274,49 +432,191 @@ void stopNote(int midiNote, byte velocity, const int midiChannel, byte playingNo
 void stopAllNotes() {
   // Serial.println("All notes off");
   for (int side = 0; side != 2; ++side) {
-    usbMIDI.sendControlChange(0x7B, 0, gSettings.midiChannels[side]);  // 123
-    for (int iKey = 0; iKey != PinInputs::keyCounts[side]; ++iKey)
-      gBigState.previousActiveKeys(side)[iKey] = 0;
-    for (int midi = gSettings.midiMin; midi <= gSettings.midiMax; ++midi) {
-      gBigState.mPlayingNotes[side][midi] = 0;
-    }
+    if (isMpeEnabled())
+      stopAllMpeNotes(side);
+    sendMidiAllNotesOff(getSideMidiChannel(side));
+    gBigState.previousActiveKeys(side) = 0;
+    gBigState.mPlayingNotes[side].clear();
   }
+  gBigState.keys<LEFT>().clearSoundingNotes();
+  gBigState.keys<RIGHT>().clearSoundingNotes();
+  gBigState.mPlayingBellowsState = BELLOWS_STATE_STATIONARY;
+}
+
+//====================================================================================================
+int getTranspose(int side) {
+  return gSettings.transpose + gSettings.octave[side] * 12;
+}
+
+//====================================================================================================
+// Rebuilds the key to note tables if the layout or transpose has changed
+void updateEffectiveNotes() {
+  NoteLayout& layout = gBigState.mNoteLayout;
+  gBigState.keys<LEFT>().updateEffectiveNotes(layout.open(LEFT), layout.close(LEFT), getTranspose(LEFT));
+  gBigState.keys<RIGHT>().updateEffectiveNotes(layout.open(RIGHT), layout.close(RIGHT), getTranspose(RIGHT));
 }
 
 //====================================================================================================
-int getMidiNoteForKey(int iKey, const byte* noteLayoutOpen, const byte* noteLayoutClose, int transpose) {
+// Plays/stops the keys that have changed since they were last played. Only the changed bits are
+// visited, so the cost depends on the number of changes, not the number of keys.
+// Returns the number of keys played/stopped.
+template<int SIDE>
+int playKeys(int velocity, int offVelocity) {
+  SideKeys<SIDE>& keys = gBigState.keys<SIDE>();
+  ActiveNoteSet& playingNotes = gBigState.mPlayingNotes[SIDE];
+
+  KeyMask changedKeys = (keys.mActiveKeys ^ keys.mPreviousActiveKeys) & SideKeys<SIDE>::ALL_KEYS;
+  // Only start playing if there is some bellows action. Previous activity is only updated when
+  // there is bellows motion - otherwise pressing a key with the bellows stationary can result in
+  // losing the note.
   if (gState.mBellowsState == BELLOWS_STATE_STATIONARY)
-    return -1;
-  int midiNote = gState.mBellowsState == BELLOWS_STATE_OPENING ? noteLayoutOpen[iKey] : noteLayoutClose[iKey];
-  if (midiNote > 0 && midiNote <= 127) {
-    midiNote += transpose;
-    if (midiNote > 0 && midiNote <= 127) {
-      return midiNote;
+    changedKeys &= keys.mPreviousActiveKeys;
+
+  int numPlayed = countKeys(changedKeys);
+  while (changedKeys) {
+    int iKey = popFirstKey(changedKeys);
+    // Releases stop the note that was started, which may be from before the bellows stopped or
+    // the transpose changed
+    if (keys.mActiveKeys & keyBit(iKey)) {
+      int midiNote = keys.getEffectiveNote(iKey, gState.mBellowsState);
+      playNote(midiNote, velocity, SIDE, playingNotes);
+      if (showNoteTrace && midiNote > 0)
+        Serial.printf("note %lu %c %s %d\n", (unsigned long)millis(), SIDE == LEFT ? 'L' : 'R',
+                      gState.mBellowsState == BELLOWS_STATE_OPENING ? "open" : "close",
+                      midiNote - keys.mEffectiveTranspose);
+      keys.mSoundingNotes[iKey] = velocity > 0 ? midiNote : 0;
+    } else {
+      stopNote(keys.mSoundingNotes[iKey], offVelocity, SIDE, playingNotes);
+      keys.mSoundingNotes[iKey] = 0;
     }
+    keys.mPreviousActiveKeys ^= keyBit(iKey);
   }
-  return -1;
+  return numPlayed;
 }
 
 //====================================================================================================
-void playKeys(
-  const byte activeKeys[], byte previousActiveKeys[], const int keyCount, const int midiChannel,
-  const byte* noteLayoutOpen, const byte* noteLayoutClose, byte playingNotes[],
-  int velocity, int offVelocity, int transpose) {
-  for (int iKey = 0; iKey != keyCount; ++iKey) {
-    if (activeKeys[iKey] && !previousActiveKeys[iKey]) {
-      if (gState.mBellowsState != BELLOWS_STATE_STATIONARY) {
-        // Start playing, but only if there is some bellows action.
-        playNote(getMidiNoteForKey(iKey, noteLayoutOpen, noteLayoutClose, transpose), velocity, midiChannel, playingNotes);
-        // Only update previous activity if there is bellows motion - otherwise pressing a key with
-        // the bellows stationary can result in losing the note.
-        previousActiveKeys[iKey] = activeKeys[iKey];
-      }
-    } else if (!activeKeys[iKey] && previousActiveKeys[iKey]) {
-      // Stop playing
-      stopNote(getMidiNoteForKey(iKey, noteLayoutOpen, noteLayoutClose, transpose), offVelocity, midiChannel, playingNotes);
-      previousActiveKeys[iKey] = activeKeys[iKey];
+// Switches the playing notes on one side over to a new bellows direction. The notes that the held
+// keys play in each direction are compared as sets, so a note that's still wanted (from any key)
+// keeps sounding, and only notes that come or go are sent. Returns the number of messages sent.
+template<int SIDE>
+int reversePlayingNotes(BellowsState newBellowsState, int& numNotes) {
+  const int side = SIDE;
+  SideKeys<SIDE>& keys = gBigState.keys<SIDE>();
+  ActiveNoteSet& playingNotes = gBigState.mPlayingNotes[side];
+
+  ActiveNoteSet newPlayingNotes;
+  numNotes = 0;
+  for (KeyMask heldKeys = keys.mPreviousActiveKeys; heldKeys;) {
+    int iKey = popFirstKey(heldKeys);
+    int midiNote = keys.getEffectiveNote(iKey, newBellowsState);
+    keys.mSoundingNotes[iKey] = midiNote;
+    if (midiNote > 0) {
+      newPlayingNotes.add(midiNote);
+      ++numNotes;
     }
   }
+
+  // Stop before starting, as the synth might have a limited number of voices
+  int numMessages = 0;
+  const NoteMask oldNotes = playingNotes.getMask();
+  const NoteMask& newNotes = newPlayingNotes.getMask();
+  oldNotes.without(newNotes).forEach([&](int midiNote) {
+    sendSideNoteOff(side, midiNote, gSettings.noteOffVelocity[side]);
+    playingNotes.setCount(midiNote, 0);
+    ++numMessages;
+  });
+  int velocity = getVelocity(side);
+  newNotes.without(oldNotes).forEach([&](int midiNote) {
+    sendSideNoteOn(side, midiNote, velocity);
+    ++numMessages;
+  });
+  newNotes.forEach([&](int midiNote) {
+    playingNotes.setCount(midiNote, newPlayingNotes.getCount(midiNote));
+  });
+  return numMessages;
+}
+
+//====================================================================================================
+// Tracks the direction of the playing notes. If the bellows reverse (possibly via a short stop),
+// the notes are handed over with reversePlayingNotes. If they stay stopped, all notes are stopped.
+void updatePlayingBellowsState() {
+  static uint32_t numReversals = 0;
+  static int32_t numMessagesSaved = 0;  // Can go negative if most notes change
+
+  BellowsState playingState = gBigState.mPlayingBellowsState;
+  if (gState.mBellowsState == BELLOWS_STATE_STATIONARY) {
+    if (gPrevState.mBellowsState != BELLOWS_STATE_STATIONARY)
+      gBigState.mStationaryTimeMillis = gState.mLoopStartTimeMillis;
+    if (playingState != BELLOWS_STATE_STATIONARY
+        && gState.mLoopStartTimeMillis - gBigState.mStationaryTimeMillis >= sReversalHoldMillis)
+      stopAllNotes();
+    return;
+  }
+
+  if (playingState != BELLOWS_STATE_STATIONARY && playingState != gState.mBellowsState) {
+    // Stopping everything would send All Notes Off on each side, then restart every held note
+    int numMessages = 0, numMessagesStopAll = 2;
+    for (int side = 0; side != 2; ++side) {
+      int numNotes;
+      numMessages += side == LEFT ? reversePlayingNotes<LEFT>(gState.mBellowsState, numNotes)
+                                  : reversePlayingNotes<RIGHT>(gState.mBellowsState, numNotes);
+      numMessagesStopAll += numNotes;
+    }
+    ++numReversals;
+    numMessagesSaved += numMessagesStopAll - numMessages;
+    if (showReversals)
+      Serial.printf("Reversal: %d messages instead of %d. Total saved %ld over %lu reversals\n",
+                    numMessages, numMessagesStopAll, (long)numMessagesSaved, (unsigned long)numReversals);
+  }
+  gBigState.mPlayingBellowsState = gState.mBellowsState;
+}
+
+//====================================================================================================
+// Replaces gSettings with a slot or preset from the menu, in one go. Notes are stopped while the
+// old channels are still in place, since note offs have to go where the notes went. Held notes are
+// then moved to the new layout/transpose the same way as a bellows reversal, so notes that are
+// still wanted keep sounding. The program and pan changes go out ahead of the notes, and all of it
+// in the flush at the end of updateNotes.
+void applySettingsChanges() {
+  if (!hasPendingSettings())
+    return;
+  uint64_t changes = getPendingSettingsChanges();
+  uint64_t channelChanges = settingBit(SETTING_MIDI_MODE) | settingBit(SETTING_MIDI_CHANNEL_LEFT)
+                            | settingBit(SETTING_MIDI_CHANNEL_RIGHT);
+  if (isMpeEnabled())
+    channelChanges |= settingBit(SETTING_METRONOME_MIDI_CHANNEL);  // The zones stop short of it
+  const uint64_t noteChanges = settingBit(SETTING_NOTE_LAYOUT) | settingBit(SETTING_TRANSPOSE)
+                               | settingBit(SETTING_OCTAVE_LEFT) | settingBit(SETTING_OCTAVE_RIGHT);
+  if (changes & channelChanges)
+    stopAllNotes();  // Any keys still held start again on the new channels
+
+  applyPendingSettings();
+  if (isMpeZoneChangePending())
+    updateMpeZones();
+
+  updateSideMidiControls();
+  sendChangedMidiControls();
+
+  if (changes & noteChanges) {
+    syncNoteLayout();
+    updateEffectiveNotes();
+    BellowsState playingState = gBigState.mPlayingBellowsState;
+    if (playingState != BELLOWS_STATE_STATIONARY) {
+      int numNotes;
+      reversePlayingNotes<LEFT>(playingState, numNotes);
+      reversePlayingNotes<RIGHT>(playingState, numNotes);
+    }
+  }
+  if (showReversals)
+    Serial.printf("Settings applied: changes %08lx%08lx\n", (unsigned long)(changes >> 32), (unsigned long)changes);
+}
+
+//====================================================================================================
+int playSideKeys(int side, int velocity, int offVelocity) {
+  if (side == LEFT)
+    return playKeys<LEFT>(velocity, offVelocity);
+  else
+    return playKeys<RIGHT>(velocity, offVelocity);
 }
 
 //====================================================================================================
@@ -326,25 +626,39 @@ int getVelocity(int side) {
   int levels[2];
   convertBalanceToLevels(gSettings.balance, levels);
   return convertFractionToMidi(
-    gState.mModifiedPressure * (levels[side] / 100.0f) * (gSettings.maxVelocity[side] / 127.0f));
+    gState.mModifiedPressures[side] * (levels[side] / 100.0f) * (gSettings.maxVelocity[side] / 127.0f));
 }
 
 //====================================================================================================
 void playAllKeys() {
-  for (int side = 0; side != 2; ++side) {
-    int velocity = getVelocity(side);
-    int offVelocity = gSettings.noteOffVelocity[side];
-    int transpose = gSettings.transpose + gSettings.octave[side] * 12;
-    playKeys(gBigState.activeKeys(side), gBigState.previousActiveKeys(side),
-             PinInputs::keyCounts[side], gSettings.midiChannels[side],
-             gBigState.mNoteLayout.open(side), gBigState.mNoteLayout.close(side),
-             gBigState.mPlayingNotes[side],
-             velocity, offVelocity, transpose);
+  int velocities[2];
+  for (int side = 0; side != 2; ++side)
+    velocities[side] = getVelocity(side);
+
+  // Apply the changes from the background scanner in the order they happened, so that a quick
+  // press and release in one frame still plays
+  if (sUseTimerKeyScan) {
+    KeyEvent event;
+    while (gKeyEventQueue.pop(event)) {
+      int side = event.mSide;
+      if (event.mPressed)
+        gBigState.activeKeys(side) |= keyBit(event.mKey);
+      else
+        gBigState.activeKeys(side) &= ~keyBit(event.mKey);
+      if (playSideKeys(side, velocities[side], gSettings.noteOffVelocity[side])
+          && sNumPendingNoteTimes != MAX_PENDING_NOTE_TIMES)
+        sPendingNoteTimes[sNumPendingNoteTimes++] = event.mTimeMicros;
+    }
   }
+
+  // This picks up keys that are waiting for bellows movement, or that need replaying after a
+  // reversal
+  for (int side = 0; side != 2; ++side)
+    playSideKeys(side, velocities[side], gSettings.noteOffVelocity[side]);
 }
 
 //====================================================================================================
-void readKeys(const byte rowPins[], const byte columnPins[], byte activeKeys[], uint32_t activeKeysTime[], int rowCount, int columnCount) {
+void readKeys(const byte rowPins[], const byte columnPins[], KeyMask& activeKeys, uint32_t activeKeysTime[], int rowCount, int columnCount) {
   uint32_t currentMillis = millis();
 
   for (int iColumn = 0; iColumn != columnCount; ++iColumn) {
@@ -365,12 +679,12 @@ void readKeys(const byte rowPins[], const byte columnPins[], byte activeKeys[],
       byte keyState = !digitalRead(rowPin);
 
       if (keyState == HIGH) {
-        activeKeys[iKey] = 1;
+        activeKeys |= keyBit(iKey);
         activeKeysTime[iKey] = currentMillis;
       }
 
       if (keyState == LOW && int(currentMillis - activeKeysTime[iKey]) >= gSettings.debounceTime) {
-        activeKeys[iKey] = 0;
+        activeKeys &= ~keyBit(iKey);
       }
       pinMode(rowPin, INPUT);
     }
@@ -378,13 +692,48 @@ void readKeys(const byte rowPins[], const byte columnPins[], byte activeKeys[],
   }
 }
 
+//====================================================================================================
+// Same as readKeys, but the whole matrix side is read with port reads first
+template<int SIDE>
+void readKeysFast() {
+  SideKeys<SIDE>& keys = gBigState.keys<SIDE>();
+  uint32_t currentMillis = millis();
+
+  uint32_t columnRowBits[SideKeys<SIDE>::COLUMN_COUNT];
+  recordKeyScanTime(SIDE, scanKeyMatrix(SIDE, columnRowBits));
+  KeyMask pressedKeys = toKeyMask<SideKeys<SIDE>::ROW_COUNT, SideKeys<SIDE>::COLUMN_COUNT>(columnRowBits);
+
+  for (KeyMask pressed = pressedKeys; pressed;)
+    keys.mActiveKeysTime[popFirstKey(pressed)] = currentMillis;
+
+  for (KeyMask released = keys.mActiveKeys & ~pressedKeys; released;) {
+    int iKey = popFirstKey(released);
+    if (int(currentMillis - keys.mActiveKeysTime[iKey]) < gSettings.debounceTime)
+      pressedKeys |= keyBit(iKey);
+  }
+  keys.mActiveKeys = pressedKeys;
+}
+
 //====================================================================================================
 void readAllKeys() {
-  for (int side = 0; side != 2; ++side) {
-    readKeys(
-      PinInputs::rowPins(side), PinInputs::columnPins(side), gBigState.activeKeys(side),
-      gBigState.activeKeysTimes(side), PinInputs::rowCounts[side], PinInputs::columnCounts[side]);
+  if (sUseTimerKeyScan) {
+    // The scanning happens in the background, so just keep its configuration up to date
+    updateKeyScanTimer(gSettings.keyScanRate, gSettings.debounceTime, gSettings.keyScanMode);
+    return;
   }
+  if (sUseFastKeyScan) {
+    readKeysFast<LEFT>();
+    readKeysFast<RIGHT>();
+    return;
+  }
+  uint32_t startMicros = micros();
+  readKeys(PinInputs::rowPinsLeft, PinInputs::columnPinsLeft, gBigState.mKeysLeft.mActiveKeys,
+           gBigState.mKeysLeft.mActiveKeysTime, PinInputs::rowCounts[LEFT], PinInputs::columnCounts[LEFT]);
+  recordKeyScanTime(LEFT, micros() - startMicros);
+  startMicros = micros();
+  readKeys(PinInputs::rowPinsRight, PinInputs::columnPinsRight, gBigState.mKeysRight.mActiveKeys,
+           gBigState.mKeysRight.mActiveKeysTime, PinInputs::rowCounts[RIGHT], PinInputs::columnCounts[RIGHT]);
+  recordKeyScanTime(RIGHT, micros() - startMicros);
 }
 
 //====================================================================================================
@@ -413,9 +762,90 @@ void hardwareTest() {
 
   lastHardwareTestPrintTime = millis();
 
+  if (showKeyScanTiming) {
+    // Paired scans interleave the sides, so there's only the whole matrix time
+    if (!sUseTimerKeyScan || gSettings.keyScanMode != KEY_SCAN_MODE_PAIRED)
+      Serial.printf("Key scan (%s) left: %5.1fus (worst %5.1fus) right: %5.1fus (worst %5.1fus)\n",
+                    sUseTimerKeyScan ? "timer" : (sUseFastKeyScan ? "ports" : "digitalRead"),
+                    gKeyScanTiming.mAverageMicros[LEFT], gKeyScanTiming.mWorstMicros[LEFT],
+                    gKeyScanTiming.mAverageMicros[RIGHT], gKeyScanTiming.mWorstMicros[RIGHT]);
+    if (sUseTimerKeyScan) {
+      Serial.printf("Key scan whole matrix (%s): %5.1fus (worst %5.1fus)\n",
+                    gKeyScanModeNames[gSettings.keyScanMode],
+                    gKeyScanTiming.mAverageTotalMicros, gKeyScanTiming.mWorstTotalMicros);
+      Serial.printf("Key debounce: %5.1fus (worst %5.1fus) bounces left: %lu right: %lu\n",
+                    gKeyScanTiming.mAverageDebounceMicros, gKeyScanTiming.mWorstDebounceMicros,
+                    (unsigned long)getNumKeyBounces(LEFT), (unsigned long)getNumKeyBounces(RIGHT));
+      Serial.printf("Key events dropped: %lu\n", (unsigned long)gKeyEventQueue.numDropped());
+    }
+    resetKeyScanWorstTimes();
+  }
+
+  if (showKeyTrace && sUseTimerKeyScan) {
+    if (isKeyTraceComplete())
+      printKeyTrace();
+    else
+      startKeyTrace();
+  }
+
+  if (showNoteLatency) {
+    LatencyStats<256>::Summary latency = gBigState.mNoteLatency.summarise();
+    Serial.printf("Note latency (%s, %d notes): min %luus median %luus p99 %luus max %luus\n",
+                  gSettings.immediateNotes ? "immediate" : "end of frame", latency.mCount,
+                  (unsigned long)latency.mMin, (unsigned long)latency.mMedian,
+                  (unsigned long)latency.mP99, (unsigned long)latency.mMax);
+  }
+
+  if (showMidiOut) {
+    if (isMpeEnabled())
+      Serial.printf("MPE channel steals left: %lu right: %lu\n",
+                    (unsigned long)getMpeNumSteals(LEFT), (unsigned long)getMpeNumSteals(RIGHT));
+    const MidiOutStats& stats = getMidiOutStats();
+    Serial.printf("MIDI out: notes %lu controls %lu. Suppressed: coalesced %lu duplicate %lu. Over budget %lu\n",
+                  (unsigned long)stats.mNumNotesSent, (unsigned long)stats.mNumControlsSent,
+                  (unsigned long)stats.mNumControlsCoalesced, (unsigned long)stats.mNumControlsDropped,
+                  (unsigned long)stats.mNumFlushesOverBudget);
+  }
+
+  if (showMidiClock) {
+    const ClockPll& pll = getMidiClockPll();
+    Serial.printf("MIDI clock: %s%s tick %ld bpm %.2f jitter %.0fus. Reads deferred %lu\n",
+                  pll.isLocked() ? "locked" : "unlocked", isMetronomeSynced() ? " synced" : "",
+                  (long)pll.getTickIndex(), pll.getBeatsPerMinute(), pll.getJitterMicros(),
+                  (unsigned long)sNumMidiReadsDeferred);
+  }
+
+  if (showDisplayFlush) {
+    const DisplayFlushStats& stats = getDisplayFlushStats();
+    Serial.printf("Display flush: %lu flushes of %lu bytes, coalesced %lu errors %lu. Last %luus worst %luus. Worst start %luus\n",
+                  (unsigned long)stats.mNumFlushes, (unsigned long)stats.mBytesPerFlush,
+                  (unsigned long)stats.mNumCoalesced, (unsigned long)stats.mNumErrors,
+                  (unsigned long)stats.mLastFlushMicros, (unsigned long)stats.mWorstFlushMicros,
+                  (unsigned long)stats.mWorstStartMicros);
+  }
+
+  if (showSettingsWriter) {
+    const SettingsWriterStats& stats = getSettingsWriterStats();
+    Serial.printf("Settings writer: %s writes %lu chunks %lu failures %lu. Worst step %luus blocking %luus\n",
+                  isSettingsWritePending() ? "pending" : "idle", (unsigned long)stats.mNumWrites,
+                  (unsigned long)stats.mNumChunks, (unsigned long)stats.mNumFailures,
+                  (unsigned long)stats.mWorstStepMicros, (unsigned long)stats.mWorstBlockingMicros);
+    Serial.printf("Settings load/save: image %lu/%luus JSON %lu/%luus\n",
+                  (unsigned long)stats.mImageReadMicros, (unsigned long)stats.mImageWriteMicros,
+                  (unsigned long)stats.mJsonReadMicros, (unsigned long)stats.mJsonWriteMicros);
+  }
+
+  if (showPressureFilter && sPressureTraceLength == PRESSURE_TRACE_LENGTH) {
+    printPressureFilterReport();
+    sPressureTraceLength = 0;
+  }
+
   if (showBellows) {
     Serial.println("Bellows");
+    Serial.println(gState.mRawPressure);
     Serial.println(gState.mPressure);
+    Serial.println(gState.mPressureRate);
+    Serial.println(gSettings.zeroLoadReading);
     Serial.println(gState.mModifiedPressure);
     Serial.println(gState.mBellowsState);
   }
@@ -425,7 +855,7 @@ void hardwareTest() {
     for (int j = 0; j != PinInputs::columnCounts[LEFT]; ++j) {
       for (int i = 0; i < PinInputs::rowCounts[LEFT]; i++) {
         int iKey = INDEX_LEFT(i, j);
-        Serial.print(gBigState.mActiveKeysLeft[iKey]);
+        Serial.print(gBigState.isKeyActive(LEFT, iKey));
         Serial.print(" (");
         Serial.print(gState.mBellowsState == BELLOWS_STATE_OPENING ? gBigState.mNoteLayout.mLeftOpen[iKey] : gBigState.mNoteLayout.mLeftClose[iKey]);
         Serial.print(")");
@@ -437,7 +867,7 @@ void hardwareTest() {
     for (int j = 0; j != PinInputs::columnCounts[RIGHT]; ++j) {
       for (int i = 0; i < PinInputs::rowCounts[RIGHT]; i++) {
         int iKey = INDEX_RIGHT(i, j);
-        Serial.print(gBigState.mActiveKeysRight[iKey]);
+        Serial.print(gBigState.isKeyActive(RIGHT, iKey));
         Serial.print(" (");
         Serial.print(gState.mBellowsState == BELLOWS_STATE_OPENING ? gBigState.mNoteLayout.mRightOpen[iKey] : gBigState.mNoteLayout.mRightClose[iKey]);
         Serial.print(")");
@@ -449,22 +879,13 @@ void hardwareTest() {
   }
 
   if (showPlayingNotes) {
-    Serial.print("Playing notes left: ");
-    for (int i = gSettings.midiMin; i <= gSettings.midiMax; ++i) {
-      if (gBigState.mPlayingNotes[LEFT][i]) {
-        NoteInfo noteInfo = getNoteInfo(
-          i, CLEF_TREBLE, gSettings.accidentalPreference, gSettings.accidentalKey);
-        Serial.printf("%s ", noteInfo.mName);
-      }
-    }
-    Serial.println();
-    Serial.print("Playing notes right: ");
-    for (int i = gSettings.midiMin; i <= gSettings.midiMax; ++i) {
-      if (gBigState.mPlayingNotes[RIGHT][i]) {
+    for (int side = 0; side != 2; ++side) {
+      Serial.print(side == LEFT ? "Playing notes left: " : "Playing notes right: ");
+      gBigState.mPlayingNotes[side].forEach([](int midiNote) {
         NoteInfo noteInfo = getNoteInfo(
-          i, CLEF_TREBLE, gSettings.accidentalPreference, gSettings.accidentalKey);
+          midiNote, CLEF_TREBLE, gSettings.accidentalPreference, gSettings.accidentalKey);
         Serial.printf("%s ", noteInfo.mName);
-      }
+      });
       Serial.println();
     }
   }
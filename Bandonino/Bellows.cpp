@@ -2,51 +2,174 @@
 #include "State.h"
 #include "Settings.h"
 
-// https://github.com/bogde/HX711
-#include <HX711.h>
+#include <Arduino.h>
 
+#include <algorithm>
+
+//====================================================================================================
+// The HX711 signals that a sample is ready by pulling DOUT low. That edge triggers an interrupt
+// which clocks the 24 bit sample out, so nothing ever has to wait for the load cell.
 //====================================================================================================
-HX711 loadcell;
 const long LOADCELL_OFFSET = 50682624;
 const long LOADCELL_DIVIDER = 5895655;
 
+// Gain 128 on channel A needs one extra clock pulse after the data
+const int LOADCELL_GAIN_PULSES = 1;
+
+// If a data ready edge is missed (e.g. DOUT was already low when the interrupt was attached), then
+// the sample is read by the loop after this long
+const uint32_t LOADCELL_STALL_MICROS = 50000;
+
+// Load cell counts for a pressure of 1, at 100% gain
+const float LOADCELL_COUNTS_PER_PRESSURE = 500000.0f;
+
+// Auto zero - the zero reading follows the load cell while the bellows are idle and quiet
+const int AUTO_ZERO_QUIET_SAMPLES = 40;      // About 0.5s of quiet before tracking starts
+const float AUTO_ZERO_MAX_PRESSURE = 0.05f;  // More than this is taken to be the bellows moving
+const float AUTO_ZERO_MAX_CHANGE = 0.005f;   // Largest change between samples that's still quiet
+const float AUTO_ZERO_RATE = 0.0125f;        // Fraction of the error corrected each sample
+const float AUTO_ZERO_MAX_SLEW = 0.0002f;    // Most the zero can move each sample, as pressure
+
+static volatile LoadCellSample sLatestSample;
+static uint32_t sLastSequence = 0;
+
+static int sNumQuietSamples = 0;
+static long sPreviousReading = 0;
+static float sTrackedZero = 0.0f;  // Unrounded zero reading
+static long sTrackedZeroReading = LONG_MAX;
+
+//====================================================================================================
+// Clocks out the sample. Called from the data ready interrupt, or the loop if that stalls.
+static void readLoadCell() {
+  // SCK must not stay high for more than 60us, or the HX711 powers down. Masking first also means
+  // that when the loop calls this, the interrupt can't take the sample between the check and the
+  // clocking.
+  noInterrupts();
+
+  // DOUT changes while the data is clocked out, which triggers more interrupts. Those can be
+  // ignored, since the data is only ready when DOUT is low, and it goes high after the last pulse.
+  if (digitalReadFast(LOADCELL_DOUT_PIN)) {
+    interrupts();
+    return;
+  }
+
+  uint32_t timeMicros = micros();
+  uint32_t value = 0;
+  for (int i = 0; i != 24 + LOADCELL_GAIN_PULSES; ++i) {
+    digitalWriteFast(LOADCELL_SCK_PIN, HIGH);
+    delayNanoseconds(400);
+    if (i < 24)
+      value = (value << 1) | digitalReadFast(LOADCELL_DOUT_PIN);
+    digitalWriteFast(LOADCELL_SCK_PIN, LOW);
+    delayNanoseconds(400);
+  }
+
+  // Sign extend the 24 bit two's complement value
+  sLatestSample.mReading = (long)((int32_t)(value << 8) >> 8);
+  sLatestSample.mTimeMicros = timeMicros;
+  sLatestSample.mSequence = sLatestSample.mSequence + 1;
+  interrupts();
+}
+
+//====================================================================================================
+LoadCellSample getLoadCellSample() {
+  LoadCellSample sample;
+  noInterrupts();
+  sample.mReading = sLatestSample.mReading;
+  sample.mTimeMicros = sLatestSample.mTimeMicros;
+  sample.mSequence = sLatestSample.mSequence;
+  interrupts();
+
+  // Recover if the data ready edge was missed
+  if (micros() - sample.mTimeMicros > LOADCELL_STALL_MICROS && !digitalReadFast(LOADCELL_DOUT_PIN))
+    readLoadCell();
+  return sample;
+}
+
+//====================================================================================================
+// Blocks until there is a sample newer than sequence, or timeout. Only for use outside of playing.
+static bool waitForLoadCellSample(uint32_t sequence, uint32_t timeoutMillis, LoadCellSample& sample) {
+  uint32_t startMillis = millis();
+  do {
+    sample = getLoadCellSample();
+    if (sample.mSequence != sequence)
+      return true;
+  } while (millis() - startMillis < timeoutMillis);
+  return false;
+}
+
 //====================================================================================================
 void initBellows() {
   // Initialise the loadcell
-  loadcell.begin(LOADCELL_DOUT_PIN, LOADCELL_SCK_PIN);
+  pinMode(LOADCELL_SCK_PIN, OUTPUT);
+  digitalWriteFast(LOADCELL_SCK_PIN, LOW);
+  pinMode(LOADCELL_DOUT_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(LOADCELL_DOUT_PIN), readLoadCell, FALLING);
+
+  LoadCellSample sample;
+  if (!waitForLoadCellSample(0, 1000, sample))
+    Serial.println("No response from the load cell");
 
-  while (!loadcell.is_ready()) {
-  }
   //Zero scale
   if (gSettings.zeroLoadReading == LONG_MAX) {
     zeroBellows();
   } else {
     Serial.printf("Re-using zero bellows reading %d\n", gSettings.zeroLoadReading);
   }
-  gState.mPressure = 0;
+  gState.mRawPressure = 0;
 }
 
 //====================================================================================================
 void zeroBellows() {
-  while (!loadcell.is_ready()) {
-  }
-  gSettings.zeroLoadReading = loadcell.read();
+  // Use a fresh sample, in case the bellows were moving when the last one was taken
+  LoadCellSample sample;
+  waitForLoadCellSample(getLoadCellSample().mSequence, 100, sample);
+  gSettings.zeroLoadReading = sample.mReading;
   Serial.printf("Zero bellows reading measured as %d\n", gSettings.zeroLoadReading);
-  gSettings.writeToCard();
+  markSettingsDirty();
 }
 
 //====================================================================================================
-void updateBellows() {
-
-  if (gSettings.zeroLoadReading == LONG_MAX) {
+bool updateBellows() {
+  if (gSettings.zeroLoadReading == LONG_MAX)
     zeroBellows();
-  } else {
-    while (!loadcell.is_ready()) {
-    }
-  }
-  const float loadScale = 500000.0f;
-  gState.mLoadReading = loadcell.read();
-  gSettings.zeroLoadReading -= gSettings.zeroLoadOffset * loadScale / 100;
+
+  LoadCellSample sample = getLoadCellSample();
+  bool isNewSample = sample.mSequence != sLastSequence;
+  sLastSequence = sample.mSequence;
+
+  gState.mLoadReading = sample.mReading;
+  gState.mLoadSampleTimeMicros = sample.mTimeMicros;
+  gSettings.zeroLoadReading -= gSettings.zeroLoadOffset * LOADCELL_COUNTS_PER_PRESSURE / 100;
   gSettings.zeroLoadOffset = 0;
-  gState.mPressure = -((gState.mLoadReading - gSettings.zeroLoadReading) * (gSettings.pressureGain / 100.0f)) / 500000.0f;
+  gState.mRawPressure = -((gState.mLoadReading - gSettings.zeroLoadReading) * (gSettings.pressureGain / 100.0f)) / LOADCELL_COUNTS_PER_PRESSURE;
+  return isNewSample;
+}
+
+//====================================================================================================
+void trackBellowsZero(bool isIdle) {
+  long reading = gState.mLoadReading;
+  float countsPerPressure = LOADCELL_COUNTS_PER_PRESSURE * 100.0f / gSettings.pressureGain;
+  float change = fabsf((float)(reading - sPreviousReading)) / countsPerPressure;
+  sPreviousReading = reading;
+
+  bool isQuiet = isIdle && change < AUTO_ZERO_MAX_CHANGE && fabsf(gState.mRawPressure) < AUTO_ZERO_MAX_PRESSURE;
+  if (!gSettings.autoZero || !isQuiet || gSettings.zeroLoadReading == LONG_MAX) {
+    sNumQuietSamples = 0;
+    return;
+  }
+  if (sNumQuietSamples < AUTO_ZERO_QUIET_SAMPLES) {
+    ++sNumQuietSamples;
+    return;
+  }
+
+  // Start again from the stored zero if something else has changed it
+  if (gSettings.zeroLoadReading != sTrackedZeroReading)
+    sTrackedZero = (float)gSettings.zeroLoadReading;
+
+  float maxSlew = AUTO_ZERO_MAX_SLEW * countsPerPressure;
+  float correction = std::clamp((reading - sTrackedZero) * AUTO_ZERO_RATE, -maxSlew, maxSlew);
+  sTrackedZero += correction;
+  sTrackedZeroReading = lroundf(sTrackedZero);
+  gSettings.zeroLoadReading = sTrackedZeroReading;
 }
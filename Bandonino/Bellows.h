@@ -1,10 +1,28 @@
 #ifndef BELLOWS_H
 #define BELLOWS_H
 
+#include <stdint.h>
+
+// A raw reading from the load cell, published by the data ready interrupt
+struct LoadCellSample {
+  long mReading = 0;
+  uint32_t mTimeMicros = 0;  // When the sample became ready
+  uint32_t mSequence = 0;    // Incremented for each new sample
+};
+
 void initBellows();
 
-void updateBellows();
+// Updates the pressure from the latest load cell sample. This never waits for the load cell.
+// Returns true if there has been a new sample since the last call.
+bool updateBellows();
 
 void zeroBellows();
 
+// Call after updateBellows returns a new sample. While isIdle (no keys held) and the load cell is
+// quiet, the zero reading is slowly moved to follow drift. This never writes the settings to the card.
+void trackBellowsZero(bool isIdle);
+
+// Returns a copy of the latest sample
+LoadCellSample getLoadCellSample();
+
 #endif
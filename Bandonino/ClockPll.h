@@ -0,0 +1,169 @@
+#ifndef CLOCKPLL_H
+#define CLOCKPLL_H
+
+#include <math.h>
+#include <stdint.h>
+
+// Follows an incoming MIDI clock (24 ticks per quarter note). The ticks are timestamped when
+// they're read, so they carry the USB and loop jitter. A second order phase locked loop smooths
+// this out, giving a steady tick period and phase that the metronome can schedule beats from.
+//
+// Every tick is counted, but ticks that arrive well away from where they were expected (because
+// the loop was held up) don't move the estimate. If that keeps happening, or there's a long gap, it
+// starts acquiring again.
+//
+// There are no hardware dependencies, so it can be fed synthetic clock streams offline - see
+// Tools/ClockPllTest.cpp.
+class ClockPll {
+public:
+  // Fastest and slowest tick periods accepted - about 300 and 20 beats per minute
+  static constexpr float MIN_TICK_MICROS = 8000.0f;
+  static constexpr float MAX_TICK_MICROS = 125000.0f;
+
+  // Forgets the clock completely
+  void reset() {
+    mNumTicks = 0;
+    mTickPeriod = 0.0f;
+    mTickIndex = -1;
+    mLocked = false;
+  }
+
+  // MIDI Start - the next tick is the first of the song. Keeps the tempo.
+  void startCount() {
+    mTickIndex = -1;
+  }
+
+  void addTick(uint32_t timeMicros) {
+    ++mTickIndex;
+    ++mTicksSinceAcquire;
+    if (mNumTicks == 0) {
+      acquire(timeMicros);
+      return;
+    }
+    float interval = (float)(int32_t)(timeMicros - mRawTickMicros);
+
+    if (mNumTicks == 1) {
+      // Keep the old tempo if this looks the same, so a restarted clock locks quickly
+      if (mTickPeriod == 0.0f || fabsf(interval - mTickPeriod) > 0.25f * mTickPeriod)
+        mTickPeriod = interval;
+      if (mTickPeriod < MIN_TICK_MICROS || mTickPeriod > MAX_TICK_MICROS) {
+        mTickPeriod = 0.0f;
+        acquire(timeMicros);
+        return;
+      }
+      mJitter = 0.0f;
+      accept(timeMicros, 0.0f);
+      return;
+    }
+
+    if (interval > 2 * MAX_TICK_MICROS) {
+      // The clock stopped for a while
+      mLocked = false;
+      acquire(timeMicros);
+      return;
+    }
+
+    float error = interval - mOffset - mTickPeriod;
+    if (fabsf(error) > MAX_ERROR * mTickPeriod) {
+      // Held up (e.g. by a slow loop), or bunched up behind one that was. Take the tick as being
+      // where it was expected, unless this keeps happening, in which case the tempo has jumped.
+      if (++mNumOutliers >= MAX_OUTLIERS) {
+        mLocked = false;
+        mTickPeriod = 0.0f;
+        acquire(timeMicros);
+        return;
+      }
+      mOffset = mOffset + mTickPeriod - interval;
+      mRawTickMicros = timeMicros;
+      return;
+    }
+    accept(timeMicros, error);
+  }
+
+  bool isLocked() const {
+    return mLocked;
+  }
+
+  // Index of the last tick since the start (or since the clock was picked up), -1 before the first
+  int32_t getTickIndex() const {
+    return mTickIndex;
+  }
+
+  float getTickPeriodMicros() const {
+    return mTickPeriod;
+  }
+
+  float getBeatsPerMinute() const {
+    return mTickPeriod > 0.0f ? 60e6f / (mTickPeriod * TICKS_PER_BEAT) : 0.0f;
+  }
+
+  // Average difference between when the ticks arrived and when the loop expected them
+  float getJitterMicros() const {
+    return mJitter;
+  }
+
+  // Smoothed time of the tick at tickIndex (which can be in the future)
+  uint32_t getTickTimeMicros(int32_t tickIndex) const {
+    float offset = mOffset + (tickIndex - mTickIndex) * mTickPeriod;
+    return mRawTickMicros + (int32_t)lroundf(offset);
+  }
+
+  static const int TICKS_PER_BEAT = 24;
+
+private:
+  // Loop gains once locked. The period gain is a quarter of the phase gain squared, so the loop
+  // is critically damped. The time constant is about 1 / PHASE_GAIN ticks.
+  static constexpr float PHASE_GAIN = 0.08f;
+  static constexpr float JITTER_RATE = 0.05f;
+  // Ticks after acquiring during which the gains start high and drop to the values above. Until
+  // then, the period is the average interval since acquiring, as the loop's period gain is too
+  // slow to correct a noisy first interval.
+  static const int ACQUIRE_TICKS = 24;
+  // Fraction of a period that a tick can be out by and still be used to correct the loop
+  static constexpr float MAX_ERROR = 0.3f;
+  static const int MAX_OUTLIERS = 6;
+
+  void acquire(uint32_t timeMicros) {
+    mRawTickMicros = timeMicros;
+    mAcquireMicros = timeMicros;
+    mTicksSinceAcquire = 0;
+    mOffset = 0.0f;
+    mNumTicks = 1;
+    mNumOutliers = 0;
+  }
+
+  void accept(uint32_t timeMicros, float error) {
+    float phaseGain = PHASE_GAIN;
+    if (mNumTicks < ACQUIRE_TICKS)
+      phaseGain = fmaxf(PHASE_GAIN, 2.0f / (mNumTicks + 1));
+    // The estimate moves from the prediction towards the tick, and is kept relative to the tick
+    mOffset = -(1.0f - phaseGain) * error;
+    if (mNumTicks < ACQUIRE_TICKS)
+      mTickPeriod = (float)(int32_t)(timeMicros - mAcquireMicros) / mTicksSinceAcquire;
+    else
+      mTickPeriod += (phaseGain * phaseGain / 4) * error;
+    mTickPeriod = fminf(fmaxf(mTickPeriod, MIN_TICK_MICROS), MAX_TICK_MICROS);
+    mRawTickMicros = timeMicros;
+    mJitter += (fabsf(error) - mJitter) * JITTER_RATE;
+    mNumOutliers = 0;
+    if (mNumTicks < ACQUIRE_TICKS)
+      ++mNumTicks;
+    else if (mJitter < 0.1f * mTickPeriod)
+      mLocked = true;
+    else if (mJitter > 0.2f * mTickPeriod)
+      mLocked = false;
+  }
+
+  uint32_t mRawTickMicros = 0;  // When the last tick arrived
+  uint32_t mAcquireMicros = 0;  // When the first tick since acquiring arrived
+  float mOffset = 0.0f;         // Smoothed time of the last tick, relative to mRawTickMicros
+  float mTickPeriod = 0.0f;
+  float mJitter = 0.0f;
+  int32_t mTickIndex = -1;
+  int mNumTicks = 0;            // Ticks used since acquiring, up to ACQUIRE_TICKS
+  int32_t mTicksSinceAcquire = 0;  // Including those that didn't fit
+  int mNumOutliers = 0;         // Consecutive ticks that didn't fit
+  bool mLocked = false;
+};
+
+#endif
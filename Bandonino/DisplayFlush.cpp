@@ -0,0 +1,149 @@
+#include "DisplayFlush.h"
+
+#include <Arduino.h>
+#include <Adafruit_SSD1327.h>
+#include <DMAChannel.h>
+#include <Wire.h>
+
+#include <algorithm>
+
+// 128x128 at 4 bits per pixel
+const int DISPLAY_WIDTH = 128;
+const int DISPLAY_HEIGHT = 128;
+const int DISPLAY_BUFFER_SIZE = DISPLAY_WIDTH * DISPLAY_HEIGHT / 2;
+
+// SSD1327 commands, and the I2C control bytes that say whether commands or data follow
+const uint8_t SSD1327_SET_COLUMN = 0x15;
+const uint8_t SSD1327_SET_ROW = 0x75;
+const uint8_t SSD1327_CONTROL_COMMANDS = 0x00;
+const uint8_t SSD1327_CONTROL_DATA = 0x40;
+
+// Set the window to the whole screen, then send the frame after a repeated start, and stop
+const int HEADER_WORDS = 10;
+const int TRANSMIT_WORDS = HEADER_WORDS + DISPLAY_BUFFER_SIZE + 1;
+
+// A transfer at 1MHz takes under 100ms. Anything longer means the DMA is stuck.
+const uint32_t FLUSH_TIMEOUT_MICROS = 250000;
+
+// Each word is written to LPI2C1_MTDR - a command in bits 8 to 10, and the data in bits 0 to 7
+DMAMEM static uint32_t sTransmitWords[TRANSMIT_WORDS] __attribute__((aligned(32)));
+
+static DMAChannel sDma;
+static Adafruit_SSD1327* sDisplay = nullptr;
+static bool sBusy = false;
+static bool sPending = false;
+static uint32_t sStartMicros = 0;
+static volatile uint32_t sDmaDoneMicros = 0;
+static DisplayFlushStats sStats;
+
+//====================================================================================================
+static void dmaCompleteISR() {
+  sDmaDoneMicros = micros();
+  sDma.clearInterrupt();
+}
+
+//====================================================================================================
+void initDisplayFlush(Adafruit_SSD1327& display, uint8_t i2cAddress, uint32_t clockHz) {
+  sDisplay = &display;
+
+  // The header doesn't change
+  const uint32_t address = (uint32_t)i2cAddress << 1;
+  const uint32_t header[HEADER_WORDS] = {
+    LPI2C_MTDR_CMD_START | address, SSD1327_CONTROL_COMMANDS,
+    SSD1327_SET_COLUMN, 0, DISPLAY_WIDTH / 2 - 1,
+    SSD1327_SET_ROW, 0, DISPLAY_HEIGHT - 1,
+    LPI2C_MTDR_CMD_START | address, SSD1327_CONTROL_DATA
+  };
+  std::copy(header, header + HEADER_WORDS, sTransmitWords);
+  sTransmitWords[TRANSMIT_WORDS - 1] = LPI2C_MTDR_CMD_STOP;
+  sStats.mBytesPerFlush = TRANSMIT_WORDS - 1;  // Every word but the stop puts a byte on the bus
+
+  // Adafruit_SSD1327 drops the clock after each of its transfers, so set it for ours
+  Wire.setClock(clockHz);
+
+  sDma.begin(true);
+  sDma.destination(LPI2C1_MTDR);
+  sDma.triggerAtHardwareEvent(DMAMUX_SOURCE_LPI2C1);
+  sDma.disableOnCompletion();
+  sDma.interruptAtCompletion();
+  sDma.attachInterrupt(dmaCompleteISR);
+}
+
+//====================================================================================================
+static void abandonFlush() {
+  sDma.disable();
+  LPI2C1_MDER = 0;
+  LPI2C1_MCR |= LPI2C_MCR_RTF;
+  LPI2C1_MSR = LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF | LPI2C_MSR_SDF;
+  ++sStats.mNumErrors;
+  sBusy = false;
+}
+
+//====================================================================================================
+static void startFlush() {
+  uint32_t startMicros = micros();
+  sPending = false;
+
+  // Copy the frame, so it can be drawn over while this is sent
+  const uint8_t* frame = sDisplay->getBuffer();
+  uint32_t* words = sTransmitWords + HEADER_WORDS;
+  for (int i = 0; i != DISPLAY_BUFFER_SIZE; ++i)
+    words[i] = frame[i];
+  arm_dcache_flush(sTransmitWords, sizeof(sTransmitWords));
+
+  // Clear the flags from the last transfer, and let the empty FIFO request the first words
+  LPI2C1_MSR = LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF | LPI2C_MSR_SDF;
+  sDmaDoneMicros = 0;
+  sDma.sourceBuffer(sTransmitWords, sizeof(sTransmitWords));
+  sDma.enable();
+  LPI2C1_MDER = LPI2C_MDER_TDDE;
+
+  sBusy = true;
+  sStartMicros = startMicros;
+  ++sStats.mNumFlushes;
+  sStats.mWorstStartMicros = std::max(sStats.mWorstStartMicros, micros() - startMicros);
+}
+
+//====================================================================================================
+void flushDisplay() {
+  if (!sDisplay)
+    return;
+  updateDisplayFlush();
+  if (!sBusy) {
+    startFlush();
+  } else {
+    if (sPending)
+      ++sStats.mNumCoalesced;
+    sPending = true;
+  }
+}
+
+//====================================================================================================
+void updateDisplayFlush() {
+  if (sBusy) {
+    if (LPI2C1_MSR & (LPI2C_MSR_NDF | LPI2C_MSR_ALF | LPI2C_MSR_FEF)) {
+      abandonFlush();
+    } else if (sDmaDoneMicros && (LPI2C1_MSR & LPI2C_MSR_SDF)) {
+      // Everything has been queued, and the stop has gone out
+      LPI2C1_MDER = 0;
+      sBusy = false;
+      sStats.mLastFlushMicros = sDmaDoneMicros - sStartMicros;
+      sStats.mWorstFlushMicros = std::max(sStats.mWorstFlushMicros, sStats.mLastFlushMicros);
+    } else if (micros() - sStartMicros > FLUSH_TIMEOUT_MICROS) {
+      abandonFlush();
+    }
+  }
+  if (!sBusy && sPending)
+    startFlush();
+}
+
+//====================================================================================================
+void waitForDisplayFlush() {
+  while (sBusy || sPending)
+    updateDisplayFlush();
+}
+
+//====================================================================================================
+const DisplayFlushStats& getDisplayFlushStats() {
+  return sStats;
+}
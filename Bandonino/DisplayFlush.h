@@ -0,0 +1,44 @@
+#ifndef DISPLAYFLUSH_H
+#define DISPLAYFLUSH_H
+
+#include <stdint.h>
+
+class Adafruit_SSD1327;
+
+// Sends the SSD1327 frame buffer in the background, instead of display.display(), which blocks for
+// the whole 8KB I2C transfer. The frame is copied into a transmit buffer of LPI2C1 (Wire) commands,
+// and DMA feeds those to the I2C master, so drawing into the display's buffer can carry on while
+// the copy is being sent.
+//
+// The display is wired for I2C here. If it were switched to SPI (the BS1/BS2 jumpers), the same
+// approach would work with LPSPI4 DMA, but that isn't implemented.
+
+// Call after display.begin
+void initDisplayFlush(Adafruit_SSD1327& display, uint8_t i2cAddress, uint32_t clockHz);
+
+// Starts sending the display's buffer. If a frame is already being sent, this one is sent when
+// that finishes (by updateDisplayFlush), taking whatever is in the buffer then, so several calls
+// in one loop cost one transfer.
+void flushDisplay();
+
+// Call each loop, after drawing. Finishes off the last transfer, and starts the next if one is
+// waiting.
+void updateDisplayFlush();
+
+// Sends anything waiting, and returns once it is on the screen. For code that delays without calling
+// updateDisplayFlush, or that needs the bus (e.g. Wire).
+void waitForDisplayFlush();
+
+struct DisplayFlushStats {
+  uint32_t mNumFlushes = 0;
+  uint32_t mNumCoalesced = 0;     // Calls to flushDisplay that were merged into a later transfer
+  uint32_t mNumErrors = 0;        // Transfers abandoned because of a NACK, bus error or timeout
+  uint32_t mBytesPerFlush = 0;    // Including the commands and address
+  uint32_t mLastFlushMicros = 0;  // From starting the transfer to the last byte being queued
+  uint32_t mWorstFlushMicros = 0;
+  uint32_t mWorstStartMicros = 0; // The time the loop spends starting a transfer (copying the frame)
+};
+
+const DisplayFlushStats& getDisplayFlushStats();
+
+#endif
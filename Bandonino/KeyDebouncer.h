@@ -0,0 +1,81 @@
+#ifndef KEYDEBOUNCER_H
+#define KEYDEBOUNCER_H
+
+#include "KeyMask.h"
+
+#include <stdint.h>
+
+// Debounces one side of the matrix, counting in scan ticks rather than milliseconds.
+//
+// It's asymmetric: a press is accepted on the first tick it's seen, so there's no added latency.
+// Releases are integrated - each tick a held key reads released its counter goes down, and each
+// tick it reads pressed it goes back up (to a maximum of the release ticks). The key is only
+// released when the counter reaches zero, so chatter as a key is let go doesn't retrigger it.
+//
+// Only held or changing keys are visited, and there are no hardware dependencies, so recorded
+// raw scans can be replayed through it offline (see Tools/KeyTraceReplay.cpp).
+template<int KEY_COUNT>
+class KeyDebouncer {
+public:
+  static_assert(KEY_COUNT <= 64, "Key state is held as a 64 bit mask");
+
+  // Number of consecutive released ticks needed to release a key. Minimum of 1, which means no
+  // debouncing.
+  void setReleaseTicks(int releaseTicks) {
+    mReleaseTicks = (uint8_t)(releaseTicks < 1 ? 1 : (releaseTicks > 255 ? 255 : releaseTicks));
+  }
+
+  int getReleaseTicks() const {
+    return mReleaseTicks;
+  }
+
+  // Takes the raw pressed keys from a scan, and returns the debounced keys
+  KeyMask update(KeyMask rawKeys) {
+    KeyMask newKeys = rawKeys & ~mActiveKeys;
+    mActiveKeys |= newKeys;
+
+    for (KeyMask keys = mActiveKeys; keys;) {
+      int iKey = popFirstKey(keys);
+      uint8_t& counter = mCounters[iKey];
+      if (rawKeys & keyBit(iKey)) {
+        if (newKeys & keyBit(iKey)) {
+          counter = mReleaseTicks;
+        } else if (counter < mReleaseTicks) {
+          // Pressed again after reading released - i.e. it's bouncing
+          ++mNumBounces;
+          ++counter;
+        }
+      } else {
+        // The release time may have been reduced since the key was pressed
+        if (counter > mReleaseTicks)
+          counter = mReleaseTicks;
+        if (--counter == 0)
+          mActiveKeys &= ~keyBit(iKey);
+      }
+    }
+    ++mNumTicks;
+    return mActiveKeys;
+  }
+
+  KeyMask getActiveKeys() const {
+    return mActiveKeys;
+  }
+
+  // Number of ticks where a released key read pressed again before being released
+  uint32_t getNumBounces() const {
+    return mNumBounces;
+  }
+
+  uint32_t getNumTicks() const {
+    return mNumTicks;
+  }
+
+private:
+  KeyMask mActiveKeys = 0;
+  uint8_t mCounters[KEY_COUNT] = {};
+  uint8_t mReleaseTicks = 1;
+  uint32_t mNumBounces = 0;
+  uint32_t mNumTicks = 0;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef KEYEVENTS_H
+#define KEYEVENTS_H
+
+#include "KeyDebouncer.h"
+#include "KeyMask.h"
+
+#include <stdint.h>
+
+// A change in the (debounced) state of a key, as detected by the background scanner
+struct KeyEvent {
+  uint32_t mTimeMicros;  // Start of the scan that detected the change
+  uint8_t mSide;
+  uint8_t mKey;
+  bool mPressed;
+};
+
+// Turns successive raw scans of one side of the matrix into debounced press/release events. There
+// are no hardware dependencies, so this can be driven from a simulated matrix as well as the real
+// one. The work done per scan scales with the number of held/changed keys, not the matrix size.
+template<int ROW_COUNT, int COLUMN_COUNT>
+class KeyEventGenerator {
+public:
+  static constexpr int KEY_COUNT = ROW_COUNT * COLUMN_COUNT;
+
+  // See KeyDebouncer - this is the number of scans a key must read released for
+  void setReleaseTicks(int releaseTicks) {
+    mDebouncer.setReleaseTicks(releaseTicks);
+  }
+
+  // rawKeys has a bit set for each key that reads as pressed in the scan (see toKeyMask).
+  //
+  // Each event is passed to push(const KeyEvent&), which returns false if it can't take it. In
+  // that case the key state is left alone, so the event will be generated again on the next scan.
+  // Returns the number of events pushed.
+  template<typename PushFn>
+  int update(int side, KeyMask rawKeys, uint32_t timeMicros, PushFn&& push) {
+    KeyMask debouncedKeys = mDebouncer.update(rawKeys);
+
+    int numEvents = 0;
+    for (KeyMask changed = debouncedKeys ^ mActive; changed;) {
+      int iKey = popFirstKey(changed);
+      bool isPressed = (debouncedKeys & keyBit(iKey)) != 0;
+      KeyEvent event = { timeMicros, (uint8_t)side, (uint8_t)iKey, isPressed };
+      if (!push(event))
+        continue;
+      mActive ^= keyBit(iKey);
+      ++numEvents;
+    }
+    return numEvents;
+  }
+
+  bool isActive(int iKey) const {
+    return (mActive & keyBit(iKey)) != 0;
+  }
+
+  // The keys that have been reported as pressed
+  KeyMask activeKeys() const {
+    return mActive;
+  }
+
+  const KeyDebouncer<KEY_COUNT>& debouncer() const {
+    return mDebouncer;
+  }
+
+private:
+  KeyDebouncer<KEY_COUNT> mDebouncer;
+  KeyMask mActive = 0;
+};
+
+#endif
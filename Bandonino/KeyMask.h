@@ -0,0 +1,39 @@
+#ifndef KEYMASK_H
+#define KEYMASK_H
+
+#include <stdint.h>
+
+// A bit per key on one side, using the toKeyIndex ordering. Each side has at most 64 keys.
+typedef uint64_t KeyMask;
+
+constexpr KeyMask keyBit(int iKey) {
+  return KeyMask(1) << iKey;
+}
+
+constexpr KeyMask allKeysMask(int keyCount) {
+  return keyCount >= 64 ? ~KeyMask(0) : keyBit(keyCount) - 1;
+}
+
+// Returns the lowest key in the mask, and removes it. mask must not be zero.
+inline int popFirstKey(KeyMask& mask) {
+  int iKey = __builtin_ctzll(mask);
+  mask &= mask - 1;
+  return iKey;
+}
+
+inline int countKeys(KeyMask mask) {
+  return __builtin_popcountll(mask);
+}
+
+// Packs a bit per row, for each column, into a bit per key. Since keys are numbered column by
+// column, each column is just shifted into place.
+template<int ROW_COUNT, int COLUMN_COUNT>
+inline KeyMask toKeyMask(const uint32_t columnRowBits[]) {
+  static_assert(ROW_COUNT * COLUMN_COUNT <= 64, "Key masks hold at most 64 keys");
+  KeyMask mask = 0;
+  for (int iColumn = 0; iColumn != COLUMN_COUNT; ++iColumn)
+    mask |= (KeyMask(columnRowBits[iColumn]) & allKeysMask(ROW_COUNT)) << (iColumn * ROW_COUNT);
+  return mask;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#include "KeyScan.h"
+#include "KeyMask.h"
+#include "NoteLayouts.h"
+#include "Settings.h"
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+using namespace KeyScan;
+
+KeyScan::Timing gKeyScanTiming;
+KeyEventQueue gKeyEventQueue;
+
+static IntervalTimer sKeyScanTimer;
+static int sKeyScanRate = 0;
+static volatile int sReleaseTicks = 1;
+static volatile int sKeyScanMode = KEY_SCAN_MODE_PAIRED;
+
+static KeyEventGenerator<PinInputs::rowCounts[LEFT], PinInputs::columnCounts[LEFT]> sKeyEventsLeft;
+static KeyEventGenerator<PinInputs::rowCounts[RIGHT], PinInputs::columnCounts[RIGHT]> sKeyEventsRight;
+
+enum TraceState {
+  TRACE_STATE_IDLE,
+  TRACE_STATE_ARMED,
+  TRACE_STATE_RECORDING,
+  TRACE_STATE_COMPLETE
+};
+static volatile TraceState sTraceState = TRACE_STATE_IDLE;
+static TraceEntry sTrace[TRACE_LENGTH];
+static int sTraceLength = 0;
+static KeyMask sPreviousRawKeys[2] = { 0, 0 };
+
+// This is the wait (microseconds) between driving a column and reading the rows.
+static const int sColumnSettleTime = 3;
+
+static volatile uint32_t* const sPortInputs[NUM_PORTS] = { &GPIO6_PSR, &GPIO7_PSR, &GPIO8_PSR, &GPIO9_PSR };
+static volatile uint32_t* const sPortDirections[NUM_PORTS] = { &GPIO6_GDIR, &GPIO7_GDIR, &GPIO8_GDIR, &GPIO9_GDIR };
+
+//====================================================================================================
+void initKeyScan() {
+  for (int side = 0; side != 2; ++side) {
+    for (int iRow = 0; iRow != PinInputs::rowCounts[side]; ++iRow)
+      pinMode(PinInputs::rowPins(side)[iRow], INPUT_PULLUP);
+    // The output value is left low, so switching the direction is all that's needed to drive
+    // the column
+    for (int iColumn = 0; iColumn != PinInputs::columnCounts[side]; ++iColumn) {
+      uint8_t pin = PinInputs::columnPins(side)[iColumn];
+      pinMode(pin, OUTPUT);
+      digitalWriteFast(pin, LOW);
+      pinMode(pin, INPUT);
+    }
+  }
+}
+
+//====================================================================================================
+static inline float cyclesToMicros(uint32_t cycles) {
+  return cycles * (1000000.0f / F_CPU_ACTUAL);
+}
+
+//====================================================================================================
+// Reads each port in usedPorts once
+static inline void readPorts(uint8_t usedPorts, uint32_t ports[NUM_PORTS]) {
+  for (int iPort = 0; iPort != NUM_PORTS; ++iPort)
+    ports[iPort] = (usedPorts & (1u << iPort)) ? *sPortInputs[iPort] : 0;
+}
+
+//====================================================================================================
+// Gathers the row bits from the port values. Rows are pulled up, so a pressed key reads low.
+template<size_t N>
+static inline uint32_t gatherRows(const PinTable<N>& rowTable, const uint32_t ports[NUM_PORTS]) {
+  uint32_t rowBits = 0;
+  for (size_t iRow = 0; iRow != N; ++iRow) {
+    const PortBit& row = rowTable.mPins[iRow];
+    rowBits |= ((~ports[row.mPort] >> row.mBit) & 1u) << iRow;
+  }
+  return rowBits;
+}
+
+//====================================================================================================
+template<size_t N>
+static inline uint32_t readRows(const PinTable<N>& rowTable) {
+  uint32_t ports[NUM_PORTS];
+  readPorts(rowTable.mUsedPorts, ports);
+  return gatherRows(rowTable, ports);
+}
+
+//====================================================================================================
+// Drives (or releases) a column, if it exists - the sides can have different column counts
+template<size_t C>
+static inline void driveColumn(const PinTable<C>& columnTable, size_t iColumn, bool drive) {
+  if (iColumn >= C)
+    return;
+  const PortBit& column = columnTable.mPins[iColumn];
+  if (drive)
+    *sPortDirections[column.mPort] |= 1u << column.mBit;
+  else
+    *sPortDirections[column.mPort] &= ~(1u << column.mBit);
+}
+
+//====================================================================================================
+template<size_t R, size_t C>
+static float scanSide(const PinTable<R>& rowTable, const PinTable<C>& columnTable, uint32_t columnRowBits[]) {
+  uint32_t startCycles = ARM_DWT_CYCCNT;
+  for (size_t iColumn = 0; iColumn != C; ++iColumn) {
+    const PortBit& column = columnTable.mPins[iColumn];
+    volatile uint32_t& direction = *sPortDirections[column.mPort];
+    uint32_t mask = 1u << column.mBit;
+
+    direction |= mask;
+    delayMicroseconds(sColumnSettleTime);
+    columnRowBits[iColumn] = readRows(rowTable);
+    direction &= ~mask;
+  }
+  return cyclesToMicros(ARM_DWT_CYCCNT - startCycles);
+}
+
+//====================================================================================================
+float scanKeyMatrix(int side, uint32_t columnRowBits[]) {
+  if (side == LEFT)
+    return scanSide(rowTableLeft, columnTableLeft, columnRowBits);
+  else
+    return scanSide(rowTableRight, columnTableRight, columnRowBits);
+}
+
+//====================================================================================================
+// Scans both sides together. Each left column is driven at the same time as the matching right
+// column, and both row groups are read with a single pass over the ports. The next pair of columns
+// is driven as soon as the reads are taken, so it settles while the current reads are processed.
+float scanKeyMatrixPaired(uint32_t columnRowBitsLeft[], uint32_t columnRowBitsRight[]) {
+  constexpr size_t columnCountLeft = PinInputs::columnCounts[LEFT];
+  constexpr size_t columnCountRight = PinInputs::columnCounts[RIGHT];
+  constexpr size_t pairCount = std::max(columnCountLeft, columnCountRight);
+  constexpr uint8_t usedPorts = rowTableLeft.mUsedPorts | rowTableRight.mUsedPorts;
+
+  uint32_t startCycles = ARM_DWT_CYCCNT;
+  const uint32_t settleCycles = sColumnSettleTime * (F_CPU_ACTUAL / 1000000);
+
+  driveColumn(columnTableLeft, 0, true);
+  driveColumn(columnTableRight, 0, true);
+  uint32_t readyCycles = ARM_DWT_CYCCNT + settleCycles;
+
+  uint32_t ports[NUM_PORTS];
+  for (size_t iPair = 0; iPair != pairCount; ++iPair) {
+    while ((int32_t)(ARM_DWT_CYCCNT - readyCycles) < 0) {
+    }
+    readPorts(usedPorts, ports);
+
+    driveColumn(columnTableLeft, iPair, false);
+    driveColumn(columnTableRight, iPair, false);
+    if (iPair + 1 != pairCount) {
+      driveColumn(columnTableLeft, iPair + 1, true);
+      driveColumn(columnTableRight, iPair + 1, true);
+      readyCycles = ARM_DWT_CYCCNT + settleCycles;
+    }
+
+    if (iPair < columnCountLeft)
+      columnRowBitsLeft[iPair] = gatherRows(rowTableLeft, ports);
+    if (iPair < columnCountRight)
+      columnRowBitsRight[iPair] = gatherRows(rowTableRight, ports);
+  }
+  return cyclesToMicros(ARM_DWT_CYCCNT - startCycles);
+}
+
+//====================================================================================================
+// Exponential average so the report is stable
+static void recordTime(float& average, float& worst, float micros) {
+  average = average == 0 ? micros : average + 0.01f * (micros - average);
+  worst = std::max(worst, micros);
+}
+
+//====================================================================================================
+void recordKeyScanTime(int side, float micros) {
+  recordTime(gKeyScanTiming.mAverageMicros[side], gKeyScanTiming.mWorstMicros[side], micros);
+}
+
+//====================================================================================================
+void resetKeyScanWorstTimes() {
+  gKeyScanTiming.mWorstMicros[LEFT] = 0;
+  gKeyScanTiming.mWorstMicros[RIGHT] = 0;
+  gKeyScanTiming.mWorstTotalMicros = 0;
+  gKeyScanTiming.mWorstDebounceMicros = 0;
+}
+
+//====================================================================================================
+static void recordKeyTrace(uint32_t timeMicros, const KeyMask rawKeys[2]) {
+  if (sTraceState == TRACE_STATE_ARMED && (rawKeys[LEFT] != sPreviousRawKeys[LEFT] || rawKeys[RIGHT] != sPreviousRawKeys[RIGHT])) {
+    sTraceLength = 0;
+    sTraceState = TRACE_STATE_RECORDING;
+  }
+  if (sTraceState == TRACE_STATE_RECORDING) {
+    TraceEntry& entry = sTrace[sTraceLength];
+    entry.mTimeMicros = timeMicros;
+    entry.mRawKeys[LEFT] = rawKeys[LEFT];
+    entry.mRawKeys[RIGHT] = rawKeys[RIGHT];
+    if (++sTraceLength == TRACE_LENGTH)
+      sTraceState = TRACE_STATE_COMPLETE;
+  }
+  sPreviousRawKeys[LEFT] = rawKeys[LEFT];
+  sPreviousRawKeys[RIGHT] = rawKeys[RIGHT];
+}
+
+//====================================================================================================
+void startKeyTrace() {
+  if (sTraceState == TRACE_STATE_IDLE)
+    sTraceState = TRACE_STATE_ARMED;
+}
+
+//====================================================================================================
+bool isKeyTraceComplete() {
+  return sTraceState == TRACE_STATE_COMPLETE;
+}
+
+//====================================================================================================
+void printKeyTrace() {
+  if (sTraceState != TRACE_STATE_COMPLETE)
+    return;
+  Serial.printf("Key trace: %d scans\n", sTraceLength);
+  for (int i = 0; i != sTraceLength; ++i) {
+    const TraceEntry& entry = sTrace[i];
+    Serial.printf("%lu %012llx %012llx\n", (unsigned long)(entry.mTimeMicros - sTrace[0].mTimeMicros),
+                  (unsigned long long)entry.mRawKeys[LEFT], (unsigned long long)entry.mRawKeys[RIGHT]);
+  }
+  sTraceState = TRACE_STATE_IDLE;
+}
+
+//====================================================================================================
+static bool pushKeyEvent(const KeyEvent& event) {
+  return gKeyEventQueue.push(event);
+}
+
+//====================================================================================================
+static void keyScanISR() {
+  uint32_t timeMicros = micros();
+
+  uint32_t columnRowBitsLeft[PinInputs::columnCounts[LEFT]];
+  uint32_t columnRowBitsRight[PinInputs::columnCounts[RIGHT]];
+
+  uint32_t startCycles = ARM_DWT_CYCCNT;
+  if (sKeyScanMode == KEY_SCAN_MODE_PAIRED) {
+    scanKeyMatrixPaired(columnRowBitsLeft, columnRowBitsRight);
+  } else {
+    recordKeyScanTime(LEFT, scanKeyMatrix(LEFT, columnRowBitsLeft));
+    recordKeyScanTime(RIGHT, scanKeyMatrix(RIGHT, columnRowBitsRight));
+  }
+  recordTime(gKeyScanTiming.mAverageTotalMicros, gKeyScanTiming.mWorstTotalMicros,
+             cyclesToMicros(ARM_DWT_CYCCNT - startCycles));
+
+  KeyMask rawKeys[2];
+  rawKeys[LEFT] = toKeyMask<PinInputs::rowCounts[LEFT], PinInputs::columnCounts[LEFT]>(columnRowBitsLeft);
+  rawKeys[RIGHT] = toKeyMask<PinInputs::rowCounts[RIGHT], PinInputs::columnCounts[RIGHT]>(columnRowBitsRight);
+
+  recordKeyTrace(timeMicros, rawKeys);
+
+  startCycles = ARM_DWT_CYCCNT;
+  int releaseTicks = sReleaseTicks;
+  sKeyEventsLeft.setReleaseTicks(releaseTicks);
+  sKeyEventsRight.setReleaseTicks(releaseTicks);
+  sKeyEventsLeft.update(LEFT, rawKeys[LEFT], timeMicros, pushKeyEvent);
+  sKeyEventsRight.update(RIGHT, rawKeys[RIGHT], timeMicros, pushKeyEvent);
+  recordTime(gKeyScanTiming.mAverageDebounceMicros, gKeyScanTiming.mWorstDebounceMicros,
+             cyclesToMicros(ARM_DWT_CYCCNT - startCycles));
+}
+
+//====================================================================================================
+void startKeyScanTimer(int rateHz) {
+  sKeyScanRate = std::clamp(rateHz, 1000, 4000);
+  if (!sKeyScanTimer.begin(keyScanISR, 1000000.0f / sKeyScanRate))
+    Serial.println("Unable to start the key scan timer");
+}
+
+//====================================================================================================
+void updateKeyScanTimer(int rateHz, int debounceMillis, int scanMode) {
+  sKeyScanMode = scanMode;
+  rateHz = std::clamp(rateHz, 1000, 4000);
+  if (rateHz != sKeyScanRate) {
+    sKeyScanRate = rateHz;
+    sKeyScanTimer.update(1000000.0f / sKeyScanRate);
+  }
+  // Round up, so any debounce time gives at least one tick
+  sReleaseTicks = std::max((std::max(debounceMillis, 0) * sKeyScanRate + 999) / 1000, 1);
+}
+
+//====================================================================================================
+uint32_t getNumKeyBounces(int side) {
+  return side ? sKeyEventsRight.debouncer().getNumBounces() : sKeyEventsLeft.debouncer().getNumBounces();
+}
@@ -0,0 +1,135 @@
+#ifndef KEYSCAN_H
+#define KEYSCAN_H
+
+#include "KeyEvents.h"
+#include "PinInputs.h"
+#include "SpscQueue.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reads the key matrix a whole row group at a time, using the Teensy 4.1 fast GPIO port
+// registers (GPIO6 to GPIO9) rather than pinMode/digitalRead per key. The port/bit for each
+// pin is looked up at compile time from the pin arrays in PinInputs.h.
+namespace KeyScan {
+
+static constexpr int NUM_PORTS = 4;  // GPIO6, GPIO7, GPIO8, GPIO9
+static constexpr uint8_t INVALID_PORT = 0xff;
+
+struct PortBit {
+  uint8_t mPort = INVALID_PORT;  // 0 to 3 for GPIO6 to GPIO9
+  uint8_t mBit = 0;
+};
+
+// Teensy 4.1 pin to fast GPIO port/bit - see CORE_PINxx_BIT/CORE_PINxx_PORTREG in core_pins.h
+static constexpr PortBit pinPortBits[] = {
+  { 0, 3 }, { 0, 2 }, { 3, 4 }, { 3, 5 }, { 3, 6 }, { 3, 8 }, { 1, 10 }, { 1, 17 },         // 0-7
+  { 1, 16 }, { 1, 11 }, { 1, 0 }, { 1, 2 }, { 1, 1 }, { 1, 3 }, { 0, 18 }, { 0, 19 },      // 8-15
+  { 0, 23 }, { 0, 22 }, { 0, 17 }, { 0, 16 }, { 0, 26 }, { 0, 27 }, { 0, 24 }, { 0, 25 },   // 16-23
+  { 0, 12 }, { 0, 13 }, { 0, 30 }, { 0, 31 }, { 2, 18 }, { 3, 31 }, { 2, 23 }, { 2, 22 },   // 24-31
+  { 1, 12 }, { 3, 7 }, { 1, 29 }, { 1, 28 }, { 1, 18 }, { 1, 19 }, { 0, 28 }, { 0, 29 },   // 32-39
+  { 0, 20 }, { 0, 21 }                                                                      // 40-41
+};
+static constexpr int NUM_PINS = sizeof(pinPortBits) / sizeof(pinPortBits[0]);
+
+// The port/bit of each pin in a group, plus the mask of ports that need reading and the bits
+// within each port. Built at compile time by makePinTable.
+template<size_t N>
+struct PinTable {
+  PortBit mPins[N];
+  uint32_t mPortMasks[NUM_PORTS] = {};
+  uint8_t mUsedPorts = 0;  // bit per port
+  bool mValid = true;
+};
+
+template<size_t N>
+constexpr PinTable<N> makePinTable(const uint8_t (&pins)[N]) {
+  PinTable<N> table;
+  for (size_t i = 0; i != N; ++i) {
+    if (pins[i] >= NUM_PINS) {
+      table.mValid = false;
+      continue;
+    }
+    PortBit portBit = pinPortBits[pins[i]];
+    table.mPins[i] = portBit;
+    table.mPortMasks[portBit.mPort] |= 1u << portBit.mBit;
+    table.mUsedPorts |= 1u << portBit.mPort;
+  }
+  return table;
+}
+
+static constexpr auto rowTableLeft = makePinTable(PinInputs::rowPinsLeft);
+static constexpr auto rowTableRight = makePinTable(PinInputs::rowPinsRight);
+static constexpr auto columnTableLeft = makePinTable(PinInputs::columnPinsLeft);
+static constexpr auto columnTableRight = makePinTable(PinInputs::columnPinsRight);
+
+static_assert(rowTableLeft.mValid && rowTableRight.mValid, "Row pins must map to fast GPIO ports");
+static_assert(columnTableLeft.mValid && columnTableRight.mValid, "Column pins must map to fast GPIO ports");
+static_assert(PinInputs::rowCounts[0] <= 32 && PinInputs::rowCounts[1] <= 32, "Rows are returned as 32 bit masks");
+
+// Running cost of the scan per side (when the sides are scanned separately), of the whole matrix,
+// and of debouncing/generating events for both sides
+struct Timing {
+  float mAverageMicros[2] = { 0, 0 };
+  float mWorstMicros[2] = { 0, 0 };
+  float mAverageTotalMicros = 0;
+  float mWorstTotalMicros = 0;
+  float mAverageDebounceMicros = 0;
+  float mWorstDebounceMicros = 0;
+};
+
+// Raw (not debounced) scans can be captured, so that chatter can be replayed offline through
+// KeyDebouncer
+struct TraceEntry {
+  uint32_t mTimeMicros;
+  KeyMask mRawKeys[2];
+};
+static constexpr int TRACE_LENGTH = 512;
+
+}  // namespace KeyScan
+
+// Sets the rows to pull up, and the columns to be released (but pre-set to drive low when
+// they're switched to output)
+void initKeyScan();
+
+// Scans one side of the matrix. For each column, sets a bit per row in columnRowBits if that
+// key is pressed. Returns the time taken in microseconds.
+float scanKeyMatrix(int side, uint32_t columnRowBits[]);
+
+// Scans both sides at once, driving a left and right column together, and letting the next pair
+// settle while the current one is processed. Returns the time taken in microseconds.
+float scanKeyMatrixPaired(uint32_t columnRowBitsLeft[], uint32_t columnRowBitsRight[]);
+
+// Records the time taken by a scan, for reporting by hardwareTest
+void recordKeyScanTime(int side, float micros);
+
+// Resets the worst times after they've been reported
+void resetKeyScanWorstTimes();
+
+// Starts scanning the whole matrix from a timer interrupt, at rateHz. Changes in key state are
+// pushed to gKeyEventQueue.
+void startKeyScanTimer(int rateHz);
+
+// Call this periodically to apply changes to the scan rate (Hz), debounce time (ms) and scan mode
+// (KeyScanMode). The debounce time is converted to scan ticks.
+void updateKeyScanTimer(int rateHz, int debounceMillis, int scanMode);
+
+// Number of times a key has bounced while being released, since startup
+uint32_t getNumKeyBounces(int side);
+
+// Arms the trace capture (if it's not already running) - it starts recording at the next change in
+// the raw keys, and stops when the buffer is full
+void startKeyTrace();
+
+bool isKeyTraceComplete();
+
+// Prints the captured trace to serial, as "micros left right" with the masks in hex
+void printKeyTrace();
+
+extern KeyScan::Timing gKeyScanTiming;
+
+// Filled by the background scanner, and drained by the main loop
+typedef SpscQueue<KeyEvent, 128> KeyEventQueue;
+extern KeyEventQueue gKeyEventQueue;
+
+#endif
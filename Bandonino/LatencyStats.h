@@ -0,0 +1,54 @@
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+#include <stdint.h>
+
+#include <algorithm>
+
+// Keeps the last SAMPLE_COUNT latencies (in microseconds), so that the distribution can be
+// summarised. Adding is cheap - the work is done when summarising.
+template<int SAMPLE_COUNT>
+class LatencyStats {
+public:
+  struct Summary {
+    int mCount = 0;
+    uint32_t mMin = 0;
+    uint32_t mMedian = 0;
+    uint32_t mP99 = 0;
+    uint32_t mMax = 0;
+  };
+
+  void add(uint32_t latencyMicros) {
+    mSamples[mNext] = latencyMicros;
+    mNext = (mNext + 1) % SAMPLE_COUNT;
+    if (mCount < SAMPLE_COUNT)
+      ++mCount;
+  }
+
+  void reset() {
+    mCount = 0;
+    mNext = 0;
+  }
+
+  Summary summarise() const {
+    Summary summary;
+    summary.mCount = mCount;
+    if (mCount == 0)
+      return summary;
+    uint32_t sorted[SAMPLE_COUNT];
+    std::copy(mSamples, mSamples + mCount, sorted);
+    std::sort(sorted, sorted + mCount);
+    summary.mMin = sorted[0];
+    summary.mMedian = sorted[mCount / 2];
+    summary.mP99 = sorted[(mCount * 99) / 100];
+    summary.mMax = sorted[mCount - 1];
+    return summary;
+  }
+
+private:
+  uint32_t mSamples[SAMPLE_COUNT] = {};
+  int mCount = 0;
+  int mNext = 0;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "Menu.h"
 
+#include "DisplayFlush.h"
 #include "Settings.h"
 #include "State.h"
 #include "Bellows.h"
@@ -14,12 +15,12 @@
 #include <Adafruit_SSD1327.h>
 
 #include <algorithm>
-#include <vector>
 
 //====================================================================================================
 #define I2C_ADDRESS 0x3D
 #define OLED_RESET -1
-Adafruit_SSD1327 display(128, 128, &Wire, OLED_RESET, 4000000);
+#define I2C_CLOCK 4000000
+Adafruit_SSD1327 display(128, 128, &Wire, OLED_RESET, I2C_CLOCK);
 
 // Note that fonts can be generated from https://oleddisplay.squix.ch/#/home
 #include "Fonts/FreeSans9pt7b.h"
@@ -37,9 +38,37 @@ static const int sPageY = 16;
 
 static bool sForceMenuRefresh = false;
 
+//====================================================================================================
+// The value, range, step and wrap of each setting, from the schema. Only int settings can be
+// edited, so the others have no value.
+struct SettingMenuInfo {
+  int* mValue;
+  int mMinValue;
+  int mMaxValue;
+  int mStep;
+  bool mWrap;
+};
+
+constexpr int* intSetting(int* value) {
+  return value;
+}
+
+template<typename T>
+constexpr int* intSetting(T*) {
+  return nullptr;
+}
+
+#define SETTING_MENU_INFO(id, field, minValue, maxValue, step, flags) \
+  { intSetting(&gSettings.field), (int)(minValue), (int)(maxValue), step, ((flags) & SETTING_WRAP) != 0 },
+static constexpr SettingMenuInfo sSettingMenuInfos[SETTING_NUM] = {
+  SETTINGS_SCHEMA(SETTING_MENU_INFO)
+};
+#undef SETTING_MENU_INFO
+
 //====================================================================================================
 // This is a bit hacky, overloading the constructors. Each entry should be customisable as it's
-// added, with a clearer definition. Then we wouldn't need the type either.
+// added, with a clearer definition. Then we wouldn't need the type either. The constructors are
+// constexpr so that the pages can be static tables.
 struct Option {
   typedef void (*Action)();
 
@@ -49,25 +78,45 @@ struct Option {
     TYPE_NONE
   };
 
-  Option(const char* name, int* value, int minValue, int maxValue, int deltaValue, bool wrap = false, Action action = nullptr)
+  constexpr Option(const char* name, int* value, int minValue, int maxValue, int deltaValue, bool wrap = false, Action action = nullptr)
     : mType(TYPE_OPTION), mName(name), mIntValue(value), mIntMinValue(minValue), mIntMaxValue(maxValue), mIntDeltaValue(deltaValue), mWrap(wrap), mAction(action) {}
 
-  Option(const char* name, int* value, const char** valueStrings, int numStrings, Action action = nullptr)
+  constexpr Option(const char* name, int* value, const char** valueStrings, int numStrings, Action action = nullptr)
     : mType(TYPE_OPTION), mName(name), mValueStrings(valueStrings), mIntValue(value), mIntMinValue(0), mIntMaxValue(numStrings - 1), mIntDeltaValue(1), mWrap(true), mAction(action) {}
 
-  Option(const char* name, float* value, float minValue, float maxValue, float deltaValue, Action action = nullptr)
+  // The value and its range come from the settings schema
+  constexpr Option(const char* name, SettingId id, Action action = nullptr)
+    : Option(name, sSettingMenuInfos[id].mValue, sSettingMenuInfos[id].mMinValue, sSettingMenuInfos[id].mMaxValue,
+             sSettingMenuInfos[id].mStep, sSettingMenuInfos[id].mWrap, action) {}
+
+  constexpr Option(const char* name, SettingId id, const char** valueStrings, int numStrings, Action action = nullptr)
+    : Option(name, sSettingMenuInfos[id].mValue, valueStrings, std::min(numStrings, sSettingMenuInfos[id].mMaxValue + 1), action) {}
+
+  // For strings that are only counted at run time (the note layouts, some of which are loaded)
+  constexpr Option(const char* name, SettingId id, const char** valueStrings, const int* numStrings, Action action = nullptr)
+    : Option(name, id, valueStrings, sSettingMenuInfos[id].mMaxValue + 1, action) {
+    mNumValueStrings = numStrings;
+  }
+
+  constexpr Option(const char* name, float* value, float minValue, float maxValue, float deltaValue, Action action = nullptr)
     : mType(TYPE_OPTION), mName(name), mFloatValue(value), mFloatMinValue(minValue), mFloatMaxValue(maxValue), mFloatDeltaValue(deltaValue), mWrap(false), mAction(action) {}
 
-  Option(const char* name, Action action)
+  constexpr Option(const char* name, Action action)
     : mType(TYPE_ACTION), mName(name), mAction(action) {}
 
-  Option(Action action = nullptr)
+  constexpr Option(Action action = nullptr)
     : mType(TYPE_NONE), mAction(action) {}
 
+  // The largest int value, allowing for the number of strings changing
+  int getIntMaxValue() const {
+    return mNumValueStrings ? std::min(mIntMaxValue, *mNumValueStrings - 1) : mIntMaxValue;
+  }
+
   Type mType;
 
   const char* mName = "";
   const char** mValueStrings = nullptr;
+  const int* mNumValueStrings = nullptr;
 
   int* mIntValue = nullptr;
   float* mFloatValue = nullptr;
@@ -94,6 +143,18 @@ static const char* sForceBellowsStrings[] = {
   "Sensor", "Open", "Close"
 };
 
+static const char* sOffOnStrings[] = {
+  "Off", "On"
+};
+
+static const char* sCurveInputNames[MAX_RESPONSE_CURVE_POINTS] = {
+  "In 1", "In 2", "In 3", "In 4", "In 5", "In 6", "In 7", "In 8"
+};
+
+static const char* sCurveOutputNames[MAX_RESPONSE_CURVE_POINTS] = {
+  "Out 1", "Out 2", "Out 3", "Out 4", "Out 5", "Out 6", "Out 7", "Out 8"
+};
+
 struct Page {
   enum Type {
     TYPE_SPLASH,
@@ -104,16 +165,16 @@ struct Page {
     TYPE_OPTIONS
   };
 
-  Page(Type type, const char* title, const std::vector<Option>& options)
-    : mType(type), mTitle(title), mOptions(options) {}
-  Page(Type type, const char* title)
-    : mType(type), mTitle(title) {}
   Type mType;
   const char* mTitle;
-  std::vector<Option> mOptions;
+  const Option* mOptions;
+  int mNumOptions;
 };
 
-std::vector<Page> sPages;
+template<int NUM_OPTIONS>
+constexpr Page makePage(Page::Type type, const char* title, const Option (&options)[NUM_OPTIONS]) {
+  return { type, title, options, NUM_OPTIONS };
+}
 
 // Track prev and current values to see if things need redrawing
 static int sPreviousPageIndex = -1;
@@ -127,6 +188,10 @@ static bool sAdjustOption = true;
 uint32_t sSplashTime = 0;  // When splash was triggered
 const uint32_t SPLASH_DURATION = 2000;
 
+// Set by showMessage
+static bool sShowingMessage = false;
+static uint32_t sMessageEndTime = 0;
+
 static float sAverageFPS = 0;
 static float sWorstFPS = 0;
 
@@ -143,28 +208,24 @@ void showMessage(const char* msg, int time) {
   display.setFont(sPageTitleFont);
   display.setCursor(0, 64);
   display.print(msg);
-  display.display();
+  flushDisplay();
   display.setFont(nullptr);
-  delay(time);
-  forceMenuRefresh();
+  // updateMenu leaves it up until then
+  sMessageEndTime = millis() + time;
+  sShowingMessage = true;
 }
 
 //====================================================================================================
+// Written in the background, so this can be called while playing
 void saveSettings() {
-  Serial.println("Writing gSettings to gSettings.json");
-  if (!gSettings.writeToCard())
-    Serial.println("Failed to write to gSettings.json");
+  markSettingsDirty();
 }
 
 //====================================================================================================
 void actionSaveSettings() {
-  Serial.println("Save gSettings");
-  char filename[32];
-  sprintf(filename, "Settings%02d.json", gSettings.slot);
-  if (!gSettings.writeToCard(filename))
-    Serial.printf("Failed to write gSettings to %s\n", filename);
-  else
-    showMessage("Saved", 500);
+  Serial.printf("Save gSettings to slot %d\n", gSettings.slot);
+  storeSettingsSlot(gSettings.slot, gSettings);
+  showMessage("Saved", 500);
 }
 
 //====================================================================================================
@@ -176,14 +237,15 @@ void resetBellows() {
   display.setFont(sPageTitleFont);
   display.setCursor(0, sPageTitleFont->yAdvance);
   display.print("Zero bellows");
-  display.display();
+  flushDisplay();
   display.setFont(nullptr);
 
   display.setTextSize(3);
   for (int i = 3; i != 0; --i) {
     display.setCursor(56, 64);
     display.printf("%d", i);
-    display.display();
+    flushDisplay();
+    waitForDisplayFlush();
     delay(500);
   }
   display.setTextSize(1);
@@ -199,65 +261,76 @@ void actionResetBellows() {
 }
 
 //====================================================================================================
+// The presets are applied at the start of the next loop - see applySettingsChanges
 void actionResetSettings() {
-  gSettings = Settings();
+  setPendingSettings(Settings());
   showMessage("Reset", 500);
 }
 
 //====================================================================================================
 void actionLoadBandoneon() {
-  gSettings.reset();
-  gSettings.midiInstruments[LEFT] = 0;
-  gSettings.midiInstruments[RIGHT] = 0;
-  gSettings.balance = 10;
-  gSettings.stereo = 50;
+  Settings settings = gSettings;
+  settings.reset();
+  settings.midiInstruments[LEFT] = 0;
+  settings.midiInstruments[RIGHT] = 0;
+  settings.balance = 10;
+  settings.stereo = 50;
+  setPendingSettings(settings);
   showMessage("Bandoneon", 500);
 }
 
 //====================================================================================================
 void actionLoadConcertina() {
-  gSettings.reset();
-  gSettings.midiInstruments[LEFT] = 1;
-  gSettings.midiInstruments[RIGHT] = 1;
-  gSettings.balance = 0;
-  gSettings.stereo = 50;
+  Settings settings = gSettings;
+  settings.reset();
+  settings.midiInstruments[LEFT] = 1;
+  settings.midiInstruments[RIGHT] = 1;
+  settings.balance = 0;
+  settings.stereo = 50;
+  setPendingSettings(settings);
   showMessage("Bandoneon", 500);
 }
 
 //====================================================================================================
 void actionLoadPiano() {
-  gSettings.reset();
-  gSettings.midiInstruments[LEFT] = 2;
-  gSettings.midiInstruments[RIGHT] = 2;
-  gSettings.expressions[LEFT] = EXPRESSION_VELOCITY;
-  gSettings.expressions[RIGHT] = EXPRESSION_VELOCITY;
-  gSettings.balance = 0;
-  gSettings.stereo = 0;
-  gSettings.debounceTime = 10;
+  Settings settings = gSettings;
+  settings.reset();
+  settings.midiInstruments[LEFT] = 2;
+  settings.midiInstruments[RIGHT] = 2;
+  settings.expressions[LEFT] = EXPRESSION_VELOCITY;
+  settings.expressions[RIGHT] = EXPRESSION_VELOCITY;
+  settings.balance = 0;
+  settings.stereo = 0;
+  settings.debounceTime = 10;
+  setPendingSettings(settings);
   showMessage("Piano", 500);
 }
 
 //====================================================================================================
 void actionLoadBandoPiano() {
-  gSettings.reset();
-  gSettings.midiInstruments[LEFT] = 2;
-  gSettings.midiInstruments[RIGHT] = 0;
-  gSettings.expressions[LEFT] = EXPRESSION_VELOCITY;
-  gSettings.balance = -20;
-  gSettings.stereo = 25;
-  gSettings.debounceTime = 10;
+  Settings settings = gSettings;
+  settings.reset();
+  settings.midiInstruments[LEFT] = 2;
+  settings.midiInstruments[RIGHT] = 0;
+  settings.expressions[LEFT] = EXPRESSION_VELOCITY;
+  settings.balance = -20;
+  settings.stereo = 25;
+  settings.debounceTime = 10;
+  setPendingSettings(settings);
   showMessage("BandoPiano", 500);
 }
 
 //====================================================================================================
 void actionLoadSettings() {
-  Serial.println("Load gSettings");
-  char filename[32];
-  sprintf(filename, "Settings%02d.json", gSettings.slot);
-  if (!gSettings.readFromCard(filename))
-    Serial.printf("Failed to write gSettings to %s\n", filename);
-  else
-    showMessage("Loaded", 500);
+  Serial.printf("Load gSettings from slot %d\n", gSettings.slot);
+  Settings settings;
+  if (!getSettingsSlot(gSettings.slot, settings)) {
+    Serial.printf("Slot %d is empty\n", gSettings.slot);
+    showMessage("Empty", 500);
+    return;
+  }
+  setPendingSettings(settings);
+  showMessage("Loaded", 500);
 }
 
 //====================================================================================================
@@ -273,7 +346,7 @@ void disableDisplay() {
   if (gSettings.menuDisplayEnabled) {
     gSettings.menuDisplayEnabled = false;
     display.clearDisplay();
-    display.display();
+    flushDisplay();
     saveSettings();
   }
 }
@@ -308,7 +381,7 @@ void scrollInText(int x, int y, const char* text, int ms) {
   for (int x1 = 128; --x1 >= x;) {
     display.setCursor(x1, y);
     display.printf("%s ", text);
-    display.display();
+    flushDisplay();
     delay(ms);
   }
 }
@@ -319,102 +392,175 @@ void overlayFPS(int x = 0, int y = 128 - sCharHeight) {
   display.printf("%5.1f (%5.1f)", sAverageFPS, sWorstFPS);
 }
 
+//====================================================================================================
+// Keeps the unused points as copies of the last one, so adding a point extends the curve
+void actionResponseCurveChanged() {
+  gSettings.responseCurves[LEFT].fillUnusedPoints();
+  gSettings.responseCurves[RIGHT].fillUnusedPoints();
+}
+
+//====================================================================================================
+// The pages of options are fixed tables, taking their ranges from the settings schema. Only the
+// response curve pages are filled in at run time, by fillResponseCurveOptions.
+static constexpr Option sSettingsOptions[] = {
+  Option("Slot", SETTING_SLOT),
+  Option("Save", &actionSaveSettings),
+  Option("Load", &actionLoadSettings),
+  Option("Bandoneon", &actionLoadBandoneon),
+  Option("Concertina", &actionLoadConcertina),
+  Option("Piano", &actionLoadPiano),
+  Option("BandoPiano", &actionLoadBandoPiano),
+  Option("Reset", &actionResetSettings)
+};
+
+static constexpr Option sToggleDisplayOptions[] = {
+  Option(&actionToggleDisplay)
+};
+
+static constexpr Option sOptionsOptions[] = {
+  Option("Zero", &actionResetBellows),
+  Option("Offset", SETTING_ZERO_LOAD_OFFSET),
+  Option("Transpose", SETTING_TRANSPOSE),
+  Option("Key", SETTING_ACCIDENTAL_KEY, gKeyNames, NUM_KEYS),
+  Option("Stereo", SETTING_STEREO),
+  Option("Balance", SETTING_BALANCE),
+
+  Option("Metronome", &actionToggleMetronome),
+  Option("Beats/min", SETTING_METRONOME_BEATS_PER_MINUTE),
+  Option("Beats/bar", SETTING_METRONOME_BEATS_PER_BAR)
+};
+
+static constexpr Option sLeftOptions[] = {
+  Option("Expression", SETTING_EXPRESSION_LEFT, gExpressionNames, EXPRESSION_NUM),
+  Option("Max vel", SETTING_MAX_VELOCITY_LEFT),
+  Option("Off vel", SETTING_NOTE_OFF_VELOCITY_LEFT),
+  Option("Octave", SETTING_OCTAVE_LEFT),
+  Option("Instrument", SETTING_MIDI_INSTRUMENT_LEFT)
+};
+
+static constexpr Option sRightOptions[] = {
+  Option("Expression", SETTING_EXPRESSION_RIGHT, gExpressionNames, EXPRESSION_NUM),
+  Option("Max vel", SETTING_MAX_VELOCITY_RIGHT),
+  Option("Off vel", SETTING_NOTE_OFF_VELOCITY_RIGHT),
+  Option("Octave", SETTING_OCTAVE_RIGHT),
+  Option("Instrument", SETTING_MIDI_INSTRUMENT_RIGHT)
+};
+
+static constexpr Option sBellowsOptions[] = {
+  Option("Bellows", SETTING_FORCE_BELLOWS, sForceBellowsStrings, 3),
+  Option("Zero", &actionResetBellows),
+  Option("Offset", SETTING_ZERO_LOAD_OFFSET),
+  Option("Auto zero", SETTING_AUTO_ZERO, sOffOnStrings, 2),
+  Option("Press gain", SETTING_PRESSURE_GAIN),
+  Option("Filter", SETTING_PRESSURE_FILTER, gPressureFilterNames, PRESSURE_FILTER_NUM),
+  Option("Smoothing", SETTING_PRESSURE_SMOOTHING),
+  Option("Predict", SETTING_PRESSURE_PREDICTION, sOffOnStrings, 2)
+};
+
+// Points, then an input and output per point
+static Option sResponseCurveOptions[2][1 + 2 * MAX_RESPONSE_CURVE_POINTS];
+
+static constexpr Option sMetronomeOptions[] = {
+  Option("Volume", SETTING_METRONOME_VOLUME),
+  Option("Note 1", SETTING_METRONOME_MIDI_NOTE_PRIMARY),
+  Option("Note 2", SETTING_METRONOME_MIDI_NOTE_SECONDARY),
+  Option("Instrument", SETTING_METRONOME_MIDI_INSTRUMENT),
+  Option("MIDI sync", SETTING_METRONOME_SYNC, sOffOnStrings, 2)
+};
+
+static constexpr Option sMiscOptions[] = {
+  Option("Layout", SETTING_NOTE_LAYOUT, gNoteLayoutNames, &gNumNoteLayouts),
+  Option("Notes", SETTING_ACCIDENTAL_PREFERENCE, gAccidentalPreferenceNames, 3),
+  Option("Debounce", SETTING_DEBOUNCE_TIME),
+  Option("Scan rate", SETTING_KEY_SCAN_RATE),
+  Option("Scan mode", SETTING_KEY_SCAN_MODE, gKeyScanModeNames, KEY_SCAN_MODE_NUM),
+  Option("Fast notes", SETTING_IMMEDIATE_NOTES, sOffOnStrings, 2),
+  Option("MIDI mode", SETTING_MIDI_MODE, gMidiModeNames, MIDI_MODE_NUM),
+  Option("AT thresh", SETTING_POLY_PRESSURE_THRESHOLD),
+  Option("Brightness", SETTING_MENU_BRIGHTNESS, &forceMenuRefresh),
+  Option("Note disp.", SETTING_NOTE_DISPLAY, gNoteDisplayNames, NOTE_DISPLAY_NUM),
+  Option("Toggle FPS", &actionShowFPS)
+};
+
+static constexpr Page sPages[] = {
+  // Not sure there's any merit to a blank page, since the display can be turned off by clicking
+  // makePage(Page::TYPE_SPLASH, "Bandon.ino", sToggleDisplayOptions),
+  makePage(Page::TYPE_OPTIONS, "Settings", sSettingsOptions),
+  makePage(Page::TYPE_PLAYING_NOTES, "Playing", sToggleDisplayOptions),
+  makePage(Page::TYPE_PLAYING_STAFF, "", sToggleDisplayOptions),
+  makePage(Page::TYPE_OPTIONS, "Options", sOptionsOptions),
+  makePage(Page::TYPE_OPTIONS, "Left", sLeftOptions),
+  makePage(Page::TYPE_OPTIONS, "Right", sRightOptions),
+  makePage(Page::TYPE_OPTIONS, "Bellows", sBellowsOptions),
+  makePage(Page::TYPE_OPTIONS, "Curve L", sResponseCurveOptions[LEFT]),
+  makePage(Page::TYPE_OPTIONS, "Curve R", sResponseCurveOptions[RIGHT]),
+  makePage(Page::TYPE_OPTIONS, "Metronome", sMetronomeOptions),
+  makePage(Page::TYPE_OPTIONS, "Misc", sMiscOptions),
+  makePage(Page::TYPE_STATUS, "Status", sToggleDisplayOptions)
+};
+static const int NUM_PAGES = sizeof(sPages) / sizeof(sPages[0]);
+
+//====================================================================================================
+// Only the first "Points" points are used. The curve is rebuilt when it's next applied.
+void fillResponseCurveOptions(Option options[], ResponseCurvePoints& curve) {
+  options[0] = Option("Points", &curve.mNumPoints, 2, MAX_RESPONSE_CURVE_POINTS, 1, false, &actionResponseCurveChanged);
+  for (int i = 0; i != MAX_RESPONSE_CURVE_POINTS; ++i) {
+    options[1 + 2 * i] = Option(sCurveInputNames[i], &curve.mInputs[i], 0, 100, 1, false, &actionResponseCurveChanged);
+    options[2 + 2 * i] = Option(sCurveOutputNames[i], &curve.mOutputs[i], 0, 100, 1, false, &actionResponseCurveChanged);
+  }
+}
+
 //====================================================================================================
 // Display is 128x64 - so 16x8 characters
 void initMenu() {
   if (!display.begin(I2C_ADDRESS))
     Serial.println("Unable to initialize OLED");
+  initDisplayFlush(display, I2C_ADDRESS, I2C_CLOCK);
 
-  // Not sure there's any merit to a blank page, since the display can be turned off by clicking
-  // sPages.push_back(Page(Page::TYPE_SPLASH, "Bandon.ino", { Option() }));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Settings", {}));
-  sPages.back().mOptions.push_back(Option("Slot", &gSettings.slot, 0, 9, 1));
-  sPages.back().mOptions.push_back(Option("Save", &actionSaveSettings));
-  sPages.back().mOptions.push_back(Option("Load", &actionLoadSettings));
-  sPages.back().mOptions.push_back(Option("Bandoneon", &actionLoadBandoneon));
-  sPages.back().mOptions.push_back(Option("Concertina", &actionLoadConcertina));
-  sPages.back().mOptions.push_back(Option("Piano", &actionLoadPiano));
-  sPages.back().mOptions.push_back(Option("BandoPiano", &actionLoadBandoPiano));
-  sPages.back().mOptions.push_back(Option("Reset", &actionResetSettings));
-
-  sPages.push_back(Page(Page::TYPE_PLAYING_NOTES, "Playing", { Option(&actionToggleDisplay) }));
-
-  sPages.push_back(Page(Page::TYPE_PLAYING_STAFF, "", { Option(&actionToggleDisplay) }));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Options", {}));
-  sPages.back().mOptions.push_back(Option("Zero", &actionResetBellows));
-  sPages.back().mOptions.push_back(Option("Offset", &gSettings.zeroLoadOffset, -1, 1, 1));
-  sPages.back().mOptions.push_back(Option("Transpose", &gSettings.transpose, -12, 12, 1));
-  sPages.back().mOptions.push_back(Option("Key", &gSettings.accidentalKey, gKeyNames, NUM_KEYS));
-  sPages.back().mOptions.push_back(Option("Stereo", &gSettings.stereo, -100, 100, 5, false));
-  sPages.back().mOptions.push_back(Option("Balance", &gSettings.balance, -100, 100, 5, false));
-
-  sPages.back().mOptions.push_back(Option("Metronome", &actionToggleMetronome));
-  sPages.back().mOptions.push_back(Option("Beats/min", &gSettings.metronomeBeatsPerMinute, 20, 200, 1, false));
-  sPages.back().mOptions.push_back(Option("Beats/bar", &gSettings.metronomeBeatsPerBar, 1, 10, 1, false));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Left", {}));
-  sPages.back().mOptions.push_back(Option("Expression", &gSettings.expressions[LEFT], gExpressionNames, EXPRESSION_NUM));
-  sPages.back().mOptions.push_back(Option("Max vel", &gSettings.maxVelocity[LEFT], 0, 127, 1, false));
-  sPages.back().mOptions.push_back(Option("Off vel", &gSettings.noteOffVelocity[LEFT], 0, 127, 1, false));
-  sPages.back().mOptions.push_back(Option("Octave", &gSettings.octave[LEFT], -2, 2, 1));
-  sPages.back().mOptions.push_back(Option("Instrument", &gSettings.midiInstruments[LEFT], -1, 127, 1, true));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Right", {}));
-  sPages.back().mOptions.push_back(Option("Expression", &gSettings.expressions[RIGHT], gExpressionNames, EXPRESSION_NUM));
-  sPages.back().mOptions.push_back(Option("Max vel", &gSettings.maxVelocity[RIGHT], 0, 127, 1, false));
-  sPages.back().mOptions.push_back(Option("Off vel", &gSettings.noteOffVelocity[RIGHT], 0, 127, 1, false));
-  sPages.back().mOptions.push_back(Option("Octave", &gSettings.octave[RIGHT], -2, 2, 1));
-  sPages.back().mOptions.push_back(Option("Instrument", &gSettings.midiInstruments[RIGHT], -1, 127, 1, true));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Bellows", {}));
-  sPages.back().mOptions.push_back(Option("Bellows", &gSettings.forceBellows, sForceBellowsStrings, 3));
-  sPages.back().mOptions.push_back(Option("Zero", &actionResetBellows));
-  sPages.back().mOptions.push_back(Option("Offset", &gSettings.zeroLoadOffset, -1, 1, 1));
-  sPages.back().mOptions.push_back(Option("Dead zone", &gSettings.deadzone, 0, 50, 1, false));
-  sPages.back().mOptions.push_back(Option("Attack 25%", &gSettings.attack25, 0, 100, 5, false));
-  sPages.back().mOptions.push_back(Option("Attack 50%", &gSettings.attack50, 0, 100, 5, false));
-  sPages.back().mOptions.push_back(Option("Attack 75%", &gSettings.attack75, 0, 100, 5, false));
-  sPages.back().mOptions.push_back(Option("Press gain", &gSettings.pressureGain, 10, 200, 10, false));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Metronome", {}));
-  sPages.back().mOptions.push_back(Option("Volume", &gSettings.metronomeVolume, 0, 100, 5, false));
-  sPages.back().mOptions.push_back(Option("Note 1", &gSettings.metronomeMidiNotePrimary, 1, 127, 1, true));
-  sPages.back().mOptions.push_back(Option("Note 2", &gSettings.metronomeMidiNoteSecondary, 1, 127, 1, true));
-  sPages.back().mOptions.push_back(Option("Instrument", &gSettings.metronomeMidiInstrument, 0, 127, 1, true));
-
-  sPages.push_back(Page(Page::TYPE_OPTIONS, "Misc", {}));
-  sPages.back().mOptions.push_back(Option("Layout", &gSettings.noteLayout, gNoteLayoutNames, NOTELAYOUTTYPE_NUM));
-  sPages.back().mOptions.push_back(Option("Notes", &gSettings.accidentalPreference, gAccidentalPreferenceNames, 3));
-  sPages.back().mOptions.push_back(Option("Debounce", &gSettings.debounceTime, 0, 50, 1));
-  sPages.back().mOptions.push_back(Option("Brightness", &gSettings.menuBrightness, 4, 0xf, 1, false, &forceMenuRefresh));
-  sPages.back().mOptions.push_back(Option("Note disp.", &gSettings.noteDisplay, gNoteDisplayNames, NOTE_DISPLAY_NUM));
-  sPages.back().mOptions.push_back(Option("Toggle FPS", &actionShowFPS));
-
-  // This isn't useful at the moment - may kill it
-  // sPages.push_back(Page(Page::TYPE_STATUS, "Status", { Option(Option(&actionToggleDisplay)) }));
-
-  gSettings.menuPageIndex = std::clamp(gSettings.menuPageIndex, 0, (int)(sPages.size() - 1));
+  fillResponseCurveOptions(sResponseCurveOptions[LEFT], gSettings.responseCurves[LEFT]);
+  fillResponseCurveOptions(sResponseCurveOptions[RIGHT], gSettings.responseCurves[RIGHT]);
+
+  gSettings.menuPageIndex = std::clamp(gSettings.menuPageIndex, 0, NUM_PAGES - 1);
 
   display.clearDisplay();
-  display.display();
+  flushDisplay();
   display.setTextColor(gSettings.menuBrightness, 0x0);
   display.setTextWrap(false);
 
 #if 1
   scrollInText(0, 0, "Bandon.ino", 3);
   scrollInText(0, 8, "Danny Chapman", 3);
+  waitForDisplayFlush();
   delay(200);
 #endif
 
   display.clearDisplay();
-  display.display();
+  flushDisplay();
   forceMenuRefresh();
   ;
 }
 
-static std::vector<int> sLastPlayingNotes[2];
+// The notes last drawn by the playing notes/staff pages, and the version of the notes they came
+// from, so nothing is done until the notes change
+static NoteMask sLastPlayingNotes[2];
+static uint32_t sLastPlayingNotesVersions[2] = { 0, 0 };
+
+//====================================================================================================
+// Returns false if the notes are the same as were last drawn. Otherwise fills notes and
+// lastNotes (each needs space for 128) with what to draw and what was drawn before.
+static bool getChangedPlayingNotes(int side, int notes[], int& numNotes, int lastNotes[], int& numLastNotes) {
+  const ActiveNoteSet& playingNotes = gBigState.mPlayingNotes[side];
+  if (playingNotes.getVersion() == sLastPlayingNotesVersions[side])
+    return false;
+  sLastPlayingNotesVersions[side] = playingNotes.getVersion();
+  // A note can come and go between frames
+  if (playingNotes.getMask() == sLastPlayingNotes[side])
+    return false;
+  numNotes = playingNotes.getMask().getNotes(notes);
+  numLastNotes = sLastPlayingNotes[side].getNotes(lastNotes);
+  sLastPlayingNotes[side] = playingNotes.getMask();
+  return true;
+}
 
 //====================================================================================================
 int convertToScreenY(int y) {
@@ -428,17 +574,10 @@ int maxMidi[2] = { NOTE(AN, 4), NOTE(BN, 6) };
 
 //====================================================================================================
 void displayPlayingNotes(int side) {
-  byte* playingNotes = gBigState.mPlayingNotes[side];
-  std::vector<int>& lastNotes = sLastPlayingNotes[side];
-
-  static std::vector<int> notes;
-  notes.clear();
-  for (int i = gSettings.midiMin; i <= gSettings.midiMax; ++i) {
-    if (playingNotes[i]) {
-      notes.push_back(i);
-    }
-  }
-  if (notes == lastNotes)
+  int notes[128];
+  int lastNotes[128];
+  int numNotes, numLastNotes;
+  if (!getChangedPlayingNotes(side, notes, numNotes, lastNotes, numLastNotes))
     return;
 
   display.setTextSize(2);
@@ -448,7 +587,8 @@ void displayPlayingNotes(int side) {
     int col = side ? 128 - offset - 3 * 2 * sCharWidth : offset;
     int pushDelta = side ? -sCharWidth * 3 * 2 : sCharWidth * 3 * 2;
     // Clear any previous notes
-    for (int note : lastNotes) {
+    for (int i = 0; i != numLastNotes; ++i) {
+      int note = lastNotes[i];
       float frac = (note - minMidi[side]) / float(maxMidi[side] - minMidi[side]);
       int y = lowestY + frac * (highestY - lowestY);
       if (side)
@@ -461,7 +601,8 @@ void displayPlayingNotes(int side) {
     display.setTextColor(gSettings.menuBrightness, gSettings.menuBrightness);
     int prevY = -1000;
     bool prevPushed = false;
-    for (int note : notes) {
+    for (int i = 0; i != numNotes; ++i) {
+      int note = notes[i];
       float frac = (note - minMidi[side]) / float(maxMidi[side] - minMidi[side]);
       int y = lowestY + frac * (highestY - lowestY);
       if (y < prevY + 2 * sCharHeight && !prevPushed) {
@@ -482,12 +623,12 @@ void displayPlayingNotes(int side) {
     const int offset = 16;
     int col = side ? 127 - offset - 3 * 2 * sCharWidth : offset;
     int row = 5;
-    size_t num = std::max(notes.size(), lastNotes.size());
-    for (size_t i = 0; i < num; ++i, --row) {
+    int num = std::max(numNotes, numLastNotes);
+    for (int i = 0; i < num; ++i, --row) {
       if (row <= 0)
         break;
       display.setCursor(col, sPageY + row * sCharHeight * 2);
-      if (i < notes.size()) {
+      if (i < numNotes) {
         NoteInfo noteInfo = getNoteInfo(notes[i], CLEF_TREBLE, gSettings.accidentalPreference, gSettings.accidentalKey);
         display.printf("%-3s", noteInfo.mName);
       } else {
@@ -495,10 +636,8 @@ void displayPlayingNotes(int side) {
       }
     }
   }
-  display.display();
+  flushDisplay();
   display.setTextSize(1);
-
-  lastNotes.swap(notes);  // no memory copies or allocations
 }
 
 //====================================================================================================
@@ -506,7 +645,7 @@ void displayPressure() {
   display.setCursor(75, sPageY);
   static const char* bellowsIndicators[3] = { ">||<", "=||=", "<||>" };
   display.printf("%s %3.2f", bellowsIndicators[gState.mBellowsState + 1], gState.mAbsPressure);
-  display.display();
+  flushDisplay();
 }
 
 //====================================================================================================
@@ -577,7 +716,7 @@ void drawStaffLines(int startLine, int endLine, int x, int width, uint16_t colou
       area->AddPoint(x, screenY);
       area->AddPoint(x + width, screenY);
     }
-    display.display();
+    flushDisplay();
   }
 }
 
@@ -585,7 +724,7 @@ void drawStaffLines(int startLine, int endLine, int x, int width, uint16_t colou
 void displayStaffPage() {
   drawStaffLines(0, 4, 0, 128, STAFF_BITMAP_COLOUR);
   display.drawBitmap(0, 0, ClefPage, 128, 128, STAFF_BITMAP_COLOUR);
-  display.display();
+  flushDisplay();
 }
 
 //====================================================================================================
@@ -617,29 +756,21 @@ void drawAccidental(int x, int note, int accidental, uint16_t colour, Area& area
   area.AddPoint(screenX + size[0], screenY + size[1]);
 }
 
-static std::vector<int> sLastStaffNotes[2];
 static Area sLastAreas[2];
 
 //====================================================================================================
 void displayPlayingStaff(int side) {
-  const byte* playingNotes = gBigState.mPlayingNotes[side];
-  std::vector<int>& lastNotes = sLastPlayingNotes[side];
-  Area& area = sLastAreas[side];
-
-  static std::vector<int> notes;
-  notes.clear();
-  for (int i = gSettings.midiMin; i <= gSettings.midiMax; ++i) {
-    if (playingNotes[i]) {
-      notes.push_back(i);
-    }
-  }
-  if (notes == lastNotes)
+  int notes[128];
+  int lastNotes[128];
+  int numNotes, numLastNotes;
+  if (!getChangedPlayingNotes(side, notes, numNotes, lastNotes, numLastNotes))
     return;
+  Area& area = sLastAreas[side];
 
   // Wipe and refresh the area that was previously used
   if (area.IsValid()) {
     display.fillRect(area.X(), area.Y(), area.W(), area.H(), 0);
-    display.display();
+    flushDisplay();
     drawStaffLines(0, 4, area.X(), area.W(), STAFF_BITMAP_COLOUR);
   }
 
@@ -651,7 +782,7 @@ void displayPlayingStaff(int side) {
   // If there is a crunch, then the notes should alternate left right
   bool prevPushedSideways = false;
   NoteInfo prevNoteInfo(-999, 0);
-  for (size_t iNote = 0; iNote != notes.size(); ++iNote) {
+  for (int iNote = 0; iNote != numNotes; ++iNote) {
     int pushOffset = 0;
     int midiNote = notes[iNote];
     NoteInfo noteInfo = getNoteInfo(midiNote, side, gSettings.accidentalPreference, gSettings.accidentalKey);
@@ -663,13 +794,13 @@ void displayPlayingStaff(int side) {
     }
     drawNote(NOTE_X[side] + pushOffset, noteInfo.mStavePosition, NOTE_COLOUR, area);
     drawAccidental(NOTE_X[side] + pushOffset, noteInfo.mStavePosition, noteInfo.mAccidental, NOTE_COLOUR, area);
-    display.display();
+    flushDisplay();
     prevNoteInfo = noteInfo;
   }
 
-  if (!notes.empty()) {
-    int lowestMidi = notes.front();
-    int highestMidi = notes.back();
+  if (numNotes != 0) {
+    int lowestMidi = notes[0];
+    int highestMidi = notes[numNotes - 1];
     NoteInfo lowestNoteInfo = getNoteInfo(lowestMidi, side, gSettings.accidentalPreference, gSettings.accidentalKey);
     NoteInfo highestNoteInfo = getNoteInfo(highestMidi, side, gSettings.accidentalPreference, gSettings.accidentalKey);
     int requiredLines = -lowestNoteInfo.mStavePosition / 2;
@@ -681,8 +812,6 @@ void displayPlayingStaff(int side) {
       drawStaffLines(5, requiredLines, LEDGER_X[side], LEDGER_WIDTH, LEDGER_LINES_COLOUR, &area);
     }
   }
-
-  lastNotes.swap(notes);  // no memory copies or allocations
 }
 
 //====================================================================================================
@@ -699,7 +828,13 @@ void displayStatus(const State& gState) {
   display.printf("Mod pressure %3.2f\n", gState.mModifiedPressure);
   display.printf("FPS %3.1f\n", sAverageFPS);
   display.printf("Worst FPS %3.1f\n", sWorstFPS);
-  display.display();
+
+  // Key to USB latency, in ms
+  LatencyStats<256>::Summary latency = gBigState.mNoteLatency.summarise();
+  display.printf("Note latency (%s)\n", gSettings.immediateNotes ? "fast" : "frame");
+  display.printf("Min %4.2f Med %4.2f\n", latency.mMin / 1000.0f, latency.mMedian / 1000.0f);
+  display.printf("P99 %4.2f\n", latency.mP99 / 1000.0f);
+  flushDisplay();
 }
 
 //====================================================================================================
@@ -712,10 +847,10 @@ void displayTitle(const char* title) {
 
 //====================================================================================================
 void displayOption(int pageIndex, int optionIndex, int row, bool highlightLeft, bool highlightRight) {
-  if (pageIndex < 0 || pageIndex >= (int)sPages.size())
+  if (pageIndex < 0 || pageIndex >= NUM_PAGES)
     return;
   const Page& page = sPages[pageIndex];
-  if (optionIndex < 0 || optionIndex >= (int)page.mOptions.size())
+  if (optionIndex < 0 || optionIndex >= page.mNumOptions)
     return;
   const Option& option = page.mOptions[optionIndex];
 
@@ -744,12 +879,12 @@ void displayOption(int pageIndex, int optionIndex, int row, bool highlightLeft,
 }
 
 //====================================================================================================
-Page& currentPage() {
+const Page& currentPage() {
   return sPages[gSettings.menuPageIndex];
 }
 
 //====================================================================================================
-Option& currentOption() {
+const Option& currentOption() {
   return currentPage().mOptions[sCurrentOptionIndex];
 }
 
@@ -793,6 +928,13 @@ T wrap(const T& value, const T& minValue, const T& maxValue) {
 void updateMenu() {
   updateFrameTiming();
 
+  if (sShowingMessage) {
+    if ((int32_t)(millis() - sMessageEndTime) < 0)
+      return;
+    sShowingMessage = false;
+    forceMenuRefresh();
+  }
+
   int deltaRotaryEncoder = gState.mRotaryEncoderPosition - gPrevState.mRotaryEncoderPosition;
 
   bool toggledOptionValue = false;
@@ -828,20 +970,20 @@ void updateMenu() {
       changedOption = true;
       sCurrentOptionIndex += deltaRotaryEncoder;
 
-      if (sCurrentOptionIndex >= (int)currentPage().mOptions.size()) {
+      if (sCurrentOptionIndex >= currentPage().mNumOptions) {
         // Jump to next page
-        if (gSettings.menuPageIndex + 1 < (int)sPages.size()) {
+        if (gSettings.menuPageIndex + 1 < NUM_PAGES) {
           ++gSettings.menuPageIndex;
           sCurrentOptionIndex = 0;
         } else {
-          sCurrentOptionIndex = currentPage().mOptions.size() - 1;
+          sCurrentOptionIndex = currentPage().mNumOptions - 1;
         }
       }
       if (sCurrentOptionIndex < 0) {
         // Jump to previous page
         if (gSettings.menuPageIndex - 1 >= 0) {
           --gSettings.menuPageIndex;
-          sCurrentOptionIndex = sPages[gSettings.menuPageIndex].mOptions.size() - 1;
+          sCurrentOptionIndex = sPages[gSettings.menuPageIndex].mNumOptions - 1;
         } else {
           sCurrentOptionIndex = 0;
         }
@@ -849,15 +991,15 @@ void updateMenu() {
     }
   } else {  // adjustOption
     if (deltaRotaryEncoder) {
-      Option& option = currentOption();
+      const Option& option = currentOption();
       if (option.mType == Option::TYPE_OPTION) {
         changedValue = true;
         if (option.mIntValue) {
           *option.mIntValue += option.mIntDeltaValue * deltaRotaryEncoder;
           if (option.mWrap)
-            *option.mIntValue = wrap(*option.mIntValue, option.mIntMinValue, option.mIntMaxValue);
+            *option.mIntValue = wrap(*option.mIntValue, option.mIntMinValue, option.getIntMaxValue());
           else
-            *option.mIntValue = std::clamp(*option.mIntValue, option.mIntMinValue, option.mIntMaxValue);
+            *option.mIntValue = std::clamp(*option.mIntValue, option.mIntMinValue, option.getIntMaxValue());
         } else if (option.mFloatValue) {
           *option.mFloatValue += option.mFloatDeltaValue * deltaRotaryEncoder;
           if (option.mWrap)
@@ -886,7 +1028,7 @@ void updateMenu() {
       displayStaffPage();
     }
     sSplashTime = millis();
-    display.display();
+    flushDisplay();
     sPreviousOptionIndex = sCurrentOptionIndex;
     sPreviousPageIndex = gSettings.menuPageIndex;
   }
@@ -898,31 +1040,31 @@ void updateMenu() {
     if (elapsedTime > SPLASH_DURATION && gSettings.menuDisplayEnabled) {
       gSettings.menuDisplayEnabled = false;
       display.clearDisplay();
-      display.display();
+      flushDisplay();
     }
     if (gSettings.showFPS) {
       overlayFPS();
-      display.display();
+      flushDisplay();
     }
   } else if (page.mType == Page::TYPE_PLAYING_NOTES) {
     displayAllPlayingNotes();
     if (gSettings.showFPS)
       overlayFPS();
-    display.display();
+    flushDisplay();
   } else if (page.mType == Page::TYPE_PLAYING_STAFF) {
     displayPlayingStaffs();
     if (gSettings.showFPS)
       overlayFPS();
-    display.display();
+    flushDisplay();
   } else if (page.mType == Page::TYPE_STATUS) {
     displayStatus(gState);
     if (gSettings.showFPS)
       overlayFPS();
-    display.display();
+    flushDisplay();
   } else if (changedValue || changedOption || toggledOptionValue) {
     int maxLine = 10;
     int offset = std::max(0, sCurrentOptionIndex - maxLine);
-    int numOptions = (int)currentPage().mOptions.size();
+    int numOptions = currentPage().mNumOptions;
     for (int iOption = 0; iOption != numOptions; ++iOption) {
       int line = iOption - offset;
       if (line >= 0 && line <= maxLine) {
@@ -932,17 +1074,17 @@ void updateMenu() {
           displayOption(gSettings.menuPageIndex, iOption, line + 2, false, false);
       }
     }
-    if (strcmp(page.mTitle, "Options") == 0 || strcmp(page.mTitle, "Bellows") == 0)
+    if (strcmp(page.mTitle, "Options") == 0 || strcmp(page.mTitle, "Bellows") == 0 || strncmp(page.mTitle, "Curve", 5) == 0)
       displayPressure();
     if (gSettings.showFPS)
       overlayFPS();
-    display.display();
+    flushDisplay();
   } else {
-    if (strcmp(page.mTitle, "Options") == 0 || strcmp(page.mTitle, "Bellows") == 0)
+    if (strcmp(page.mTitle, "Options") == 0 || strcmp(page.mTitle, "Bellows") == 0 || strncmp(page.mTitle, "Curve", 5) == 0)
       displayPressure();
     if (gSettings.showFPS) {
       overlayFPS();
-      display.display();
+      flushDisplay();
     }
   }
 }
@@ -13,7 +13,8 @@ void initMenu();
 // Call this every tick
 void updateMenu();
 
-// clear screen and show message for time (in ms). This will block.
+// clear screen and show message for time (in ms). This doesn't block - the menu is frozen until
+// the time is up.
 void showMessage(const char* msg, int time);
 
 #endif
\ No newline at end of file
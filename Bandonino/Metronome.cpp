@@ -1,8 +1,12 @@
 #include "Metronome.h"
 
+#include "ClockPll.h"
+#include "MidiOut.h"
+#include "Mpe.h"
 #include "Settings.h"
 #include "State.h"
 
+#include <Arduino.h>
 #include <Wire.h>
 #include <wiring.h>
 
@@ -12,6 +16,11 @@ uint32_t sNextStopTime = 0;
 bool sPlaying = false;
 
 int sPreviousInstrument = -1;
+int sPreviousChannel = -1;
+
+ClockPll sClockPll;
+bool sClockRunning = false;
+int32_t sLastSyncedBeat = -1;  // Index (in beats from the start) of the last beat played in sync
 
 //====================================================================================================
 inline int convertFractionToMidi(float frac) {
@@ -23,6 +32,81 @@ inline int convertPercentToMidi(int percent) {
   return convertFractionToMidi(percent / 100.0f);
 }
 
+//====================================================================================================
+void handleMidiClockMessage(uint8_t type, uint32_t timeMicros) {
+  switch (type) {
+  case usbMIDI.Clock:
+    sClockPll.addTick(timeMicros);
+    break;
+  case usbMIDI.Start:
+    sClockPll.startCount();
+    sLastSyncedBeat = -1;
+    sClockRunning = true;
+    break;
+  case usbMIDI.Continue:
+    sClockRunning = true;
+    break;
+  case usbMIDI.Stop:
+    sClockRunning = false;
+    break;
+  default:
+    break;
+  }
+}
+
+//====================================================================================================
+bool isMetronomeSynced() {
+  return gSettings.metronomeSync && sClockRunning && sClockPll.isLocked();
+}
+
+//====================================================================================================
+const ClockPll& getMidiClockPll() {
+  return sClockPll;
+}
+
+//====================================================================================================
+static void playBeat(bool isMainBeat, uint32_t time, float beatPeriod) {
+  int midiNote = isMainBeat ? gSettings.metronomeMidiNotePrimary : gSettings.metronomeMidiNoteSecondary;
+  int midiVolume = convertPercentToMidi(gSettings.metronomeVolume);
+  int channel = getMetronomeMidiChannel();
+  sendMidiControlChange(0x07, midiVolume, channel);
+  sendMidiNoteOn(midiNote, 127, channel);
+
+  sNextStopTime = time + (uint32_t)(0.1f * beatPeriod * 1000);
+
+  if (gSettings.metronomeLED)
+    analogWrite(LED_BUILTIN, isMainBeat ? 256 : 32);
+
+  sPlaying = true;
+}
+
+//====================================================================================================
+// Plays the beats at the times predicted from the external clock, rather than when the ticks
+// arrive, so they don't pick up the jitter.
+static void updateSyncedMetronome(uint32_t time) {
+  const int ticksPerBeat = ClockPll::TICKS_PER_BEAT;
+  int32_t tickIndex = sClockPll.getTickIndex();
+  if (tickIndex < 0)
+    return;
+  int32_t beat = sLastSyncedBeat + 1;
+  // Don't try to catch up on beats that were missed (e.g. while the clock was out of lock)
+  if (beat * ticksPerBeat < tickIndex - ticksPerBeat / 2)
+    beat = (tickIndex + ticksPerBeat - 1) / ticksPerBeat;
+
+  uint32_t beatTimeMicros = sClockPll.getTickTimeMicros(beat * ticksPerBeat);
+  if ((int32_t)(micros() - beatTimeMicros) < 0)
+    return;
+
+  bool isMainBeat = (beat % gSettings.metronomeBeatsPerBar) == 0;
+  float beatPeriod = sClockPll.getTickPeriodMicros() * ticksPerBeat * 1e-6f;
+  playBeat(isMainBeat, time, beatPeriod);
+  sLastSyncedBeat = beat;
+
+  // Carry on from the next beat in the bar if the sync is lost (sNextBeat counts from 1)
+  sNextBeat = (beat + 2) % gSettings.metronomeBeatsPerBar;
+  sNextBeatTime = time + (uint32_t)(beatPeriod * 1000);
+}
+
 //====================================================================================================
 void updateMetronome() {
   if (!gSettings.metronomeEnabled) {
@@ -33,10 +117,12 @@ void updateMetronome() {
     return;
   }
 
-  if (gSettings.metronomeMidiInstrument != sPreviousInstrument) {
+  int channel = getMetronomeMidiChannel();
+  if (gSettings.metronomeMidiInstrument != sPreviousInstrument || channel != sPreviousChannel) {
     if (gSettings.metronomeMidiInstrument != 0)
-      usbMIDI.sendProgramChange(gSettings.metronomeMidiInstrument, gSettings.metronomeMidiChannel);
+      sendMidiProgramChange(gSettings.metronomeMidiInstrument, channel);
     sPreviousInstrument = gSettings.metronomeMidiInstrument;
+    sPreviousChannel = channel;
   }
 
   // Menu interactions can be slow, so don't trus tthe loop start time
@@ -44,28 +130,23 @@ void updateMetronome() {
 
   // Stop any playing note if it's time
   if (time >= sNextStopTime && sPlaying) {
-    usbMIDI.sendNoteOff(gSettings.metronomeMidiNotePrimary, 0, gSettings.metronomeMidiChannel);
-    usbMIDI.sendNoteOff(gSettings.metronomeMidiNoteSecondary, 0, gSettings.metronomeMidiChannel);
+    sendMidiNoteOff(gSettings.metronomeMidiNotePrimary, 0, channel);
+    sendMidiNoteOff(gSettings.metronomeMidiNoteSecondary, 0, channel);
     sPlaying = false;
     if (gSettings.metronomeLED)
       analogWrite(LED_BUILTIN, 0);
   }
 
+  if (isMetronomeSynced()) {
+    updateSyncedMetronome(time);
+    return;
+  }
+
   if (time >= sNextBeatTime) {
     bool isMainBeat = (sNextBeat == 1 || gSettings.metronomeBeatsPerBar == 1);
-    int midiNote = isMainBeat ? gSettings.metronomeMidiNotePrimary : gSettings.metronomeMidiNoteSecondary;
-    int midiVolume = convertPercentToMidi(gSettings.metronomeVolume);
-    usbMIDI.sendControlChange(0x07, midiVolume, gSettings.metronomeMidiChannel);
-    usbMIDI.sendNoteOn(midiNote, 127, gSettings.metronomeMidiChannel);
-
     float beatPeriod = 60.0f / gSettings.metronomeBeatsPerMinute;
+    playBeat(isMainBeat, time, beatPeriod);
     sNextBeatTime = time + (uint32_t)(beatPeriod * 1000);
-    sNextStopTime = time + (uint32_t)(0.1f * beatPeriod * 1000);
-
-    if (gSettings.metronomeLED)
-      analogWrite(LED_BUILTIN, isMainBeat ? 256 : 32);
-
     sNextBeat = (sNextBeat + 1) % gSettings.metronomeBeatsPerBar;
-    sPlaying = true;
   }
 }
@@ -1,6 +1,18 @@
 #ifndef METRONOME_H
 #define METRONOME_H
 
+#include <stdint.h>
+
+class ClockPll;
+
 void updateMetronome();
 
+// Clock, Start, Continue and Stop messages from the incoming MIDI. Other types are ignored.
+void handleMidiClockMessage(uint8_t type, uint32_t timeMicros);
+
+// True if the beats are following the incoming MIDI clock
+bool isMetronomeSynced();
+
+const ClockPll& getMidiClockPll();
+
 #endif
@@ -0,0 +1,310 @@
+#include "MidiOut.h"
+
+#include <Arduino.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Most controls sent in one flush. The loop runs at several hundred Hz or more, so this is
+// plenty, but stops a burst (e.g. resendMidiControls) from delaying the next notes.
+const int CONTROL_BUDGET_PER_FLUSH = 4;
+
+// Continuous controls need to change by at least this much to be sent straight away...
+const int CONTINUOUS_DEADBAND = 2;
+// ...otherwise they're sent once they've stopped changing for this long, so noise that keeps
+// flicking between neighbouring values isn't sent at all
+const uint32_t CONTINUOUS_SETTLE_MILLIS = 30;
+
+// Enough for volume, pan and program on each side, plus channel pressure on all the MPE channels
+const int MAX_CONTROL_SLOTS = 40;
+// Controls that haven't been given a value for this long are no longer in use (e.g. their channel
+// has changed, or an MPE channel has gone quiet), so they aren't resent, and their slots are freed
+const uint32_t CONTROL_IN_USE_MILLIS = 1000;
+
+// Most polyphonic key pressures sent in one flush. A full speed USB packet holds 16 messages, so
+// with the control budget this leaves room for the notes, however many keys are held.
+const int POLY_PRESSURE_BUDGET_PER_FLUSH = 8;
+const int MAX_QUEUED_POLY_PRESSURES = 64;
+
+enum ControlType : uint8_t {
+  CONTROL_TYPE_CC,
+  CONTROL_TYPE_PROGRAM,
+  CONTROL_TYPE_CHANNEL_PRESSURE
+};
+
+// The latest value wanted for one controller on one channel, and what was last sent
+struct ControlSlot {
+  ControlType mType;
+  uint8_t mController;
+  uint8_t mChannel;
+  bool mContinuous;
+  int16_t mValue;
+  int16_t mSentValue;  // -1 if it needs sending regardless
+  uint32_t mChangeMillis;  // When mValue last changed
+  uint32_t mQueuedMillis;  // When a value was last given, even if it hadn't changed
+};
+
+static ControlSlot sControlSlots[MAX_CONTROL_SLOTS];
+static int sNumControlSlots = 0;
+static int sNextControlSlot = 0;  // Where the next flush starts, so all slots get a turn
+
+// Polyphonic key pressure for each channel and note
+struct PolyPressureNote {
+  int8_t mValue = -1;      // -1 if the note isn't sounding
+  int8_t mSentValue = -1;  // -1 if nothing has been sent since the note started
+  bool mQueued = false;
+};
+
+static PolyPressureNote sPolyPressures[16][128];
+// Waiting to be sent, oldest first, as channel index * 128 + note
+static uint16_t sPolyPressureQueue[MAX_QUEUED_POLY_PRESSURES];
+static int sNumQueuedPolyPressures = 0;
+
+static MidiOutStats sStats;
+
+//====================================================================================================
+static void resetPolyPressure(int midiNote, int midiChannel) {
+  if (midiChannel < 1 || midiChannel > 16 || midiNote < 0 || midiNote > 127)
+    return;
+  // If it's queued, it's skipped when the queue is flushed
+  PolyPressureNote& note = sPolyPressures[midiChannel - 1][midiNote];
+  note.mValue = -1;
+  note.mSentValue = -1;
+}
+
+//====================================================================================================
+void sendMidiNoteOn(int midiNote, int velocity, int midiChannel) {
+  resetPolyPressure(midiNote, midiChannel);
+  usbMIDI.sendNoteOn(midiNote, velocity, midiChannel);
+  ++sStats.mNumNotesSent;
+}
+
+//====================================================================================================
+void sendMidiNoteOff(int midiNote, int velocity, int midiChannel) {
+  resetPolyPressure(midiNote, midiChannel);
+  usbMIDI.sendNoteOff(midiNote, velocity, midiChannel);
+  ++sStats.mNumNotesSent;
+}
+
+//====================================================================================================
+void sendMidiAllNotesOff(int midiChannel) {
+  // This is about notes, so it goes in order with them
+  for (int midiNote = 0; midiNote != 128; ++midiNote)
+    resetPolyPressure(midiNote, midiChannel);
+  usbMIDI.sendControlChange(0x7B, 0, midiChannel);  // 123
+  ++sStats.mNumNotesSent;
+}
+
+//====================================================================================================
+static void sendControlNow(ControlType type, int controller, int value, int midiChannel) {
+  if (type == CONTROL_TYPE_PROGRAM)
+    usbMIDI.sendProgramChange(value, midiChannel);
+  else if (type == CONTROL_TYPE_CHANNEL_PRESSURE)
+    usbMIDI.sendAfterTouch(value, midiChannel);
+  else
+    usbMIDI.sendControlChange(controller, value, midiChannel);
+  ++sStats.mNumControlsSent;
+}
+
+//====================================================================================================
+static ControlSlot* findControlSlot(ControlType type, int controller, int midiChannel) {
+  for (int i = 0; i != sNumControlSlots; ++i) {
+    ControlSlot& slot = sControlSlots[i];
+    if (slot.mType == type && slot.mController == controller && slot.mChannel == midiChannel)
+      return &slot;
+  }
+  return nullptr;
+}
+
+//====================================================================================================
+static void queueControl(ControlType type, int controller, int value, int midiChannel, bool continuous) {
+  ControlSlot* slot = findControlSlot(type, controller, midiChannel);
+  if (!slot) {
+    if (sNumControlSlots == MAX_CONTROL_SLOTS) {
+      // Shouldn't happen - but better to send it than lose it
+      sendControlNow(type, controller, value, midiChannel);
+      return;
+    }
+    uint32_t timeMillis = millis();
+    slot = &sControlSlots[sNumControlSlots++];
+    *slot = { type, (uint8_t)controller, (uint8_t)midiChannel, continuous, (int16_t)value, -1, timeMillis, timeMillis };
+    return;
+  }
+
+  slot->mQueuedMillis = millis();
+  if (value == slot->mValue) {
+    if (value == slot->mSentValue)
+      ++sStats.mNumControlsDropped;
+    return;
+  }
+  if (slot->mValue != slot->mSentValue)
+    ++sStats.mNumControlsCoalesced;
+  slot->mValue = (int16_t)value;
+  slot->mChangeMillis = slot->mQueuedMillis;
+}
+
+//====================================================================================================
+void sendMidiControlChange(int controller, int value, int midiChannel) {
+  queueControl(CONTROL_TYPE_CC, controller, value, midiChannel, false);
+}
+
+//====================================================================================================
+void sendMidiContinuousControl(int controller, int value, int midiChannel) {
+  queueControl(CONTROL_TYPE_CC, controller, value, midiChannel, true);
+}
+
+//====================================================================================================
+void sendMidiProgramChange(int program, int midiChannel) {
+  queueControl(CONTROL_TYPE_PROGRAM, 0, program, midiChannel, false);
+}
+
+//====================================================================================================
+void sendMidiChannelPressure(int pressure, int midiChannel) {
+  queueControl(CONTROL_TYPE_CHANNEL_PRESSURE, 0, pressure, midiChannel, true);
+}
+
+//====================================================================================================
+void sendMidiChannelPressureNow(int pressure, int midiChannel) {
+  sendControlNow(CONTROL_TYPE_CHANNEL_PRESSURE, 0, pressure, midiChannel);
+  // So the queue doesn't send it again
+  if (ControlSlot* slot = findControlSlot(CONTROL_TYPE_CHANNEL_PRESSURE, 0, midiChannel)) {
+    slot->mValue = (int16_t)pressure;
+    slot->mSentValue = (int16_t)pressure;
+  }
+}
+
+//====================================================================================================
+void sendMidiPolyPressure(int midiNote, int pressure, int midiChannel, int threshold) {
+  if (midiChannel < 1 || midiChannel > 16 || midiNote < 0 || midiNote > 127)
+    return;
+  PolyPressureNote& note = sPolyPressures[midiChannel - 1][midiNote];
+  if (pressure == note.mValue) {
+    ++sStats.mNumControlsDropped;
+    return;
+  }
+  note.mValue = (int8_t)pressure;
+  if (note.mQueued) {
+    ++sStats.mNumControlsCoalesced;
+    return;
+  }
+  // Small changes are held back, but the ends of the range always go
+  if (note.mSentValue >= 0 && abs(pressure - note.mSentValue) < threshold && pressure != 0 && pressure != 127) {
+    ++sStats.mNumControlsDropped;
+    return;
+  }
+  if (sNumQueuedPolyPressures == MAX_QUEUED_POLY_PRESSURES) {
+    // Shouldn't happen - but better to send it than lose it
+    usbMIDI.sendAfterTouchPoly(midiNote, pressure, midiChannel);
+    note.mSentValue = note.mValue;
+    ++sStats.mNumControlsSent;
+    return;
+  }
+  note.mQueued = true;
+  sPolyPressureQueue[sNumQueuedPolyPressures++] = (uint16_t)((midiChannel - 1) * 128 + midiNote);
+}
+
+//====================================================================================================
+static void flushPolyPressures() {
+  int numSent = 0;
+  int i = 0;
+  for (; i != sNumQueuedPolyPressures && numSent != POLY_PRESSURE_BUDGET_PER_FLUSH; ++i) {
+    int channelIndex = sPolyPressureQueue[i] / 128;
+    int midiNote = sPolyPressureQueue[i] % 128;
+    PolyPressureNote& note = sPolyPressures[channelIndex][midiNote];
+    note.mQueued = false;
+    // Skip notes that have stopped, or that have come back to what was sent
+    if (note.mValue < 0 || note.mValue == note.mSentValue)
+      continue;
+    usbMIDI.sendAfterTouchPoly(midiNote, note.mValue, channelIndex + 1);
+    note.mSentValue = note.mValue;
+    ++sStats.mNumControlsSent;
+    ++numSent;
+  }
+  if (i != sNumQueuedPolyPressures)
+    ++sStats.mNumFlushesOverBudget;
+  memmove(sPolyPressureQueue, sPolyPressureQueue + i, (sNumQueuedPolyPressures - i) * sizeof(sPolyPressureQueue[0]));
+  sNumQueuedPolyPressures -= i;
+}
+
+//====================================================================================================
+void sendMidiRegisteredParameter(int parameter, int value, int midiChannel) {
+  usbMIDI.sendControlChange(101, (parameter >> 7) & 0x7f, midiChannel);
+  usbMIDI.sendControlChange(100, parameter & 0x7f, midiChannel);
+  usbMIDI.sendControlChange(6, value, midiChannel);
+  // Null RPN, so stray data entry messages don't change it
+  usbMIDI.sendControlChange(101, 127, midiChannel);
+  usbMIDI.sendControlChange(100, 127, midiChannel);
+  sStats.mNumControlsSent += 5;
+}
+
+//====================================================================================================
+void resendMidiControls() {
+  // Frees the slots that are no longer in use (once anything waiting has gone), and marks the rest
+  uint32_t timeMillis = millis();
+  int numSlots = 0;
+  for (int i = 0; i != sNumControlSlots; ++i) {
+    ControlSlot& slot = sControlSlots[i];
+    if (timeMillis - slot.mQueuedMillis >= CONTROL_IN_USE_MILLIS && slot.mValue == slot.mSentValue)
+      continue;
+    slot.mSentValue = -1;
+    sControlSlots[numSlots++] = slot;
+  }
+  sNumControlSlots = numSlots;
+  if (sNextControlSlot >= sNumControlSlots)
+    sNextControlSlot = 0;
+}
+
+//====================================================================================================
+static bool isReadyToSend(const ControlSlot& slot, uint32_t timeMillis) {
+  if (slot.mValue == slot.mSentValue)
+    return false;
+  if (!slot.mContinuous || slot.mSentValue < 0)
+    return true;
+  // Reaching the ends of the range always goes, and so does the first rise from silence (e.g. the
+  // start of a note)
+  if (slot.mValue == 0 || slot.mValue == 127 || slot.mSentValue == 0)
+    return true;
+  if (abs(slot.mValue - slot.mSentValue) >= CONTINUOUS_DEADBAND)
+    return true;
+  return timeMillis - slot.mChangeMillis >= CONTINUOUS_SETTLE_MILLIS;
+}
+
+//====================================================================================================
+void flushMidiOut() {
+  // Notes have already gone into the USB buffer, so controls always follow them
+  uint32_t timeMillis = millis();
+  int numSent = 0;
+  for (int n = 0; n != sNumControlSlots; ++n) {
+    int i = (sNextControlSlot + n) % sNumControlSlots;
+    ControlSlot& slot = sControlSlots[i];
+    if (!isReadyToSend(slot, timeMillis))
+      continue;
+    if (numSent == CONTROL_BUDGET_PER_FLUSH) {
+      // Carry on from here next time
+      sNextControlSlot = i;
+      ++sStats.mNumFlushesOverBudget;
+      break;
+    }
+    sendControlNow(slot.mType, slot.mController, slot.mValue, slot.mChannel);
+    slot.mSentValue = slot.mValue;
+    ++numSent;
+  }
+  flushPolyPressures();
+  usbMIDI.send_now();
+}
+
+//====================================================================================================
+void sendChangedMidiControls() {
+  for (int i = 0; i != sNumControlSlots; ++i) {
+    ControlSlot& slot = sControlSlots[i];
+    if (slot.mValue == slot.mSentValue)
+      continue;
+    sendControlNow(slot.mType, slot.mController, slot.mValue, slot.mChannel);
+    slot.mSentValue = slot.mValue;
+  }
+}
+
+//====================================================================================================
+const MidiOutStats& getMidiOutStats() {
+  return sStats;
+}
@@ -0,0 +1,62 @@
+#ifndef MIDIOUT_H
+#define MIDIOUT_H
+
+#include <stdint.h>
+
+// All MIDI output goes through here rather than straight to usbMIDI, so that notes aren't held up
+// behind controller traffic.
+//
+// Notes (and All Notes Off) are sent straight away. Controller and program changes are queued,
+// with only the latest value kept for each controller/channel, and sent by flushMidiOut after
+// the notes, up to a budget per flush. Values that match what was last sent are dropped.
+
+struct MidiOutStats {
+  uint32_t mNumNotesSent = 0;
+  uint32_t mNumControlsSent = 0;      // Includes program changes and pressure
+  uint32_t mNumControlsCoalesced = 0; // Replaced by a newer value before being sent
+  uint32_t mNumControlsDropped = 0;   // Same as the value last sent (or within the threshold)
+  uint32_t mNumFlushesOverBudget = 0; // Flushes that left controls queued for the next one
+};
+
+void sendMidiNoteOn(int midiNote, int velocity, int midiChannel);
+void sendMidiNoteOff(int midiNote, int velocity, int midiChannel);
+void sendMidiAllNotesOff(int midiChannel);
+
+void sendMidiControlChange(int controller, int value, int midiChannel);
+
+// For controllers driven by a sensor (e.g. volume from the bellows). Changes smaller than the
+// deadband are held back until the value has stopped changing, except that reaching the ends of the
+// range, or rising from 0, always goes.
+void sendMidiContinuousControl(int controller, int value, int midiChannel);
+
+void sendMidiProgramChange(int program, int midiChannel);
+
+// Continuous, like sendMidiContinuousControl
+void sendMidiChannelPressure(int pressure, int midiChannel);
+
+// Sent straight away, even if it matches what was last sent. For a channel that's about to start a
+// note, so the note doesn't begin with the pressure left over from the channel's last note.
+void sendMidiChannelPressureNow(int pressure, int midiChannel);
+
+// Polyphonic key pressure for a sounding note. Queued like the controls (with its own budget), but
+// only once it has moved by at least threshold from what was last sent for the note. Starting or
+// stopping the note forgets the pressure.
+void sendMidiPolyPressure(int midiNote, int pressure, int midiChannel, int threshold);
+
+// Sent straight away, as the controller messages need to stay together and in order
+void sendMidiRegisteredParameter(int parameter, int value, int midiChannel);
+
+// Sends all the controller/program values that are still in use again, in case the receiver missed
+// them. Controls that haven't been given a value for a second are forgotten.
+void resendMidiControls();
+
+// Sends every control that has changed straight away, ignoring the budget and the deadband. For
+// changes that need to arrive together and ahead of the notes that follow (e.g. a preset).
+void sendChangedMidiControls();
+
+// Sends queued controls (within the budget) and flushes USB
+void flushMidiOut();
+
+const MidiOutStats& getMidiOutStats();
+
+#endif
@@ -0,0 +1,112 @@
+#include "Mpe.h"
+#include "MidiOut.h"
+#include "MpeChannelAllocator.h"
+#include "PinInputs.h"
+#include "Settings.h"
+
+// MPE Configuration Message registered parameter
+const int MPE_CONFIGURATION_RPN = 6;
+const int MPE_MANAGER_CHANNELS[2] = { 1, 16 };
+const int MPE_METRONOME_CHANNEL = 9;
+
+static MpeChannelAllocator<MPE_MEMBER_CHANNELS_PER_ZONE> sAllocators[2];
+static bool sMpeEnabled = false;
+static int sMetronomeChannel = -1;
+static int sPressures[2] = { -1, -1 };  // Last sent by sendMpePressure, for starting notes with
+
+//====================================================================================================
+static void configureZones() {
+  for (int side = 0; side != 2; ++side) {
+    int channels[MPE_MEMBER_CHANNELS_PER_ZONE];
+    int numChannels = 0;
+    int direction = side == LEFT ? 1 : -1;
+    for (int i = 0; i != MPE_MEMBER_CHANNELS_PER_ZONE; ++i) {
+      int channel = MPE_MANAGER_CHANNELS[side] + direction * (i + 1);
+      if (channel == sMetronomeChannel)
+        break;
+      channels[numChannels++] = channel;
+    }
+    sAllocators[side].setChannels(channels, numChannels);
+
+    // Turning MPE off is done by configuring a zone with no member channels
+    sendMidiRegisteredParameter(MPE_CONFIGURATION_RPN, sMpeEnabled ? numChannels : 0, MPE_MANAGER_CHANNELS[side]);
+  }
+}
+
+//====================================================================================================
+bool isMpeZoneChangePending() {
+  bool mpeEnabled = gSettings.midiMode == MIDI_MODE_MPE;
+  return mpeEnabled != sMpeEnabled || (mpeEnabled && gSettings.metronomeMidiChannel != sMetronomeChannel);
+}
+
+//====================================================================================================
+void updateMpeZones() {
+  if (!isMpeZoneChangePending())
+    return;
+  bool wasEnabled = sMpeEnabled;
+  sMpeEnabled = gSettings.midiMode == MIDI_MODE_MPE;
+  sMetronomeChannel = gSettings.metronomeMidiChannel;
+  if (sMpeEnabled || wasEnabled)
+    configureZones();
+}
+
+//====================================================================================================
+bool isMpeEnabled() {
+  return sMpeEnabled;
+}
+
+//====================================================================================================
+int getSideMidiChannel(int side) {
+  return sMpeEnabled ? MPE_MANAGER_CHANNELS[side] : gSettings.midiChannels[side];
+}
+
+//====================================================================================================
+int getMetronomeMidiChannel() {
+  int channel = gSettings.metronomeMidiChannel;
+  if (sMpeEnabled && (channel == MPE_MANAGER_CHANNELS[LEFT] || channel == MPE_MANAGER_CHANNELS[RIGHT]))
+    return MPE_METRONOME_CHANNEL;
+  return channel;
+}
+
+//====================================================================================================
+void startMpeNote(int side, int midiNote, int velocity) {
+  MpeChannelAllocator<MPE_MEMBER_CHANNELS_PER_ZONE>::Allocation allocation = sAllocators[side].allocate(midiNote);
+  if (allocation.mChannel < 0)
+    return;
+  if (allocation.mStolenNote >= 0)
+    sendMidiNoteOff(allocation.mStolenNote, gSettings.noteOffVelocity[side], allocation.mChannel);
+  // The channel still has the pressure from its last note, and the queued pressure would only
+  // follow the note on
+  if (sPressures[side] >= 0)
+    sendMidiChannelPressureNow(sPressures[side], allocation.mChannel);
+  sendMidiNoteOn(midiNote, velocity, allocation.mChannel);
+}
+
+//====================================================================================================
+void stopMpeNote(int side, int midiNote, int velocity) {
+  // If the note's channel was stolen, it has already been stopped
+  int channel = sAllocators[side].release(midiNote);
+  if (channel >= 0)
+    sendMidiNoteOff(midiNote, velocity, channel);
+}
+
+//====================================================================================================
+void stopAllMpeNotes(int side) {
+  const MpeChannelAllocator<MPE_MEMBER_CHANNELS_PER_ZONE>& allocator = sAllocators[side];
+  for (int i = 0; i != allocator.getNumChannels(); ++i)
+    sendMidiAllNotesOff(allocator.getChannelAt(i));
+  sAllocators[side].reset();
+}
+
+//====================================================================================================
+void sendMpePressure(int side, int pressure) {
+  sPressures[side] = pressure;
+  sAllocators[side].forEachUsed([pressure](int channel, int) {
+    sendMidiChannelPressure(pressure, channel);
+  });
+}
+
+//====================================================================================================
+uint32_t getMpeNumSteals(int side) {
+  return sAllocators[side].getNumSteals();
+}
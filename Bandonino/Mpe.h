@@ -0,0 +1,43 @@
+#ifndef MPE_H
+#define MPE_H
+
+#include <stdint.h>
+
+// MPE output. The left side uses the lower zone (manager channel 1, member channels from 2
+// upwards) and the right side uses the upper zone (manager channel 16, members from 15 downwards).
+// Each sounding note gets its own member channel, so the bellows pressure can be sent per note
+// as channel pressure.
+//
+// Each zone has up to 6 member channels, leaving channels 8 and 9 free for the metronome (9 by
+// default). Zones have to be contiguous, so if the metronome channel is inside one, that zone stops
+// short of it. A metronome on a manager channel is moved to channel 9 instead.
+
+const int MPE_MEMBER_CHANNELS_PER_ZONE = 6;
+
+// True if the settings no longer match the zones (e.g. MPE has been turned on or off). All notes
+// should be stopped before calling updateMpeZones.
+bool isMpeZoneChangePending();
+
+// Applies the settings, and sends the MPE configuration to the receiver
+void updateMpeZones();
+
+bool isMpeEnabled();
+
+// The channel for messages to the whole side - the manager channel with MPE, otherwise the
+// side's channel.
+int getSideMidiChannel(int side);
+
+// The channel the metronome plays on - the setting, unless that's an MPE manager channel
+int getMetronomeMidiChannel();
+
+// Allocates a member channel (stealing the oldest if necessary) and sends the note on
+void startMpeNote(int side, int midiNote, int velocity);
+void stopMpeNote(int side, int midiNote, int velocity);
+void stopAllMpeNotes(int side);
+
+// Sends pressure (0 to 127) as channel pressure on each channel with a note
+void sendMpePressure(int side, int pressure);
+
+uint32_t getMpeNumSteals(int side);
+
+#endif
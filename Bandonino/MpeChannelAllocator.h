@@ -0,0 +1,147 @@
+#ifndef MPECHANNELALLOCATOR_H
+#define MPECHANNELALLOCATOR_H
+
+#include <stdint.h>
+
+// Gives each sounding note its own MIDI channel from a fixed pool (an MPE zone's member
+// channels). Free and in use channels are kept in linked lists threaded through arrays, so
+// allocating and releasing are constant time.
+//
+// Released channels go to the back of the free list, so a channel's release tail gets as long as
+// possible before it's reused. When there are no free channels, the channel that has been in use
+// longest is stolen.
+//
+// There are no hardware dependencies - sending the MIDI is up to the caller.
+template<int MAX_CHANNELS>
+class MpeChannelAllocator {
+public:
+  static constexpr uint8_t NONE = 0xff;
+
+  struct Allocation {
+    int mChannel = -1;     // MIDI channel, 1 to 16
+    int mStolenNote = -1;  // If the channel was stolen, the note that needs stopping on it
+  };
+
+  // channels are MIDI channels (1 to 16). Forgets all notes.
+  void setChannels(const int channels[], int numChannels) {
+    mNumChannels = numChannels < MAX_CHANNELS ? numChannels : MAX_CHANNELS;
+    for (int i = 0; i != mNumChannels; ++i)
+      mChannels[i] = (uint8_t)channels[i];
+    reset();
+  }
+
+  // Forgets all notes, making all the channels free
+  void reset() {
+    for (int i = 0; i != 128; ++i)
+      mNoteSlots[i] = NONE;
+    mFree = List();
+    mUsed = List();
+    for (int i = 0; i != mNumChannels; ++i) {
+      mNotes[i] = NONE;
+      pushBack(mFree, i);
+    }
+  }
+
+  // Returns the channel for midiNote. If it's already sounding it keeps its channel.
+  Allocation allocate(int midiNote) {
+    Allocation allocation;
+    if (mNumChannels == 0 || midiNote < 0 || midiNote > 127)
+      return allocation;
+    uint8_t slot = mNoteSlots[midiNote];
+    if (slot == NONE) {
+      if (mFree.mHead != NONE) {
+        slot = mFree.mHead;
+        unlink(mFree, slot);
+      } else {
+        slot = mUsed.mHead;
+        unlink(mUsed, slot);
+        allocation.mStolenNote = mNotes[slot];
+        mNoteSlots[mNotes[slot]] = NONE;
+        ++mNumSteals;
+      }
+      mNotes[slot] = (uint8_t)midiNote;
+      mNoteSlots[midiNote] = slot;
+      pushBack(mUsed, slot);
+    }
+    allocation.mChannel = mChannels[slot];
+    return allocation;
+  }
+
+  // Returns the channel that midiNote was using, or -1 if it wasn't allocated (or was stolen)
+  int release(int midiNote) {
+    if (midiNote < 0 || midiNote > 127 || mNoteSlots[midiNote] == NONE)
+      return -1;
+    uint8_t slot = mNoteSlots[midiNote];
+    mNoteSlots[midiNote] = NONE;
+    mNotes[slot] = NONE;
+    unlink(mUsed, slot);
+    pushBack(mFree, slot);
+    return mChannels[slot];
+  }
+
+  // -1 if the note isn't allocated
+  int getChannel(int midiNote) const {
+    if (midiNote < 0 || midiNote > 127 || mNoteSlots[midiNote] == NONE)
+      return -1;
+    return mChannels[mNoteSlots[midiNote]];
+  }
+
+  // Calls fn(channel, midiNote) for each channel in use, oldest first
+  template<typename Fn>
+  void forEachUsed(Fn&& fn) const {
+    for (uint8_t slot = mUsed.mHead; slot != NONE; slot = mNext[slot])
+      fn((int)mChannels[slot], (int)mNotes[slot]);
+  }
+
+  int getNumChannels() const {
+    return mNumChannels;
+  }
+
+  int getChannelAt(int index) const {
+    return mChannels[index];
+  }
+
+  uint32_t getNumSteals() const {
+    return mNumSteals;
+  }
+
+private:
+  struct List {
+    uint8_t mHead = NONE;
+    uint8_t mTail = NONE;
+  };
+
+  void pushBack(List& list, uint8_t slot) {
+    mPrev[slot] = list.mTail;
+    mNext[slot] = NONE;
+    if (list.mTail != NONE)
+      mNext[list.mTail] = slot;
+    else
+      list.mHead = slot;
+    list.mTail = slot;
+  }
+
+  void unlink(List& list, uint8_t slot) {
+    if (mPrev[slot] != NONE)
+      mNext[mPrev[slot]] = mNext[slot];
+    else
+      list.mHead = mNext[slot];
+    if (mNext[slot] != NONE)
+      mPrev[mNext[slot]] = mPrev[slot];
+    else
+      list.mTail = mPrev[slot];
+    mPrev[slot] = mNext[slot] = NONE;
+  }
+
+  uint8_t mChannels[MAX_CHANNELS] = {};
+  uint8_t mNotes[MAX_CHANNELS] = {};  // The note on each channel slot, or NONE
+  uint8_t mNext[MAX_CHANNELS] = {};
+  uint8_t mPrev[MAX_CHANNELS] = {};
+  uint8_t mNoteSlots[128];            // The channel slot for each note, or NONE
+  List mFree;
+  List mUsed;
+  int mNumChannels = 0;
+  uint32_t mNumSteals = 0;
+};
+
+#endif
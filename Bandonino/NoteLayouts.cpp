@@ -6,14 +6,21 @@
 #include "State.h"
 
 #include <Arduino.h>
+#include <SD.h>
 
-const char* gNoteLayoutNames[] = {
+#include <algorithm>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* gNoteLayoutNames[MAX_NOTE_LAYOUTS] = {
   "Manoury1",
   "Manoury2",
   "Tango142",
   "Hayden1",
   "Hayden2"
 };
+int gNumNoteLayouts = NOTELAYOUTTYPE_NUM;
 
 //====================================================================================================
 const int gActionKey1 = INDEX_RIGHT(0, 2);
@@ -21,7 +28,16 @@ const int gActionKey2 = INDEX_RIGHT(1, 1);
 
 //====================================================================================================
 const char* getNoteLayoutName() {
-  return gNoteLayoutNames[gSettings.noteLayout];
+  return gNoteLayoutNames[std::clamp(gSettings.noteLayout, 0, gNumNoteLayouts - 1)];
+}
+
+//====================================================================================================
+int findNoteLayout(const char* name) {
+  for (int i = 0; i != gNumNoteLayouts; ++i) {
+    if (strcmp(gNoteLayoutNames[i], name) == 0)
+      return i;
+  }
+  return -1;
 }
 
 
@@ -165,29 +181,294 @@ const uint8_t* hayden2LayoutRightClose = hayden2LayoutRightOpen;
 NoteLayout hayden2NoteLayout = { hayden2LayoutLeftOpen, hayden2LayoutRightOpen, hayden2LayoutLeftClose, hayden2LayoutRightClose, gNoteLayoutNames[NOTELAYOUTTYPE_HAYDEN2] };
 
 //====================================================================================================
-void syncNoteLayout() {
-  if (gBigState.mNoteLayout.mName != getNoteLayoutName()) {
-    Serial.printf("Switching to %s\n", getNoteLayoutName());
-    switch (gSettings.noteLayout) {
-      case NOTELAYOUTTYPE_MANOURY1:
-        gBigState.mNoteLayout = manoury1NoteLayout;
-        break;
-      case NOTELAYOUTTYPE_MANOURY2:
-        gBigState.mNoteLayout = manoury2NoteLayout;
-        break;
-      case NOTELAYOUTTYPE_TANGO_142:
-        gBigState.mNoteLayout = tango142NoteLayout;
-        break;
-      case NOTELAYOUTTYPE_HAYDEN1:
-        gBigState.mNoteLayout = hayden1NoteLayout;
-        break;
-      case NOTELAYOUTTYPE_HAYDEN2:
-        gBigState.mNoteLayout = hayden2NoteLayout;
-        break;
-      default:
-        Serial.printf("Unknown note layout %d\n", gSettings.noteLayout);
+// Layouts from the SD card
+//====================================================================================================
+// Each layout is a text file in /layouts, named after the layout (e.g. /layouts/MyTango.txt). The
+// notes are listed in the same order as the layouts above, as you'd look at the keys, after a line
+// saying which side and direction they are for:
+//
+//   # Comments start with # (as a separate word)
+//   left open
+//   -   -   D2  C#2 C2  G#2 G2  F#2
+//   ...
+//   right open
+//   ...
+//
+// Notes are a name and octave (C4 is 60, flats can be written as Db4), or a MIDI number. "-" is a
+// key that doesn't play. The close sections are optional, and default to the open notes. Each
+// section needs exactly as many notes as the side has keys.
+//
+// A file is only parsed the first time it's seen. The result is saved next to it (MyTango.bin),
+// and used as is on later starts unless the text file's size or time has changed.
+
+const char* NOTE_LAYOUT_DIRECTORY = "/layouts";
+const uint32_t NOTE_LAYOUT_CACHE_MAGIC = 0x4c4e4231;  // "1BNL"
+const size_t MAX_NOTE_LAYOUT_FILE_SIZE = 4096;
+
+// A layout in the form it's cached in, and used from
+struct CompiledNoteLayout {
+  char mName[MAX_NOTE_LAYOUT_NAME];
+  uint8_t mLeft[2][PinInputs::keyCounts[LEFT]];    // Open then close
+  uint8_t mRight[2][PinInputs::keyCounts[RIGHT]];
+};
+
+struct NoteLayoutCacheHeader {
+  uint32_t mMagic;
+  uint16_t mKeyCounts[2];
+  uint32_t mSourceSize;
+  uint32_t mSourceTime;
+  uint32_t mSize;  // sizeof(CompiledNoteLayout)
+};
+
+static CompiledNoteLayout sCompiledNoteLayouts[MAX_NOTE_LAYOUTS - NOTELAYOUTTYPE_NUM];
+
+// Indexed by gSettings.noteLayout. The built in layouts are filled in by loadNoteLayouts.
+static NoteLayout sNoteLayouts[MAX_NOTE_LAYOUTS];
+static int sCurrentNoteLayout = -1;
+
+//====================================================================================================
+// Returns the note, 0 for "-", or -1 if the token isn't a note
+static int parseNote(const char* token) {
+  if (strcmp(token, "-") == 0)
+    return NOTE_UNUSED;
+  char* end;
+  if (isdigit((unsigned char)token[0])) {
+    long midiNote = strtol(token, &end, 10);
+    return *end == 0 && midiNote > 0 && midiNote <= 127 ? (int)midiNote : -1;
+  }
+  static const int semitones[7] = { NOTE_AN, NOTE_BN, NOTE_CN, NOTE_DN, NOTE_EN, NOTE_FN, NOTE_GN };
+  char letter = toupper((unsigned char)token[0]);
+  if (letter < 'A' || letter > 'G')
+    return -1;
+  int semitone = semitones[letter - 'A'];
+  ++token;
+  if (*token == '#') {
+    ++semitone;
+    ++token;
+  } else if (*token == 'b') {
+    --semitone;
+    ++token;
+  }
+  if (!isdigit((unsigned char)token[0]))
+    return -1;
+  long octave = strtol(token, &end, 10);
+  int midiNote = 12 + octave * 12 + semitone;
+  return *end == 0 && midiNote > 0 && midiNote <= 127 ? midiNote : -1;
+}
+
+//====================================================================================================
+// Parses the text of a layout file (which is modified). Reports any problems to Serial.
+static bool compileNoteLayout(char* text, const char* name, CompiledNoteLayout& layout) {
+  uint8_t* tables[2][2] = { { layout.mLeft[0], layout.mLeft[1] }, { layout.mRight[0], layout.mRight[1] } };
+  int counts[2][2] = {};
+  uint8_t* table = nullptr;
+  int* count = nullptr;
+  int side = LEFT;
+  int lineNumber = 0;
+
+  for (char* line = text; line; ) {
+    char* nextLine = strchr(line, '\n');
+    if (nextLine)
+      *nextLine++ = 0;
+    ++lineNumber;
+    // # is also a sharp, so comments need to be a separate word
+    for (char* c = line; *c; ++c) {
+      if (*c == '#' && (c == line || isspace((unsigned char)c[-1]))) {
+        *c = 0;
         break;
+      }
+    }
+    char* words[64];
+    int numWords = 0;
+    char* save;
+    for (char* word = strtok_r(line, " \t\r,", &save); word && numWords != 64; word = strtok_r(nullptr, " \t\r,", &save))
+      words[numWords++] = word;
+    line = nextLine;
+    if (numWords == 0)
+      continue;
+
+    if (numWords == 2 && (strcmp(words[0], "left") == 0 || strcmp(words[0], "right") == 0)) {
+      side = strcmp(words[0], "left") == 0 ? LEFT : RIGHT;
+      int direction = strcmp(words[1], "open") == 0 ? 0 : (strcmp(words[1], "close") == 0 ? 1 : -1);
+      if (direction < 0) {
+        Serial.printf("Layout %s line %d: expected open or close\n", name, lineNumber);
+        return false;
+      }
+      table = tables[side][direction];
+      count = &counts[side][direction];
+      continue;
+    }
+
+    if (!table) {
+      Serial.printf("Layout %s line %d: notes before a section\n", name, lineNumber);
+      return false;
+    }
+    for (int i = 0; i != numWords; ++i) {
+      int midiNote = parseNote(words[i]);
+      if (midiNote < 0) {
+        Serial.printf("Layout %s line %d: %s isn't a note\n", name, lineNumber, words[i]);
+        return false;
+      }
+      if (*count == PinInputs::keyCounts[side]) {
+        Serial.printf("Layout %s line %d: more than %d notes\n", name, lineNumber, PinInputs::keyCounts[side]);
+        return false;
+      }
+      table[(*count)++] = (uint8_t)midiNote;
+    }
+  }
+
+  for (side = 0; side != 2; ++side) {
+    if (counts[side][0] != PinInputs::keyCounts[side]) {
+      Serial.printf("Layout %s: %s open has %d notes, expected %d\n",
+                    name, side == LEFT ? "left" : "right", counts[side][0], PinInputs::keyCounts[side]);
+      return false;
+    }
+    if (counts[side][1] == 0)
+      memcpy(tables[side][1], tables[side][0], PinInputs::keyCounts[side]);
+    else if (counts[side][1] != PinInputs::keyCounts[side]) {
+      Serial.printf("Layout %s: %s close has %d notes, expected %d\n",
+                    name, side == LEFT ? "left" : "right", counts[side][1], PinInputs::keyCounts[side]);
+      return false;
     }
-    gSettings.updateMIDIRange();
   }
+  strncpy(layout.mName, name, MAX_NOTE_LAYOUT_NAME - 1);
+  layout.mName[MAX_NOTE_LAYOUT_NAME - 1] = 0;
+  return true;
+}
+
+//====================================================================================================
+static NoteLayoutCacheHeader makeCacheHeader(File& source) {
+  NoteLayoutCacheHeader header;
+  header.mMagic = NOTE_LAYOUT_CACHE_MAGIC;
+  header.mKeyCounts[LEFT] = PinInputs::keyCounts[LEFT];
+  header.mKeyCounts[RIGHT] = PinInputs::keyCounts[RIGHT];
+  header.mSourceSize = (uint32_t)source.size();
+  header.mSourceTime = 0;
+  DateTimeFields time;
+  if (source.getModifyTime(time))
+    header.mSourceTime = ((uint32_t)(time.year % 64) << 26) | ((uint32_t)time.mon << 22) | ((uint32_t)time.mday << 17)
+                         | ((uint32_t)time.hour << 12) | ((uint32_t)time.min << 6) | time.sec;
+  header.mSize = sizeof(CompiledNoteLayout);
+  return header;
+}
+
+//====================================================================================================
+static bool readNoteLayoutCache(const char* path, const NoteLayoutCacheHeader& expected, CompiledNoteLayout& layout) {
+  File file = SD.open(path, FILE_READ);
+  if (!file)
+    return false;
+  NoteLayoutCacheHeader header;
+  bool ok = file.read(&header, sizeof(header)) == sizeof(header) && memcmp(&header, &expected, sizeof(header)) == 0
+            && file.read(&layout, sizeof(layout)) == sizeof(layout);
+  file.close();
+  return ok;
+}
+
+//====================================================================================================
+static void writeNoteLayoutCache(const char* path, const NoteLayoutCacheHeader& header, const CompiledNoteLayout& layout) {
+  SD.remove(path);
+  File file = SD.open(path, FILE_WRITE);
+  if (!file) {
+    Serial.printf("Failed to write %s\n", path);
+    return;
+  }
+  file.write(&header, sizeof(header));
+  file.write(&layout, sizeof(layout));
+  file.close();
+}
+
+//====================================================================================================
+static bool loadNoteLayout(const char* name, CompiledNoteLayout& layout) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/%s.txt", NOTE_LAYOUT_DIRECTORY, name);
+  File source = SD.open(path, FILE_READ);
+  if (!source)
+    return false;
+  NoteLayoutCacheHeader header = makeCacheHeader(source);
+
+  char cachePath[64];
+  snprintf(cachePath, sizeof(cachePath), "%s/%s.bin", NOTE_LAYOUT_DIRECTORY, name);
+  if (readNoteLayoutCache(cachePath, header, layout)) {
+    source.close();
+    return true;
+  }
+
+  if (header.mSourceSize > MAX_NOTE_LAYOUT_FILE_SIZE) {
+    Serial.printf("Layout %s is too big\n", name);
+    source.close();
+    return false;
+  }
+  static char text[MAX_NOTE_LAYOUT_FILE_SIZE + 1];
+  size_t size = source.read(text, header.mSourceSize);
+  source.close();
+  text[size] = 0;
+  if (!compileNoteLayout(text, name, layout))
+    return false;
+  Serial.printf("Compiled layout %s\n", name);
+  writeNoteLayoutCache(cachePath, header, layout);
+  return true;
+}
+
+//====================================================================================================
+void loadNoteLayouts() {
+  NoteLayout builtInLayouts[NOTELAYOUTTYPE_NUM] = {
+    manoury1NoteLayout, manoury2NoteLayout, tango142NoteLayout, hayden1NoteLayout, hayden2NoteLayout
+  };
+  for (int i = 0; i != NOTELAYOUTTYPE_NUM; ++i)
+    sNoteLayouts[i] = builtInLayouts[i];
+  gNumNoteLayouts = NOTELAYOUTTYPE_NUM;
+
+  if (!initCard())
+    return;
+  File directory = SD.open(NOTE_LAYOUT_DIRECTORY);
+  if (!directory || !directory.isDirectory())
+    return;
+
+  // Sorted by name, so the menu order doesn't depend on the card. The settings save the layout's
+  // name as well as its index, so adding or removing a file doesn't move them onto another layout.
+  const int maxLayouts = MAX_NOTE_LAYOUTS - NOTELAYOUTTYPE_NUM;
+  char names[maxLayouts][MAX_NOTE_LAYOUT_NAME];
+  int numNames = 0;
+  for (File file = directory.openNextFile(); file; file = directory.openNextFile()) {
+    const char* fileName = file.name();
+    size_t length = strlen(fileName);
+    if (!file.isDirectory() && length > 4 && length - 4 < MAX_NOTE_LAYOUT_NAME
+        && strcasecmp(fileName + length - 4, ".txt") == 0 && numNames != maxLayouts) {
+      char name[MAX_NOTE_LAYOUT_NAME];
+      memcpy(name, fileName, length - 4);
+      name[length - 4] = 0;
+      int i = numNames++;
+      for (; i > 0 && strcmp(names[i - 1], name) > 0; --i)
+        memcpy(names[i], names[i - 1], MAX_NOTE_LAYOUT_NAME);
+      memcpy(names[i], name, MAX_NOTE_LAYOUT_NAME);
+    }
+    file.close();
+  }
+  directory.close();
+
+  int numLoaded = 0;
+  for (int i = 0; i != numNames; ++i) {
+    CompiledNoteLayout& layout = sCompiledNoteLayouts[numLoaded];
+    if (!loadNoteLayout(names[i], layout))
+      continue;
+    sNoteLayouts[gNumNoteLayouts] = { layout.mLeft[0], layout.mRight[0], layout.mLeft[1], layout.mRight[1], layout.mName };
+    gNoteLayoutNames[gNumNoteLayouts] = layout.mName;
+    ++gNumNoteLayouts;
+    ++numLoaded;
+  }
+  Serial.printf("Loaded %d layouts from the SD card\n", numLoaded);
+}
+
+//====================================================================================================
+void syncNoteLayout() {
+  if (gSettings.noteLayout == sCurrentNoteLayout)
+    return;
+  if (!sNoteLayouts[0].mLeftOpen)
+    loadNoteLayouts();
+  gSettings.noteLayout = std::clamp(gSettings.noteLayout, 0, gNumNoteLayouts - 1);
+  Serial.printf("Switching to %s\n", getNoteLayoutName());
+  // The layout is just pointers to its tables, so this swaps it in between frames
+  gBigState.mNoteLayout = sNoteLayouts[gSettings.noteLayout];
+  sCurrentNoteLayout = gSettings.noteLayout;
+  gSettings.updateMIDIRange();
 }
@@ -5,6 +5,7 @@
 
 struct Settings;
 
+// The built in layouts. Layouts loaded from the SD card follow these.
 enum NoteLayoutType {
   NOTELAYOUTTYPE_MANOURY1,
   NOTELAYOUTTYPE_MANOURY2,
@@ -31,15 +32,27 @@ struct NoteLayout {
   const char* mName = "none";
 };
 
-extern const char* gNoteLayoutNames[];
+// Built in plus SD card layouts
+const int MAX_NOTE_LAYOUTS = 16;
+const int MAX_NOTE_LAYOUT_NAME = 16;
+
+extern const char* gNoteLayoutNames[MAX_NOTE_LAYOUTS];
+extern int gNumNoteLayouts;
 
 const char* getNoteLayoutName();
 
+// The index (for Settings::noteLayout) of the layout with this name, or -1 if there isn't one
+int findNoteLayout(const char* name);
+
+// Adds the layouts in /layouts on the SD card (see NoteLayouts.cpp for the format) after the built
+// in ones. Call once, before the settings and menu are set up.
+void loadNoteLayouts();
+
 // This updates the state to have the note arrays to match what is in settings
 void syncNoteLayout();
 
 // The "action" keys - i.e. hot keys that could be mapped to things like zeroBellows. 
-// Check them with something like gBigState.activeKeysRight[gActionKey1]
+// Check them with something like gBigState.isKeyActive(RIGHT, gActionKey1)
 extern const int gActionKey1;
 extern const int gActionKey2;
 
@@ -12,10 +12,10 @@ static constexpr uint8_t columnPinsRight[columnCounts[1]] = { 21, 20, 9, 8, 7, 6
 static constexpr uint8_t rowPinsLeft[rowCounts[0]] = { 32, 31, 30, 29, 28, 27, 26, 25 };
 static constexpr uint8_t rowPinsRight[rowCounts[1]] = { 40, 39, 38, 37, 36, 35, 34, 33 };
 
-inline const uint8_t* columnPins(int side) {
+constexpr const uint8_t* columnPins(int side) {
   return side ? columnPinsRight : columnPinsLeft;
 }
-inline const uint8_t* rowPins(int side) {
+constexpr const uint8_t* rowPins(int side) {
   return side ? rowPinsRight : rowPinsLeft;
 }
 
@@ -0,0 +1,229 @@
+#ifndef PRESSUREFILTER_H
+#define PRESSUREFILTER_H
+
+#include <math.h>
+#include <stdint.h>
+
+enum PressureFilterType {
+  PRESSURE_FILTER_NONE,      // Raw samples, held between samples
+  PRESSURE_FILTER_ONE_EURO,  // Low pass whose cutoff rises with the rate of change
+  PRESSURE_FILTER_KALMAN,    // Estimates pressure and its rate, assuming roughly constant rate
+  PRESSURE_FILTER_NUM
+};
+
+// Smooths the bellows pressure, and estimates its rate of change so that the pressure can be
+// extrapolated between load cell samples. Samples are added as they arrive (at about 80Hz), and the
+// pressure can then be read at any later time.
+//
+// There are no hardware dependencies, so recorded pressure traces can be run through it offline
+// (see measurePressureFilter, and Tools/PressureFilterReplay.cpp).
+class PressureFilter {
+public:
+  // Changing the type restarts the filter from the next sample
+  void setType(int type) {
+    if (type != mType)
+      reset();
+    mType = type;
+  }
+
+  int getType() const {
+    return mType;
+  }
+
+  // Forgets the samples - the next one is taken as is
+  void reset() {
+    mNumSamples = 0;
+  }
+
+  // 0 tracks the samples closely (about 20Hz bandwidth), 1 is heavily smoothed (about 0.5Hz)
+  void setSmoothing(float smoothing) {
+    smoothing = smoothing < 0.0f ? 0.0f : (smoothing > 1.0f ? 1.0f : smoothing);
+    mBandwidthHz = 20.0f * powf(0.025f, smoothing);
+  }
+
+  // Standard deviation of the noise in the samples. Only used by the Kalman filter.
+  void setNoise(float noise) {
+    mNoiseVariance = noise * noise;
+  }
+
+  void addSample(float pressure, uint32_t timeMicros) {
+    if (mNumSamples == 0) {
+      mPressure = pressure;
+      mRate = 0.0f;
+      mCovariance[0][0] = mNoiseVariance;
+      mCovariance[0][1] = mCovariance[1][0] = 0.0f;
+      mCovariance[1][1] = 1.0f;
+    } else {
+      float dt = (timeMicros - mTimeMicros) * 1e-6f;
+      if (dt <= 0.0f)
+        return;
+      mAverageInterval += (dt - mAverageInterval) * (mNumSamples == 1 ? 1.0f : 0.1f);
+
+      switch (mType) {
+        case PRESSURE_FILTER_ONE_EURO: updateOneEuro(pressure, dt); break;
+        case PRESSURE_FILTER_KALMAN: updateKalman(pressure, dt); break;
+        default:
+          mRate = (pressure - mPressure) / dt;
+          mPressure = pressure;
+          break;
+      }
+    }
+    mTimeMicros = timeMicros;
+    ++mNumSamples;
+  }
+
+  // The estimated pressure at timeMicros, which should not be before the last sample. With
+  // predict, this extrapolates using the rate, for up to 1.5 sample intervals. The extrapolation
+  // never crosses zero - a reversal is only reported once a sample shows it.
+  float getPressure(uint32_t timeMicros, bool predict) const {
+    if (!predict || mType == PRESSURE_FILTER_NONE || mNumSamples < 2)
+      return mPressure;
+    float dt = (int32_t)(timeMicros - mTimeMicros) * 1e-6f;
+    float maxDt = 1.5f * mAverageInterval;
+    dt = dt < 0.0f ? 0.0f : (dt > maxDt ? maxDt : dt);
+    float pressure = mPressure + mRate * dt;
+    if (pressure * mPressure < 0.0f)
+      return 0.0f;
+    return pressure;
+  }
+
+  // Pressure per second
+  float getRate() const {
+    return mRate;
+  }
+
+  uint32_t getNumSamples() const {
+    return mNumSamples;
+  }
+
+private:
+  //====================================================================================================
+  static float lowPassAlpha(float cutoffHz, float dt) {
+    float tau = 1.0f / (2.0f * (float)M_PI * cutoffHz);
+    return 1.0f / (1.0f + tau / dt);
+  }
+
+  //====================================================================================================
+  void updateOneEuro(float pressure, float dt) {
+    // The rate is smoothed with a fixed cutoff, and then used to open up the pressure cutoff, so
+    // that there's little lag when the bellows move quickly, and heavy smoothing when they don't.
+    const float rateCutoffHz = 1.0f;
+    const float beta = 4.0f;
+    float rawRate = (pressure - mPressure) / dt;
+    mRate += (rawRate - mRate) * lowPassAlpha(rateCutoffHz, dt);
+    float cutoffHz = mBandwidthHz + beta * fabsf(mRate);
+    mPressure += (pressure - mPressure) * lowPassAlpha(cutoffHz, dt);
+  }
+
+  //====================================================================================================
+  void updateKalman(float pressure, float dt) {
+    // Constant rate model, driven by random changes in rate. For this model the bandwidth is
+    // about (q / r)^(1/4) rad/s, so the process noise q is derived from that.
+    float omega = 2.0f * (float)M_PI * mBandwidthHz;
+    float q = mNoiseVariance * omega * omega * omega * omega;
+    float (&P)[2][2] = mCovariance;
+
+    // Predict
+    mPressure += mRate * dt;
+    float p00 = P[0][0] + dt * (P[1][0] + P[0][1]) + dt * dt * P[1][1] + q * dt * dt * dt / 3.0f;
+    float p01 = P[0][1] + dt * P[1][1] + q * dt * dt / 2.0f;
+    float p10 = P[1][0] + dt * P[1][1] + q * dt * dt / 2.0f;
+    float p11 = P[1][1] + q * dt;
+
+    // Correct
+    float innovation = pressure - mPressure;
+    float s = p00 + mNoiseVariance;
+    float k0 = p00 / s;
+    float k1 = p10 / s;
+    mPressure += k0 * innovation;
+    mRate += k1 * innovation;
+    P[0][0] = (1.0f - k0) * p00;
+    P[0][1] = (1.0f - k0) * p01;
+    P[1][0] = p10 - k1 * p00;
+    P[1][1] = p11 - k1 * p01;
+  }
+
+  int mType = PRESSURE_FILTER_NONE;
+  float mBandwidthHz = 20.0f;
+  float mNoiseVariance = 1e-4f;
+
+  float mPressure = 0.0f;
+  float mRate = 0.0f;
+  float mCovariance[2][2] = {};
+  float mAverageInterval = 0.0125f;
+  uint32_t mTimeMicros = 0;
+  uint32_t mNumSamples = 0;
+};
+
+// How a filter performs on a recorded trace
+struct PressureFilterReport {
+  float mLatencyMillis = 0.0f;  // Delay of the output that best matches it to the input
+  float mNoise = 0.0f;          // RMS second difference of the output, as a fraction of the input's
+  float mMaxStep = 0.0f;        // Largest change between successive outputs
+};
+
+//====================================================================================================
+// Runs a recorded trace through a copy of filter, reading the output every outputIntervalMicros (as
+// the loop would). The latency is searched for in 1ms steps, up to maxLatencyMillis.
+inline PressureFilterReport measurePressureFilter(
+  PressureFilter filter, const float pressures[], const uint32_t timesMicros[], int count,
+  uint32_t outputIntervalMicros, bool predict, int maxLatencyMillis = 100) {
+  PressureFilterReport report;
+  if (count < 3)
+    return report;
+  filter.reset();
+  const PressureFilter initialFilter = filter;
+
+  // Noise, compared at the sample times, and steps at the output rate
+  double outputSum = 0.0, inputSum = 0.0;
+  float outputs[3] = {}, lastOutput = 0.0f;
+  for (int i = 0; i != count; ++i) {
+    if (i != 0) {
+      for (uint32_t t = timesMicros[i - 1] + outputIntervalMicros; (int32_t)(timesMicros[i] - t) > 0; t += outputIntervalMicros) {
+        float output = filter.getPressure(t, predict);
+        report.mMaxStep = fmaxf(report.mMaxStep, fabsf(output - lastOutput));
+        lastOutput = output;
+      }
+    }
+    filter.addSample(pressures[i], timesMicros[i]);
+    float output = filter.getPressure(timesMicros[i], predict);
+    if (i != 0)
+      report.mMaxStep = fmaxf(report.mMaxStep, fabsf(output - lastOutput));
+    lastOutput = output;
+
+    outputs[0] = outputs[1];
+    outputs[1] = outputs[2];
+    outputs[2] = output;
+    if (i >= 2) {
+      float outputDiff2 = outputs[2] - 2.0f * outputs[1] + outputs[0];
+      float inputDiff2 = pressures[i] - 2.0f * pressures[i - 1] + pressures[i - 2];
+      outputSum += outputDiff2 * outputDiff2;
+      inputSum += inputDiff2 * inputDiff2;
+    }
+  }
+  report.mNoise = inputSum > 0.0 ? (float)sqrt(outputSum / inputSum) : 0.0f;
+
+  // Latency - compare each sample with the output that was available latency later
+  double bestError = -1.0;
+  for (int latencyMillis = 0; latencyMillis <= maxLatencyMillis; ++latencyMillis) {
+    filter = initialFilter;
+    double error = 0.0;
+    int iNext = 0;
+    for (int i = 0; i != count; ++i) {
+      uint32_t t = timesMicros[i] + latencyMillis * 1000;
+      while (iNext != count && (int32_t)(t - timesMicros[iNext]) >= 0) {
+        filter.addSample(pressures[iNext], timesMicros[iNext]);
+        ++iNext;
+      }
+      float diff = filter.getPressure(t, predict) - pressures[i];
+      error += diff * diff;
+    }
+    if (bestError < 0.0 || error < bestError) {
+      bestError = error;
+      report.mLatencyMillis = (float)latencyMillis;
+    }
+  }
+  return report;
+}
+
+#endif
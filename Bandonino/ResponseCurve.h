@@ -0,0 +1,137 @@
+#ifndef RESPONSECURVE_H
+#define RESPONSECURVE_H
+
+#include <stdint.h>
+
+const int MAX_RESPONSE_CURVE_POINTS = 8;
+
+// Maps pressure to output, as percentages. The curve is linear between the points, and flat
+// outside them. Inputs should be increasing - any that aren't are treated as equal to the previous
+// one, making a step, except at the end, where they're ignored.
+//
+// The points past mNumPoints are kept as copies of the last one, so that raising mNumPoints (in the
+// menu) adds a point at the end of the curve, rather than one at 0, 0 that would silence it.
+struct ResponseCurvePoints {
+  int mNumPoints;
+  int mInputs[MAX_RESPONSE_CURVE_POINTS];
+  int mOutputs[MAX_RESPONSE_CURVE_POINTS];
+
+  bool operator==(const ResponseCurvePoints& other) const {
+    if (mNumPoints != other.mNumPoints)
+      return false;
+    for (int i = 0; i != mNumPoints; ++i) {
+      if (mInputs[i] != other.mInputs[i] || mOutputs[i] != other.mOutputs[i])
+        return false;
+    }
+    return true;
+  }
+
+  void fillUnusedPoints() {
+    for (int i = mNumPoints; i < MAX_RESPONSE_CURVE_POINTS; ++i) {
+      mInputs[i] = mInputs[mNumPoints - 1];
+      mOutputs[i] = mOutputs[mNumPoints - 1];
+    }
+  }
+};
+
+// Matches the original dead zone 10%, attack 25/55/75% settings
+const ResponseCurvePoints DEFAULT_RESPONSE_CURVE = {
+  6, { 0, 10, 33, 55, 78, 100, 100, 100 }, { 0, 0, 25, 55, 75, 100, 100, 100 }
+};
+
+//====================================================================================================
+// Makes the curve equivalent to the original dead zone and attack settings: the pressure is
+// rescaled to remove the dead zone, and the attack values are the outputs at 25%, 50% and 75%.
+inline ResponseCurvePoints makeAttackResponseCurve(int deadzone, int attack25, int attack50, int attack75) {
+  ResponseCurvePoints curve = {};
+  auto addPoint = [&curve](int input, int output) {
+    curve.mInputs[curve.mNumPoints] = input;
+    curve.mOutputs[curve.mNumPoints] = output;
+    ++curve.mNumPoints;
+  };
+  if (deadzone > 0)
+    addPoint(0, 0);
+  addPoint(deadzone, 0);
+  addPoint(deadzone + ((100 - deadzone) * 1 + 2) / 4, attack25);
+  addPoint(deadzone + ((100 - deadzone) * 2 + 2) / 4, attack50);
+  addPoint(deadzone + ((100 - deadzone) * 3 + 2) / 4, attack75);
+  addPoint(100, 100);
+  curve.fillUnusedPoints();
+  return curve;
+}
+
+// A response curve compiled into a table, so that applying it is a lookup and one interpolation,
+// in fixed point.
+class ResponseCurve {
+public:
+  static constexpr int TABLE_BITS = 8;
+  static constexpr int TABLE_SIZE = 1 << TABLE_BITS;
+
+  // Rebuilds the table if the points have changed. Returns true if it was rebuilt.
+  bool update(const ResponseCurvePoints& points) {
+    if (mIsCompiled && points == mPoints)
+      return false;
+    mPoints = points;
+    compile();
+    mIsCompiled = true;
+    return true;
+  }
+
+  // Takes and returns values between 0 and 1
+  float apply(float pressure) const {
+    if (!(pressure > 0.0f))
+      return mTable[0] * (1.0f / 65535.0f);
+    if (pressure >= 1.0f)
+      return mTable[TABLE_SIZE] * (1.0f / 65535.0f);
+    // Index in the top bits, 8 bits of fraction for the interpolation
+    uint32_t position = (uint32_t)(pressure * (TABLE_SIZE << 8));
+    uint32_t index = position >> 8;
+    int32_t fraction = position & 0xff;
+    int32_t value = mTable[index] + (((mTable[index + 1] - mTable[index]) * fraction) >> 8);
+    return value * (1.0f / 65535.0f);
+  }
+
+private:
+  //====================================================================================================
+  void compile() {
+    int numPoints = mPoints.mNumPoints < 1 ? 1 : (mPoints.mNumPoints > MAX_RESPONSE_CURVE_POINTS ? MAX_RESPONSE_CURVE_POINTS : mPoints.mNumPoints);
+    float inputs[MAX_RESPONSE_CURVE_POINTS];
+    float outputs[MAX_RESPONSE_CURVE_POINTS];
+    for (int i = 0; i != numPoints; ++i) {
+      inputs[i] = clampPercent(mPoints.mInputs[i]);
+      if (i != 0 && inputs[i] < inputs[i - 1])
+        inputs[i] = inputs[i - 1];
+      outputs[i] = clampPercent(mPoints.mOutputs[i]);
+    }
+    // Points at the end that don't move on would otherwise replace the end of the curve
+    while (numPoints > 1 && inputs[numPoints - 1] == inputs[numPoints - 2])
+      --numPoints;
+
+    int iPoint = 0;
+    for (int i = 0; i <= TABLE_SIZE; ++i) {
+      float input = 100.0f * i / TABLE_SIZE;
+      while (iPoint != numPoints && inputs[iPoint] <= input)
+        ++iPoint;
+      float output;
+      if (iPoint == 0) {
+        output = outputs[0];
+      } else if (iPoint == numPoints) {
+        output = outputs[numPoints - 1];
+      } else {
+        float t = (input - inputs[iPoint - 1]) / (inputs[iPoint] - inputs[iPoint - 1]);
+        output = outputs[iPoint - 1] + t * (outputs[iPoint] - outputs[iPoint - 1]);
+      }
+      mTable[i] = (uint16_t)(output * (65535.0f / 100.0f) + 0.5f);
+    }
+  }
+
+  static float clampPercent(int value) {
+    return (float)(value < 0 ? 0 : (value > 100 ? 100 : value));
+  }
+
+  ResponseCurvePoints mPoints = {};
+  bool mIsCompiled = false;
+  uint16_t mTable[TABLE_SIZE + 1] = {};
+};
+
+#endif
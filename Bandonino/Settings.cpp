@@ -9,17 +9,50 @@
 #include <SPI.h>
 
 #include <algorithm>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
 
 Settings gSettings;
 
+//====================================================================================================
+template<typename T> constexpr SettingType getSettingType();
+template<> constexpr SettingType getSettingType<bool>() { return SETTING_TYPE_BOOL; }
+template<> constexpr SettingType getSettingType<uint8_t>() { return SETTING_TYPE_UINT8; }
+template<> constexpr SettingType getSettingType<int>() { return SETTING_TYPE_INT; }
+template<> constexpr SettingType getSettingType<long>() { return SETTING_TYPE_LONG; }
+
+#define SETTING_INFO(id, field, minValue, maxValue, step, flags) \
+  { #field, offsetof(Settings, field), \
+    getSettingType<std::remove_reference_t<decltype(((Settings*)nullptr)->field)>>(), \
+    flags, minValue, maxValue, step },
+const SettingInfo gSettingInfos[SETTING_NUM] = {
+  SETTINGS_SCHEMA(SETTING_INFO)
+};
+#undef SETTING_INFO
+
 const char* gExpressionNames[] = {
-  "Volume", "Velocity"
+  "Volume", "Velocity", "Poly AT"
 };
 
 const char* gNoteDisplayNames[] = {
   "Stacked", "Placed"
 };
 
+const char* gKeyScanModeNames[] = {
+  "Sequential", "Paired"
+};
+
+const char* gPressureFilterNames[] = {
+  "None", "1 Euro", "Kalman"
+};
+
+const char* gMidiModeNames[] = {
+  "Channel", "MPE"
+};
+
 //====================================================================================================
 void Settings::updateMIDIRange() {
   midiMin = 127;
@@ -36,14 +69,65 @@ void Settings::updateMIDIRange() {
   }
 }
 
+// The binary image is this header followed by the bytes of Settings. The image is only accepted by
+// a build with the same layout of Settings.
+struct SettingsImageHeader {
+  uint32_t mMagic;
+  uint32_t mVersion;  // See getSettingsImageVersion
+  uint32_t mCrc;      // Of the settings bytes
+};
+const uint32_t SETTINGS_IMAGE_MAGIC = 0x53424e42;  // "BNBS"
+static_assert(SETTINGS_IMAGE_SIZE == sizeof(SettingsImageHeader) + sizeof(Settings), "SETTINGS_IMAGE_SIZE is wrong");
+
+// The background writer goes through these steps, one per call, so no single loop is held up for
+// long. The data is written a sector at a time. Each write is either the image of gSettings, or a
+// slot as JSON.
+enum SettingsWriteStep {
+  SETTINGS_WRITE_IDLE,
+  SETTINGS_WRITE_OPEN,
+  SETTINGS_WRITE_DATA,
+  SETTINGS_WRITE_COMMIT
+};
+// How long the settings have to be left alone before they're written, and how long to wait after
+// a failure before trying again
+const uint32_t SETTINGS_WRITE_DELAY_MILLIS = 1000;
+const size_t SETTINGS_WRITE_CHUNK = 512;
+static_assert(SETTINGS_IMAGE_SIZE <= MAX_SETTINGS_JSON, "The write buffer is too small for the image");
+
+static SettingsWriteStep sSettingsWriteStep = SETTINGS_WRITE_IDLE;
+static bool sSettingsDirty = false;
+static uint32_t sSettingsDirtyTimeMillis = 0;
+static uint32_t sSettingsRetryTimeMillis = 0;
+static int sSettingsWriteSlot = -1;  // The slot being written, or -1 for the image
+static char sSettingsWriteFilename[32];
+static uint8_t sSettingsWriteData[MAX_SETTINGS_JSON];
+static size_t sSettingsWriteLength = 0;
+static size_t sSettingsWritten = 0;
+static uint32_t sSettingsWriteMicros = 0;  // Time spent on the current write so far
+static File sSettingsFile;
+static SettingsWriterStats sSettingsWriterStats;
+
+// Copies of the slot files, so they can be loaded and saved without waiting for the card
+static Settings sSlots[NUM_SETTINGS_SLOTS];
+static bool sSlotsUsed[NUM_SETTINGS_SLOTS] = {};
+static bool sSlotsDirty[NUM_SETTINGS_SLOTS] = {};
+
+// Applied at the start of the next loop
+static Settings sPendingSettings;
+static bool sSettingsPending = false;
+
 //====================================================================================================
 bool initCard() {
+  static bool sCardInitialised = false;
+  if (sCardInitialised)
+    return true;
   Serial.print("Initializing SD card...");
   if (!SD.begin(BUILTIN_SDCARD)) {
     Serial.println("initialization failed!");
     return false;
   }
   Serial.println("initialization done.");
+  sCardInitialised = true;
   return true;
 }
 
@@ -68,76 +152,339 @@ void printFile(const char* filename) {
 }
 
 //====================================================================================================
-bool Settings::writeToCard(const char* filename) {
+static long getSettingValue(const Settings& settings, const SettingInfo& info) {
+  const uint8_t* value = (const uint8_t*)&settings + info.mOffset;
+  switch (info.mType) {
+  case SETTING_TYPE_BOOL: return *(const bool*)value;
+  case SETTING_TYPE_UINT8: return *value;
+  case SETTING_TYPE_INT: return *(const int*)value;
+  default: return *(const long*)value;
+  }
+}
+
+//====================================================================================================
+// Clamps to the setting's range
+static void setSettingValue(Settings& settings, const SettingInfo& info, long newValue) {
+  newValue = std::clamp(newValue, info.mMinValue, info.mMaxValue);
+  uint8_t* value = (uint8_t*)&settings + info.mOffset;
+  switch (info.mType) {
+  case SETTING_TYPE_BOOL: *(bool*)value = newValue != 0; break;
+  case SETTING_TYPE_UINT8: *value = (uint8_t)newValue; break;
+  case SETTING_TYPE_INT: *(int*)value = (int)newValue; break;
+  default: *(long*)value = newValue; break;
+  }
+}
+
+//====================================================================================================
+int* getIntSetting(Settings& settings, SettingId id) {
+  const SettingInfo& info = gSettingInfos[id];
+  return info.mType == SETTING_TYPE_INT ? (int*)((uint8_t*)&settings + info.mOffset) : nullptr;
+}
+
+//====================================================================================================
+// Appends to the JSON being written. Once it's run out of space, length is left past the end, so
+// the caller only needs to check at the end.
+static void appendJson(char* buffer, size_t size, size_t& length, const char* format, ...) {
+  if (length >= size)
+    return;
+  va_list args;
+  va_start(args, format);
+  length += vsnprintf(buffer + length, size - length, format, args);
+  va_end(args);
+}
+
+//====================================================================================================
+// Curves are stored as a flat array of input, output pairs
+static void writeResponseCurve(char* buffer, size_t size, size_t& length, const char* name, const ResponseCurvePoints& curve) {
+  appendJson(buffer, size, length, ",\"%s\":[", name);
+  for (int i = 0; i != curve.mNumPoints; ++i)
+    appendJson(buffer, size, length, "%s%d,%d", i ? "," : "", curve.mInputs[i], curve.mOutputs[i]);
+  appendJson(buffer, size, length, "]");
+}
+
+//====================================================================================================
+static bool readResponseCurve(JsonDocument& doc, const char* name, ResponseCurvePoints& curve) {
+  JsonArray points = doc[name].as<JsonArray>();
+  if (points.isNull() || points.size() < 4)
+    return false;
+  curve.mNumPoints = std::min((int)points.size() / 2, MAX_RESPONSE_CURVE_POINTS);
+  for (int i = 0; i != curve.mNumPoints; ++i) {
+    curve.mInputs[i] = std::clamp(points[2 * i] | 0, 0, 100);
+    curve.mOutputs[i] = std::clamp(points[2 * i + 1] | 0, 0, 100);
+  }
+  return true;
+}
+
+//====================================================================================================
+size_t Settings::serialize(char* buffer, size_t size) const {
+  size_t length = 0;
+  const char* separator = "{";
+  for (const SettingInfo& info : gSettingInfos) {
+    if (!(info.mFlags & SETTING_SAVED))
+      continue;
+    long value = getSettingValue(*this, info);
+    if (info.mType == SETTING_TYPE_BOOL)
+      appendJson(buffer, size, length, "%s\"%s\":%s", separator, info.mName, value ? "true" : "false");
+    else
+      appendJson(buffer, size, length, "%s\"%s\":%ld", separator, info.mName, value);
+    separator = ",";
+  }
+  appendJson(buffer, size, length, ",\"noteLayoutName\":\"%s\"",
+             gNoteLayoutNames[std::clamp(noteLayout, 0, gNumNoteLayouts - 1)]);
+  writeResponseCurve(buffer, size, length, "responseCurves[LEFT]", responseCurves[LEFT]);
+  writeResponseCurve(buffer, size, length, "responseCurves[RIGHT]", responseCurves[RIGHT]);
+  appendJson(buffer, size, length, "}");
+
+  // Zero if it doesn't fit
+  return length < size ? length : 0;
+}
+
+//====================================================================================================
+bool Settings::writeToCard(const char* filename) const {
+  uint32_t startMicros = micros();
   if (!initCard())
     return false;
 
+  char json[MAX_SETTINGS_JSON];
+  size_t length = serialize(json, sizeof(json));
+  if (length == 0) {
+    Serial.printf("Failed to serialize JSON to file %s\n", filename);
+    return false;
+  }
+
   SD.remove(filename);
   File file = SD.open(filename, FILE_WRITE);
   if (!file) {
-    Serial.printf("Failed to create file %f\n", filename);
+    Serial.printf("Failed to create file %s\n", filename);
+    return false;
+  }
+  bool written = file.write(json, length) == length;
+  file.close();
+  if (!written) {
+    Serial.printf("Failed to write file %s\n", filename);
     return false;
   }
 
-  JsonDocument doc;
-#define WRITE_SETTING(x) doc[#x] = x;
-  WRITE_SETTING(slot);
-  WRITE_SETTING(noteLayout);
-  WRITE_SETTING(forceBellows);
-  WRITE_SETTING(zeroLoadReading);
-  WRITE_SETTING(expressions[LEFT]);
-  WRITE_SETTING(expressions[RIGHT]);
-  WRITE_SETTING(maxVelocity[LEFT]);
-  WRITE_SETTING(maxVelocity[RIGHT]);
-  WRITE_SETTING(noteOffVelocity[LEFT]);
-  WRITE_SETTING(noteOffVelocity[RIGHT]);
-  WRITE_SETTING(octave[LEFT]);
-  WRITE_SETTING(octave[RIGHT]);
-  WRITE_SETTING(transpose);
-  WRITE_SETTING(pressureGain);
-  WRITE_SETTING(debounceTime);
-  WRITE_SETTING(midiChannels[LEFT]);
-  WRITE_SETTING(midiChannels[RIGHT]);
-  WRITE_SETTING(midiInstruments[LEFT]);
-  WRITE_SETTING(midiInstruments[RIGHT]);
-  WRITE_SETTING(metronomeEnabled);
-  WRITE_SETTING(metronomeBeatsPerMinute);
-  WRITE_SETTING(metronomeBeatsPerBar);
-  WRITE_SETTING(metronomeVolume);
-  WRITE_SETTING(metronomeMidiNotePrimary);
-  WRITE_SETTING(metronomeMidiNoteSecondary);
-  WRITE_SETTING(metronomeMidiChannel);
-  WRITE_SETTING(metronomeMidiInstrument);
-  WRITE_SETTING(metronomeLED);
-  WRITE_SETTING(stereo);
-  WRITE_SETTING(balance);
-  WRITE_SETTING(showFPS);
-  WRITE_SETTING(menuBrightness);
-  WRITE_SETTING(noteDisplay);
-  WRITE_SETTING(accidentalPreference);
-  WRITE_SETTING(accidentalKey);
-  WRITE_SETTING(menuPageIndex);
-  WRITE_SETTING(menuDisplayEnabled);
-  WRITE_SETTING(deadzone);
-  WRITE_SETTING(attack25);
-  WRITE_SETTING(attack50);
-  WRITE_SETTING(attack75);
-  WRITE_SETTING(midiMin);
-  WRITE_SETTING(midiMax);
-
-  if (serializeJson(doc, file) == 0) {
-    Serial.printf("Failed to serialize JSON to file %s\n", filename);
-    file.close();
+  sSettingsWriterStats.mJsonWriteMicros = micros() - startMicros;
+  sSettingsWriterStats.mWorstBlockingMicros = std::max(sSettingsWriterStats.mWorstBlockingMicros, sSettingsWriterStats.mJsonWriteMicros);
+  Serial.printf("Settings written to %s in %luus\n", filename, (unsigned long)sSettingsWriterStats.mJsonWriteMicros);
+  return true;
+}
+
+//====================================================================================================
+void markSettingsDirty() {
+  sSettingsDirty = true;
+  sSettingsDirtyTimeMillis = millis();
+}
+
+//====================================================================================================
+static int getDirtySlot() {
+  for (int slot = 0; slot != NUM_SETTINGS_SLOTS; ++slot) {
+    if (sSlotsDirty[slot])
+      return slot;
+  }
+  return -1;
+}
+
+//====================================================================================================
+bool isSettingsWritePending() {
+  return sSettingsDirty || getDirtySlot() >= 0 || sSettingsWriteStep != SETTINGS_WRITE_IDLE;
+}
+
+//====================================================================================================
+static void getSlotFilename(int slot, char* filename) {
+  sprintf(filename, "Settings%02d.json", slot);
+}
+
+//====================================================================================================
+static void failSettingsWrite(const char* reason) {
+  Serial.printf("Failed to write %s: %s\n", sSettingsWriteFilename, reason);
+  if (sSettingsFile)
+    sSettingsFile.close();
+  ++sSettingsWriterStats.mNumFailures;
+  sSettingsWriteStep = SETTINGS_WRITE_IDLE;
+  // Try again later
+  if (sSettingsWriteSlot >= 0)
+    sSlotsDirty[sSettingsWriteSlot] = true;
+  else
+    sSettingsDirty = true;
+  sSettingsRetryTimeMillis = millis() + SETTINGS_WRITE_DELAY_MILLIS;
+}
+
+//====================================================================================================
+// Takes a snapshot of the next thing to write, so changes made while it's being written go into the
+// next write. Returns false if there's nothing to do yet.
+static bool startSettingsWrite() {
+  uint32_t timeMillis = millis();
+  if ((int32_t)(timeMillis - sSettingsRetryTimeMillis) < 0)
+    return false;
+
+  // The slots were saved explicitly, so they go first
+  sSettingsWriteSlot = getDirtySlot();
+  if (sSettingsWriteSlot >= 0) {
+    sSlotsDirty[sSettingsWriteSlot] = false;
+    getSlotFilename(sSettingsWriteSlot, sSettingsWriteFilename);
+    sSettingsWriteLength = sSlots[sSettingsWriteSlot].serialize((char*)sSettingsWriteData, sizeof(sSettingsWriteData));
+    if (sSettingsWriteLength == 0) {
+      Serial.printf("Failed to serialize JSON to file %s\n", sSettingsWriteFilename);
+      return false;
+    }
+  } else if (sSettingsDirty && timeMillis - sSettingsDirtyTimeMillis >= SETTINGS_WRITE_DELAY_MILLIS) {
+    sSettingsDirty = false;
+    strcpy(sSettingsWriteFilename, SETTINGS_IMAGE_FILENAME);
+    sSettingsWriteLength = gSettings.writeImage(sSettingsWriteData, sizeof(sSettingsWriteData));
+  } else {
     return false;
   }
+  sSettingsWritten = 0;
+  sSettingsWriteMicros = 0;
+  return true;
+}
 
-  file.close();
-  Serial.printf("Settings written to %s\n", filename);
+//====================================================================================================
+void updateSettingsWriter(bool isIdle) {
+  if (!isIdle)
+    return;
+
+  uint32_t startMicros = micros();
+  bool finished = false;
+  switch (sSettingsWriteStep) {
+  case SETTINGS_WRITE_IDLE:
+    if (!startSettingsWrite())
+      return;
+    sSettingsWriteStep = SETTINGS_WRITE_OPEN;
+    break;
+  case SETTINGS_WRITE_OPEN:
+    if (!initCard()) {
+      failSettingsWrite("no card");
+      break;
+    }
+    SD.remove(SETTINGS_TEMP_FILENAME);
+    sSettingsFile = SD.open(SETTINGS_TEMP_FILENAME, FILE_WRITE);
+    if (!sSettingsFile) {
+      failSettingsWrite("can't create file");
+      break;
+    }
+    sSettingsWriteStep = SETTINGS_WRITE_DATA;
+    break;
+  case SETTINGS_WRITE_DATA: {
+    size_t length = std::min(SETTINGS_WRITE_CHUNK, sSettingsWriteLength - sSettingsWritten);
+    if (sSettingsFile.write(sSettingsWriteData + sSettingsWritten, length) != length) {
+      failSettingsWrite("write failed");
+      break;
+    }
+    sSettingsWritten += length;
+    ++sSettingsWriterStats.mNumChunks;
+    if (sSettingsWritten == sSettingsWriteLength)
+      sSettingsWriteStep = SETTINGS_WRITE_COMMIT;
+    break;
+  }
+  case SETTINGS_WRITE_COMMIT:
+    // The old file is only replaced once the new one is complete
+    sSettingsFile.close();
+    SD.remove(sSettingsWriteFilename);
+    if (!SD.rename(SETTINGS_TEMP_FILENAME, sSettingsWriteFilename)) {
+      failSettingsWrite("rename failed");
+      break;
+    }
+    ++sSettingsWriterStats.mNumWrites;
+    sSettingsWriteStep = SETTINGS_WRITE_IDLE;
+    finished = true;
+    break;
+  }
+  uint32_t stepMicros = micros() - startMicros;
+  sSettingsWriterStats.mWorstStepMicros = std::max(sSettingsWriterStats.mWorstStepMicros, stepMicros);
+  sSettingsWriteMicros += stepMicros;
+  if (finished)
+    (sSettingsWriteSlot >= 0 ? sSettingsWriterStats.mJsonWriteMicros : sSettingsWriterStats.mImageWriteMicros) = sSettingsWriteMicros;
+}
+
+//====================================================================================================
+void loadSettingsSlots() {
+  if (!initCard())
+    return;
+  for (int slot = 0; slot != NUM_SETTINGS_SLOTS; ++slot) {
+    char filename[32];
+    getSlotFilename(slot, filename);
+    if (!SD.exists(filename))
+      continue;
+    sSlots[slot] = Settings();
+    sSlotsUsed[slot] = sSlots[slot].readFromCard(filename);
+  }
+}
+
+//====================================================================================================
+bool getSettingsSlot(int slot, Settings& settings) {
+  if (slot < 0 || slot >= NUM_SETTINGS_SLOTS || !sSlotsUsed[slot])
+    return false;
+  settings = sSlots[slot];
   return true;
 }
 
+//====================================================================================================
+void storeSettingsSlot(int slot, const Settings& settings) {
+  if (slot < 0 || slot >= NUM_SETTINGS_SLOTS)
+    return;
+  sSlots[slot] = settings;
+  sSlotsUsed[slot] = true;
+  sSlotsDirty[slot] = true;
+}
+
+//====================================================================================================
+void setPendingSettings(const Settings& settings) {
+  sPendingSettings = settings;
+  sSettingsPending = true;
+}
+
+//====================================================================================================
+bool hasPendingSettings() {
+  return sSettingsPending;
+}
+
+//====================================================================================================
+uint64_t getSettingsChanges(const Settings& settings, const Settings& newSettings) {
+  uint64_t changes = 0;
+  for (int id = 0; id != SETTING_NUM; ++id) {
+    if (getSettingValue(settings, gSettingInfos[id]) != getSettingValue(newSettings, gSettingInfos[id]))
+      changes |= settingBit((SettingId)id);
+  }
+  return changes;
+}
+
+//====================================================================================================
+// These belong to the instrument rather than the settings
+static void keepInstrumentSettings(Settings& settings) {
+  settings.zeroLoadReading = gSettings.zeroLoadReading;
+  settings.metronomeEnabled = gSettings.metronomeEnabled;
+}
+
+//====================================================================================================
+uint64_t getPendingSettingsChanges() {
+  if (!sSettingsPending)
+    return 0;
+  keepInstrumentSettings(sPendingSettings);
+  return getSettingsChanges(gSettings, sPendingSettings);
+}
+
+//====================================================================================================
+bool applyPendingSettings() {
+  if (!sSettingsPending)
+    return false;
+  sSettingsPending = false;
+  keepInstrumentSettings(sPendingSettings);
+  gSettings = sPendingSettings;
+  markSettingsDirty();
+  return true;
+}
+
+//====================================================================================================
+const SettingsWriterStats& getSettingsWriterStats() {
+  return sSettingsWriterStats;
+}
+
 //====================================================================================================
 bool Settings::readFromCard(const char* filename) {
+  uint32_t startMicros = micros();
   if (!initCard())
     return false;
   File file = SD.open(filename, FILE_READ);
@@ -154,58 +501,157 @@ bool Settings::readFromCard(const char* filename) {
     return false;
   }
 
+  for (const SettingInfo& info : gSettingInfos) {
+    if (!(info.mFlags & SETTING_LOADED))
+      continue;
+    long value = getSettingValue(*this, info);
+    if (info.mType == SETTING_TYPE_BOOL)
+      value = doc[info.mName] | (value != 0);
+    else
+      value = doc[info.mName] | value;
+    setSettingValue(*this, info, value);
+  }
+  // Files from before the name was saved only have the index
+  if (const char* layoutName = doc["noteLayoutName"].as<const char*>())
+    findNoteLayoutByName(layoutName);
+
 #define READ_SETTING(x) x = doc[#x] | x
+  if (!readResponseCurve(doc, "responseCurves[LEFT]", responseCurves[LEFT])
+      || !readResponseCurve(doc, "responseCurves[RIGHT]", responseCurves[RIGHT])) {
+    // Older files have a single curve described by the dead zone and attack settings
+    int deadzone = 10, attack25 = 25, attack50 = 55, attack75 = 75;
+    READ_SETTING(deadzone);
+    READ_SETTING(attack25);
+    READ_SETTING(attack50);
+    READ_SETTING(attack75);
+    responseCurves[LEFT] = responseCurves[RIGHT] = makeAttackResponseCurve(
+      std::clamp(deadzone, 0, 50), std::clamp(attack25, 0, 100), std::clamp(attack50, 0, 100), std::clamp(attack75, 0, 100));
+  }
+  file.close();
 
-  READ_SETTING(slot);
-  READ_SETTING(noteLayout);
-  READ_SETTING(forceBellows);
-  READ_SETTING(zeroLoadReading);
-  READ_SETTING(expressions[LEFT]);
-  READ_SETTING(expressions[RIGHT]);
-  READ_SETTING(maxVelocity[LEFT]);
-  READ_SETTING(maxVelocity[RIGHT]);
-  READ_SETTING(noteOffVelocity[LEFT]);
-  READ_SETTING(noteOffVelocity[RIGHT]);
-  READ_SETTING(octave[LEFT]);
-  READ_SETTING(octave[RIGHT]);
-  READ_SETTING(transpose);
-  READ_SETTING(pressureGain);
-  READ_SETTING(debounceTime);
-  READ_SETTING(midiChannels[LEFT]);
-  READ_SETTING(midiChannels[RIGHT]);
-  READ_SETTING(midiInstruments[LEFT]);
-  READ_SETTING(midiInstruments[RIGHT]);
-  // READ_SETTING(metronomeEnabled); Never automatically turn it on
-  READ_SETTING(metronomeBeatsPerMinute);
-  READ_SETTING(metronomeBeatsPerBar);
-  READ_SETTING(metronomeVolume);
-  READ_SETTING(metronomeMidiNotePrimary);
-  READ_SETTING(metronomeMidiNoteSecondary);
-  READ_SETTING(metronomeMidiChannel);
-  READ_SETTING(metronomeMidiInstrument);
-  READ_SETTING(metronomeLED);
-  READ_SETTING(stereo);
-  READ_SETTING(balance);
-  READ_SETTING(showFPS);
-  READ_SETTING(menuBrightness);
-  READ_SETTING(noteDisplay);
-  READ_SETTING(accidentalPreference);
-  READ_SETTING(accidentalKey);
-  READ_SETTING(menuPageIndex);
-  READ_SETTING(menuDisplayEnabled);
-  READ_SETTING(deadzone);
-  READ_SETTING(attack25);
-  READ_SETTING(attack50);
-  READ_SETTING(attack75);
-  READ_SETTING(midiMin);
-  READ_SETTING(midiMax);
+  validate();
+
+  sSettingsWriterStats.mJsonReadMicros = micros() - startMicros;
+  Serial.printf("Settings read from %s in %luus\n", filename, (unsigned long)sSettingsWriterStats.mJsonReadMicros);
+  return true;
+}
 
+//====================================================================================================
+void Settings::validate() {
   // Avoid problems reading bad data!
-  slot = std::clamp(slot, 0, 10);
-  menuBrightness = std::clamp(menuBrightness, 4, 16);
+  for (const SettingInfo& info : gSettingInfos)
+    setSettingValue(*this, info, getSettingValue(*this, info));
+  noteLayout = std::min(noteLayout, gNumNoteLayouts - 1);
+  for (int side = 0; side != 2; ++side) {
+    responseCurves[side].mNumPoints = std::clamp(responseCurves[side].mNumPoints, 2, MAX_RESPONSE_CURVE_POINTS);
+    responseCurves[side].fillUnusedPoints();
+  }
+}
+
+//====================================================================================================
+void Settings::findNoteLayoutByName(const char* name) {
+  int index = findNoteLayout(name);
+  if (index < 0) {
+    Serial.printf("Layout %s not found, using %s\n", name, gNoteLayoutNames[Settings().noteLayout]);
+    index = Settings().noteLayout;
+  }
+  noteLayout = index;
+}
+
+//====================================================================================================
+// Standard CRC-32 (as used by zip). The image is small, so there's no table. Pass the CRC so far to
+// carry on from it.
+static uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc = 0) {
+  crc = ~crc;
+  for (size_t i = 0; i != length; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit != 8; ++bit)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
 
+//====================================================================================================
+// A hash of the layout of Settings - its size, and the name, offset and type of everything in it -
+// so an image from a build where the fields have moved (even without the size changing) is ignored,
+// without anyone having to remember to bump a version.
+static uint32_t calculateSettingsImageVersion() {
+  auto add = [](uint32_t crc, uint32_t value) {
+    return crc32((const uint8_t*)&value, sizeof(value), crc);
+  };
+  uint32_t crc = add(0, sizeof(Settings));
+  for (const SettingInfo& info : gSettingInfos) {
+    crc = crc32((const uint8_t*)info.mName, strlen(info.mName), crc);
+    crc = add(crc, info.mOffset);
+    crc = add(crc, info.mType);
+  }
+  // The rest aren't in the schema
+  crc = add(crc, offsetof(Settings, responseCurves));
+  crc = add(crc, sizeof(ResponseCurvePoints));
+  crc = add(crc, offsetof(Settings, noteLayoutName));
+  return crc;
+}
+
+//====================================================================================================
+static uint32_t getSettingsImageVersion() {
+  static const uint32_t sVersion = calculateSettingsImageVersion();
+  return sVersion;
+}
+
+//====================================================================================================
+size_t Settings::writeImage(uint8_t* buffer, size_t size) const {
+  if (size < SETTINGS_IMAGE_SIZE)
+    return 0;
+  SettingsImageHeader header;
+  header.mMagic = SETTINGS_IMAGE_MAGIC;
+  header.mVersion = getSettingsImageVersion();
+  Settings image = *this;
+  strncpy(image.noteLayoutName, gNoteLayoutNames[std::clamp(noteLayout, 0, gNumNoteLayouts - 1)], MAX_NOTE_LAYOUT_NAME - 1);
+  image.noteLayoutName[MAX_NOTE_LAYOUT_NAME - 1] = 0;
+  memcpy(buffer + sizeof(header), &image, sizeof(Settings));
+  header.mCrc = crc32(buffer + sizeof(header), sizeof(Settings));
+  memcpy(buffer, &header, sizeof(header));
+  return SETTINGS_IMAGE_SIZE;
+}
+
+//====================================================================================================
+bool Settings::readImage(const uint8_t* data, size_t length) {
+  SettingsImageHeader header;
+  if (length != SETTINGS_IMAGE_SIZE)
+    return false;
+  memcpy(&header, data, sizeof(header));
+  if (header.mMagic != SETTINGS_IMAGE_MAGIC || header.mVersion != getSettingsImageVersion() ||
+      header.mCrc != crc32(data + sizeof(header), sizeof(Settings)))
+    return false;
+
+  bool origMetronomeEnabled = metronomeEnabled;
+  memcpy(this, data + sizeof(header), sizeof(Settings));
+  metronomeEnabled = origMetronomeEnabled;  // Never automatically turn it on
+  noteLayoutName[MAX_NOTE_LAYOUT_NAME - 1] = 0;
+  findNoteLayoutByName(noteLayoutName);
+  validate();
+  return true;
+}
+
+//====================================================================================================
+bool Settings::readImageFromCard(const char* filename) {
+  uint32_t startMicros = micros();
+  if (!initCard())
+    return false;
+  File file = SD.open(filename, FILE_READ);
+  if (!file)
+    return false;
+
+  uint8_t image[SETTINGS_IMAGE_SIZE];
+  size_t length = file.size() == SETTINGS_IMAGE_SIZE ? file.read(image, SETTINGS_IMAGE_SIZE) : 0;
   file.close();
-  Serial.printf("Settings read from %s\n", filename);
+  if (!readImage(image, length)) {
+    Serial.printf("Settings image %s is invalid or out of date\n", filename);
+    return false;
+  }
+
+  sSettingsWriterStats.mImageReadMicros = micros() - startMicros;
+  Serial.printf("Settings read from %s in %luus\n", filename, (unsigned long)sSettingsWriterStats.mImageReadMicros);
   return true;
 }
 
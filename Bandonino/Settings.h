@@ -3,13 +3,26 @@
 
 #include "NoteLayouts.h"
 #include "NoteNames.h"
+#include "PressureFilter.h"
+#include "ResponseCurve.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #include <limits.h>
 
+// The current settings are kept as a binary image (see Settings::writeImage). JSON is used for the
+// numbered slots, and gSettings.json is still read if there's no image (e.g. after an upgrade).
+const char* const SETTINGS_FILENAME = "gSettings.json";
+const char* const SETTINGS_IMAGE_FILENAME = "gSettings.bin";
+const char* const SETTINGS_TEMP_FILENAME = "gSettings.tmp";
+
+// Most that the settings can take when serialized
+const size_t MAX_SETTINGS_JSON = 4096;
+
 enum Expression {
   EXPRESSION_VOLUME,
   EXPRESSION_VELOCITY,
+  EXPRESSION_POLY_PRESSURE,  // Velocity, then polyphonic key pressure while the note sounds
   EXPRESSION_NUM
 };
 extern const char* gExpressionNames[];
@@ -21,22 +34,47 @@ enum NoteDisplay {
 };
 extern const char* gNoteDisplayNames[];
 
+enum KeyScanMode {
+  KEY_SCAN_MODE_SEQUENTIAL,  // Left then right, one column at a time
+  KEY_SCAN_MODE_PAIRED,      // Left and right columns driven together, pipelined
+  KEY_SCAN_MODE_NUM
+};
+extern const char* gKeyScanModeNames[];
+extern const char* gPressureFilterNames[];
+
+enum MidiMode {
+  MIDI_MODE_CHANNEL,  // Each side on its own channel
+  MIDI_MODE_MPE,      // Each note on its own channel - see Mpe.h
+  MIDI_MODE_NUM
+};
+extern const char* gMidiModeNames[];
+
 struct Settings {
-  int slot;  // settings slot - e.g. 0 to 9
+  int slot = 0;  // settings slot - 0 to NUM_SETTINGS_SLOTS - 1
   int noteLayout = NOTELAYOUTTYPE_MANOURY2;
-  int forceBellows = 0;    // 1 means use opening. -1 means use closing. 0 means use the pressure sensor
+  int forceBellows = 0;    // 1 means use opening. 2 means use closing. 0 means use the pressure sensor
   long zeroLoadReading = LONG_MAX ; // Reasonable LONG_MAX means to measure
   int  zeroLoadOffset = 0; // Will be applied and then immediately zeroed
+  int autoZero = 1;        // Track drift in the zero reading while no keys are held
   int pressureGain = 100;  // Treat as percentage - but it can go above 100
+  int pressureFilter = PRESSURE_FILTER_KALMAN;
+  int pressureSmoothing = 40;  // 0 to 100 - see PressureFilter::setSmoothing
+  int pressurePrediction = 1;  // Extrapolate the pressure between load cell samples
   int expressions[2] = { EXPRESSION_VOLUME, EXPRESSION_VOLUME };
   int maxVelocity[2] = { 126, 126 };
   int noteOffVelocity[2] = { 64, 64 };
   int octave[2] = { 0, 0 };  // up/down in octaves, per side
   int transpose = 0;         // in semitones
 
-  int debounceTime = 0;  // milliseconds. Turns out not to be very helpful
+  // milliseconds that a key must read released before it is released. Presses are never delayed.
+  int debounceTime = 0;
+  int keyScanRate = 2000;  // Hz - how often the keys are scanned in the background (1000 to 4000)
+  int keyScanMode = KEY_SCAN_MODE_PAIRED;
+  int immediateNotes = 1;  // Send notes at the start of the loop, before the menu and display work
 
-  int midiChannels[2] = { 1, 2 };
+  int midiMode = MIDI_MODE_CHANNEL;
+  int polyPressureThreshold = 2;  // Smallest change in a note's pressure that gets sent
+  int midiChannels[2] = { 1, 2 };  // Not used in MPE mode
   int midiInstruments[2] = { -1, -1 };  // -1 means don't send - let the playback system decide
 
   bool metronomeEnabled = false;
@@ -45,9 +83,10 @@ struct Settings {
   int metronomeVolume = 50;
   int metronomeMidiNotePrimary = 60;
   int metronomeMidiNoteSecondary = 80;
-  int metronomeMidiChannel = 3;
+  int metronomeMidiChannel = 9;  // Between the MPE zones
   int metronomeMidiInstrument = 115;  // Appears to be woodblock
   bool metronomeLED = true;
+  int metronomeSync = 1;  // Follow the MIDI clock from the computer, when there is one
 
   // percentages between -100 and 100
   // int pans[2] = { -25, 25 };
@@ -69,26 +108,195 @@ struct Settings {
   int menuPageIndex = 2;
   bool menuDisplayEnabled = true;
 
-  // Shape the pressure response using attack params. As percentages
-  int deadzone = 10;  // pressure is rescaled to remove this %
-  int attack25 = 25;  // output when pressure = 25%
-  int attack50 = 55;  // output when pressure = 50%
-  int attack75 = 75;  // output when pressure = 75%
+  // Shape the pressure response, per side. These replace the old deadzone and attack25/50/75
+  // settings, which are converted when reading older files.
+  ResponseCurvePoints responseCurves[2] = { DEFAULT_RESPONSE_CURVE, DEFAULT_RESPONSE_CURVE };
 
   // Things below here are updated automatically
   uint8_t midiMin = 0;
   uint8_t midiMax = 127;
 
+  // The name of noteLayout, filled in when the image is written. The SD card layouts are numbered
+  // after the built in ones in name order, so their indices move when files are added or removed.
+  // Loading looks the layout up by name, and falls back to the default if it's gone.
+  char noteLayoutName[MAX_NOTE_LAYOUT_NAME] = "";
+
   // Call this to limit the range of midi notes we traverse after changing the layout
   void updateMIDIRange();
 
   // Sets everything to defaults EXCEPT the zero load reading is preserved
   void reset();
 
-  bool writeToCard(const char* filename = "gSettings.json");
-  bool readFromCard(const char* filename = "gSettings.json");
+  // Clamps everything to the ranges in SETTINGS_SCHEMA, after reading
+  void validate();
+
+  // Points noteLayout at the layout with this name, or the default layout if there's none
+  void findNoteLayoutByName(const char* name);
+
+  // The binary image - a header with a CRC, then the struct. writeImage returns the length
+  // (SETTINGS_IMAGE_SIZE), or zero if it doesn't fit. readImage leaves the settings alone if the
+  // image is damaged, or came from a build with a different Settings.
+  size_t writeImage(uint8_t* buffer, size_t size) const;
+  bool readImage(const uint8_t* data, size_t length);
+  bool readImageFromCard(const char* filename = SETTINGS_IMAGE_FILENAME);
+
+  // Writes the settings as JSON into buffer, returning the length, or zero if it doesn't fit. This
+  // doesn't allocate.
+  size_t serialize(char* buffer, size_t size) const;
+
+  // These block while the card is accessed. During play, use markSettingsDirty instead.
+  bool writeToCard(const char* filename = SETTINGS_FILENAME) const;
+  bool readFromCard(const char* filename = SETTINGS_FILENAME);
 };
 
 extern Settings gSettings;
 
+enum SettingFlags {
+  SETTING_SAVED = 1,   // Written to the JSON files
+  SETTING_LOADED = 2,  // Read back from them
+  SETTING_WRAP = 4,    // The menu wraps around at the ends of the range
+  SETTING_PERSISTED = SETTING_SAVED | SETTING_LOADED
+};
+
+// Every setting that's saved or appears in the menu (the response curves are handled separately).
+// Each is X(id, field, minValue, maxValue, step, flags), which generates the SettingId, the entry
+// in gSettingInfos, the JSON key (the field as written), and the clamps in Settings::validate.
+// The menu takes the range and step from here. The defaults are in Settings.
+#define SETTINGS_SCHEMA(X) \
+  X(SLOT, slot, 0, NUM_SETTINGS_SLOTS - 1, 1, SETTING_PERSISTED) \
+  X(NOTE_LAYOUT, noteLayout, 0, MAX_NOTE_LAYOUTS - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(FORCE_BELLOWS, forceBellows, 0, 2, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(ZERO_LOAD_READING, zeroLoadReading, LONG_MIN, LONG_MAX, 0, SETTING_PERSISTED) \
+  X(ZERO_LOAD_OFFSET, zeroLoadOffset, -1, 1, 1, 0) \
+  X(AUTO_ZERO, autoZero, 0, 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(EXPRESSION_LEFT, expressions[LEFT], 0, EXPRESSION_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(EXPRESSION_RIGHT, expressions[RIGHT], 0, EXPRESSION_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(MAX_VELOCITY_LEFT, maxVelocity[LEFT], 0, 127, 1, SETTING_PERSISTED) \
+  X(MAX_VELOCITY_RIGHT, maxVelocity[RIGHT], 0, 127, 1, SETTING_PERSISTED) \
+  X(NOTE_OFF_VELOCITY_LEFT, noteOffVelocity[LEFT], 0, 127, 1, SETTING_PERSISTED) \
+  X(NOTE_OFF_VELOCITY_RIGHT, noteOffVelocity[RIGHT], 0, 127, 1, SETTING_PERSISTED) \
+  X(OCTAVE_LEFT, octave[LEFT], -2, 2, 1, SETTING_PERSISTED) \
+  X(OCTAVE_RIGHT, octave[RIGHT], -2, 2, 1, SETTING_PERSISTED) \
+  X(TRANSPOSE, transpose, -12, 12, 1, SETTING_PERSISTED) \
+  X(PRESSURE_GAIN, pressureGain, 10, 200, 10, SETTING_PERSISTED) \
+  X(PRESSURE_FILTER, pressureFilter, 0, PRESSURE_FILTER_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(PRESSURE_SMOOTHING, pressureSmoothing, 0, 100, 5, SETTING_PERSISTED) \
+  X(PRESSURE_PREDICTION, pressurePrediction, 0, 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(DEBOUNCE_TIME, debounceTime, 0, 50, 1, SETTING_PERSISTED) \
+  X(KEY_SCAN_RATE, keyScanRate, 1000, 4000, 500, SETTING_PERSISTED) \
+  X(KEY_SCAN_MODE, keyScanMode, 0, KEY_SCAN_MODE_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(IMMEDIATE_NOTES, immediateNotes, 0, 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(MIDI_MODE, midiMode, 0, MIDI_MODE_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(POLY_PRESSURE_THRESHOLD, polyPressureThreshold, 1, 16, 1, SETTING_PERSISTED) \
+  X(MIDI_CHANNEL_LEFT, midiChannels[LEFT], 1, 16, 1, SETTING_PERSISTED) \
+  X(MIDI_CHANNEL_RIGHT, midiChannels[RIGHT], 1, 16, 1, SETTING_PERSISTED) \
+  X(MIDI_INSTRUMENT_LEFT, midiInstruments[LEFT], -1, 127, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(MIDI_INSTRUMENT_RIGHT, midiInstruments[RIGHT], -1, 127, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(METRONOME_ENABLED, metronomeEnabled, 0, 1, 1, SETTING_SAVED) /* Never automatically turn it on */ \
+  X(METRONOME_BEATS_PER_MINUTE, metronomeBeatsPerMinute, 20, 200, 1, SETTING_PERSISTED) \
+  X(METRONOME_BEATS_PER_BAR, metronomeBeatsPerBar, 1, 10, 1, SETTING_PERSISTED) \
+  X(METRONOME_VOLUME, metronomeVolume, 0, 100, 5, SETTING_PERSISTED) \
+  X(METRONOME_MIDI_NOTE_PRIMARY, metronomeMidiNotePrimary, 1, 127, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(METRONOME_MIDI_NOTE_SECONDARY, metronomeMidiNoteSecondary, 1, 127, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(METRONOME_MIDI_CHANNEL, metronomeMidiChannel, 1, 16, 1, SETTING_PERSISTED) \
+  X(METRONOME_MIDI_INSTRUMENT, metronomeMidiInstrument, 0, 127, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(METRONOME_LED, metronomeLED, 0, 1, 1, SETTING_PERSISTED) \
+  X(METRONOME_SYNC, metronomeSync, 0, 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(STEREO, stereo, -100, 100, 5, SETTING_PERSISTED) \
+  X(BALANCE, balance, -100, 100, 5, SETTING_PERSISTED) \
+  X(SHOW_FPS, showFPS, 0, 1, 1, SETTING_PERSISTED) \
+  X(MENU_BRIGHTNESS, menuBrightness, 4, 15, 1, SETTING_PERSISTED) \
+  X(NOTE_DISPLAY, noteDisplay, 0, NOTE_DISPLAY_NUM - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(ACCIDENTAL_PREFERENCE, accidentalPreference, 0, ACCIDENTAL_PREFERENCE_KEY, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(ACCIDENTAL_KEY, accidentalKey, 0, NUM_KEYS - 1, 1, SETTING_PERSISTED | SETTING_WRAP) \
+  X(MENU_PAGE_INDEX, menuPageIndex, 0, 63, 1, SETTING_PERSISTED) \
+  X(MENU_DISPLAY_ENABLED, menuDisplayEnabled, 0, 1, 1, SETTING_PERSISTED) \
+  X(MIDI_MIN, midiMin, 0, 127, 1, SETTING_PERSISTED) \
+  X(MIDI_MAX, midiMax, 0, 127, 1, SETTING_PERSISTED)
+
+#define SETTING_ID(id, field, minValue, maxValue, step, flags) SETTING_##id,
+enum SettingId {
+  SETTINGS_SCHEMA(SETTING_ID)
+  SETTING_NUM
+};
+#undef SETTING_ID
+
+enum SettingType {
+  SETTING_TYPE_BOOL,
+  SETTING_TYPE_UINT8,
+  SETTING_TYPE_INT,
+  SETTING_TYPE_LONG
+};
+
+struct SettingInfo {
+  const char* mName;
+  uint16_t mOffset;  // In Settings
+  uint8_t mType;
+  uint8_t mFlags;
+  long mMinValue;
+  long mMaxValue;
+  int mStep;
+};
+
+extern const SettingInfo gSettingInfos[SETTING_NUM];
+
+static_assert(SETTING_NUM <= 64, "The settings no longer fit in the changes mask");
+inline uint64_t settingBit(SettingId id) {
+  return uint64_t(1) << id;
+}
+
+// The settings that differ, as settingBit flags
+uint64_t getSettingsChanges(const Settings& settings, const Settings& newSettings);
+
+// Nullptr if the setting isn't an int (which is all the menu can edit)
+int* getIntSetting(Settings& settings, SettingId id);
+
+const size_t SETTINGS_IMAGE_SIZE = 12 + sizeof(Settings);
+
+// Mounts the SD card the first time it's called (the mount is kept after that)
+bool initCard();
+
+// gSettings has changed and should be saved. It's written by updateSettingsWriter, once the
+// settings have been left alone for a second.
+void markSettingsDirty();
+bool isSettingsWritePending();
+
+// Call each loop. The write only makes progress while isIdle (nothing playing), and then does one
+// small step per call - take the image, open, write a sector, or replace the old file. It's written
+// to SETTINGS_TEMP_FILENAME first, so a power cut never leaves a half written SETTINGS_IMAGE_FILENAME.
+void updateSettingsWriter(bool isIdle);
+
+// The numbered slots (Settings00.json to Settings09.json) are all read at boot and kept in RAM.
+// Storing a slot updates the copy, and the writer saves it to the card in the background.
+const int NUM_SETTINGS_SLOTS = 10;
+
+void loadSettingsSlots();
+// Returns false if the slot has never been saved
+bool getSettingsSlot(int slot, Settings& settings);
+void storeSettingsSlot(int slot, const Settings& settings);
+
+// Settings (a slot or preset) that replace gSettings at the start of the next loop, rather than part
+// way through one. The bellows zero and the metronome on/off are kept. getPendingSettingsChanges
+// says which settings will change (as settingBit flags), so the notes can be dealt with first.
+// applyPendingSettings returns true if gSettings has been replaced.
+void setPendingSettings(const Settings& settings);
+bool hasPendingSettings();
+uint64_t getPendingSettingsChanges();
+bool applyPendingSettings();
+
+struct SettingsWriterStats {
+  uint32_t mNumWrites = 0;
+  uint32_t mNumChunks = 0;
+  uint32_t mNumFailures = 0;
+  uint32_t mWorstStepMicros = 0;     // Longest a call to updateSettingsWriter took
+  uint32_t mWorstBlockingMicros = 0; // Longest a writeToCard (e.g. saving a slot) took
+  // The last load and save in each format. The image write is the total over its steps.
+  uint32_t mImageReadMicros = 0;
+  uint32_t mImageWriteMicros = 0;
+  uint32_t mJsonReadMicros = 0;
+  uint32_t mJsonWriteMicros = 0;
+};
+
+const SettingsWriterStats& getSettingsWriterStats();
+
 #endif
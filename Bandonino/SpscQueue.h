@@ -0,0 +1,59 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Fixed size, lock-free, single producer/single consumer queue. Intended for passing data from an
+// interrupt (the producer) to the main loop (the consumer). N must be a power of two.
+template<typename T, uint32_t N>
+class SpscQueue {
+public:
+  static_assert(N > 0 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+  // Producer only. Returns false (and counts the drop) if the queue is full.
+  bool push(const T& item) {
+    uint32_t head = mHead.load(std::memory_order_relaxed);
+    if (head - mTail.load(std::memory_order_acquire) == N) {
+      mNumDropped.store(mNumDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return false;
+    }
+    mItems[head & (N - 1)] = item;
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool pop(T& item) {
+    uint32_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail == mHead.load(std::memory_order_acquire))
+      return false;
+    item = mItems[tail & (N - 1)];
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  uint32_t size() const {
+    return mHead.load(std::memory_order_acquire) - mTail.load(std::memory_order_acquire);
+  }
+
+  static constexpr uint32_t capacity() {
+    return N;
+  }
+
+  uint32_t numDropped() const {
+    return mNumDropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  T mItems[N];
+  std::atomic<uint32_t> mHead{ 0 };
+  std::atomic<uint32_t> mTail{ 0 };
+  std::atomic<uint32_t> mNumDropped{ 0 };
+};
+
+#endif
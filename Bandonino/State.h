@@ -1,6 +1,9 @@
 #ifndef STATE_H
 #define STATE_H
 
+#include "ActiveNoteSet.h"
+#include "KeyMask.h"
+#include "LatencyStats.h"
 #include "NoteLayouts.h"
 #include "PinInputs.h"
 
@@ -12,33 +15,110 @@ enum BellowsState {
   BELLOWS_STATE_OPENING = 1
 };
 
+// For tables indexed by direction - 0 when opening and 1 when closing
+inline int getDirectionIndex(BellowsState bellowsState) {
+  return bellowsState == BELLOWS_STATE_OPENING ? 0 : 1;
+}
+
+// The key state for one side. Specialised on side, so the matrix size is known at compile time.
+template<int SIDE>
+struct SideKeys {
+  static constexpr int ROW_COUNT = PinInputs::rowCounts[SIDE];
+  static constexpr int COLUMN_COUNT = PinInputs::columnCounts[SIDE];
+  static constexpr int KEY_COUNT = PinInputs::keyCounts[SIDE];
+  static constexpr KeyMask ALL_KEYS = allKeysMask(KEY_COUNT);
+  static_assert(KEY_COUNT <= 64, "Key state is held as a 64 bit mask per side");
+
+  // Keys that are currently pressed
+  KeyMask mActiveKeys = 0;
+  // Keys as they were when last played - so the difference is what needs playing/stopping
+  KeyMask mPreviousActiveKeys = 0;
+
+  // This is set to the current time (ms) when the key is being pressed - so it's
+  // possible to tell how long ago it has been since the key was released. Only used when the
+  // keys are scanned from the loop.
+  uint32_t mActiveKeysTime[KEY_COUNT] = {};
+
+  // The MIDI note each key plays opening and closing (see getDirectionIndex), with the transpose
+  // and octave applied. 0 if the key doesn't play a note. Rebuilt by updateEffectiveNotes when
+  // the layout or transpose changes.
+  uint8_t mEffectiveNotes[2][KEY_COUNT] = {};
+  const uint8_t* mEffectiveLayout = nullptr;
+  int mEffectiveTranspose = 0;
+
+  // The note each key actually started, so that releasing it always stops that note, even if the
+  // transpose has changed since. 0 if none.
+  uint8_t mSoundingNotes[KEY_COUNT] = {};
+
+  void clearSoundingNotes() {
+    for (int iKey = 0; iKey != KEY_COUNT; ++iKey)
+      mSoundingNotes[iKey] = 0;
+  }
+
+  // Returns 0 when the bellows are stationary
+  int getEffectiveNote(int iKey, BellowsState bellowsState) const {
+    if (bellowsState == BELLOWS_STATE_STATIONARY)
+      return 0;
+    return mEffectiveNotes[getDirectionIndex(bellowsState)][iKey];
+  }
+
+  void updateEffectiveNotes(const uint8_t* noteLayoutOpen, const uint8_t* noteLayoutClose, int transpose) {
+    if (!noteLayoutOpen || (noteLayoutOpen == mEffectiveLayout && transpose == mEffectiveTranspose))
+      return;
+    mEffectiveLayout = noteLayoutOpen;
+    mEffectiveTranspose = transpose;
+    for (int iKey = 0; iKey != KEY_COUNT; ++iKey) {
+      mEffectiveNotes[0][iKey] = transposeNote(noteLayoutOpen[iKey], transpose);
+      mEffectiveNotes[1][iKey] = transposeNote(noteLayoutClose[iKey], transpose);
+    }
+  }
+
+private:
+  static uint8_t transposeNote(int midiNote, int transpose) {
+    if (midiNote <= 0 || midiNote > 127)
+      return 0;
+    midiNote += transpose;
+    return midiNote > 0 && midiNote <= 127 ? midiNote : 0;
+  }
+};
+
 // Big state - don't copy
 struct BigState {
   // The actual note layout
   NoteLayout mNoteLayout;
 
-  uint8_t mActiveKeysLeft[PinInputs::keyCounts[LEFT]];
-  uint8_t mActiveKeysRight[PinInputs::keyCounts[RIGHT]];
-  uint8_t* activeKeys(int side) {
-    return side ? mActiveKeysRight : mActiveKeysLeft;
-  };
+  SideKeys<LEFT> mKeysLeft;
+  SideKeys<RIGHT> mKeysRight;
 
-  uint8_t mPreviousActiveKeysLeft[PinInputs::keyCounts[LEFT]];
-  uint8_t mPreviousActiveKeysRight[PinInputs::keyCounts[RIGHT]];
-  uint8_t* previousActiveKeys(int side) {
-    return side ? mPreviousActiveKeysRight : mPreviousActiveKeysLeft;
-  };
+  template<int SIDE>
+  SideKeys<SIDE>& keys() {
+    if constexpr (SIDE == LEFT)
+      return mKeysLeft;
+    else
+      return mKeysRight;
+  }
 
-  // This is set to the current time (ms) when the key is being pressed - so it's
-  // possible to tell how long ago it has been since the key was released.
-  uint32_t mActiveKeysTimeLeft[PinInputs::keyCounts[LEFT]];
-  uint32_t mActiveKeysTimeRight[PinInputs::keyCounts[RIGHT]];
-  uint32_t* activeKeysTimes(int side) {
-    return side ? mActiveKeysTimeRight : mActiveKeysTimeLeft;
+  KeyMask& activeKeys(int side) {
+    return side ? mKeysRight.mActiveKeys : mKeysLeft.mActiveKeys;
+  };
+  KeyMask& previousActiveKeys(int side) {
+    return side ? mKeysRight.mPreviousActiveKeys : mKeysLeft.mPreviousActiveKeys;
   };
+  bool isKeyActive(int side, int iKey) const {
+    return ((side ? mKeysRight.mActiveKeys : mKeysLeft.mActiveKeys) & keyBit(iKey)) != 0;
+  }
+
+  // The notes sounding on each side. These are reference counted (so if multiple buttons activate
+  // the note, then that is tracked)
+  ActiveNoteSet mPlayingNotes[2];
+
+  // The direction that the playing notes were started with. This lags mBellowsState while the
+  // bellows are briefly stationary, so that a reversal can hand over from the old notes.
+  BellowsState mPlayingBellowsState = BELLOWS_STATE_STATIONARY;
+  uint32_t mStationaryTimeMillis = 0;  // When the bellows last became stationary
 
-  // Indexed by midi. These a reference counted (so if multiple buttons activate the note, then that is tracked)
-  uint8_t mPlayingNotes[2][127];
+  // From the scan that saw a key change, to the note being flushed to USB
+  LatencyStats<256> mNoteLatency;
 };
 
 // State can be copied and checked for changes
@@ -47,11 +127,15 @@ struct State {
 
   // Raw load cell data
   long mLoadReading;
+  uint32_t mLoadSampleTimeMicros = 0;
 
-  // Pressures - converted using the gain
+  // Pressures - converted using the gain. mPressure has been filtered (see PressureFilter)
+  float mRawPressure = 0.0f;
   float mPressure = 0.0f;
+  float mPressureRate = 0.0f;  // per second
   float mAbsPressure = 0.0f;       // clamped to 0 and 1
-  float mModifiedPressure = 0.0f;  // clamped to 0 and 1
+  float mModifiedPressure = 0.0f;  // clamped to 0 and 1. The larger of the two sides
+  float mModifiedPressures[2] = { 0.0f, 0.0f };  // after each side's response curve
 
   int mMidiPans[2] = { -1, -1 };
   int mMidiVolumes[2] = { -1, -1 };  // scaled to 0-127
@@ -0,0 +1,130 @@
+// Feeds synthetic MIDI clock streams through ClockPll, and checks that it locks, counts every tick
+// and smooths out the jitter.
+//
+// This runs on a computer, not the Teensy. Build and run it with something like:
+//
+//   g++ -O2 -std=c++17 -IBandonino Tools/ClockPllTest.cpp -o ClockPllTest && ./ClockPllTest
+//
+// Each stream is a steady tempo, with the ticks timestamped late by a random amount (as the USB and
+// the loop do), and optionally with stalls, where the loop is held up and the ticks that arrived
+// meanwhile are all read when it carries on. For each one it checks:
+//   - lock: the PLL is locked within MAX_LOCK_TICKS ticks, and stays locked
+//   - count: the tick index matches the number of ticks sent
+//   - tempo: the beats per minute are within 0.5%
+//   - error: once locked, the smoothed tick times are closer to the real ones than the raw
+//     timestamps are, by at least MIN_ERROR_REDUCTION (RMS)
+// It prints a line per stream, and returns non-zero if any check fails.
+
+#include "ClockPll.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+const int MAX_LOCK_TICKS = 48;
+const double MIN_ERROR_REDUCTION = 2.0;
+const double MAX_TEMPO_ERROR = 0.005;
+
+struct Stream {
+  double mBeatsPerMinute;
+  double mJitterMicros;      // Ticks are read up to this late, uniformly
+  double mStallMicros;       // How long each stall holds up the loop, 0 for none
+  int mTicksBetweenStalls;
+  int mNumTicks;
+};
+
+struct Result {
+  int mLockTick = -1;      // First tick at which the PLL was locked
+  int mNumUnlocked = 0;    // Ticks after that at which it wasn't
+  bool mCountOk = true;
+  double mTempoError = 0.0;
+  double mRawErrorMicros = 0.0;     // RMS, once locked
+  double mSmoothErrorMicros = 0.0;
+};
+
+//====================================================================================================
+static Result runStream(const Stream& stream, uint32_t seed) {
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<double> jitter(0.0, stream.mJitterMicros);
+
+  double tickMicros = 60e6 / (stream.mBeatsPerMinute * ClockPll::TICKS_PER_BEAT);
+  double startMicros = 1000000.0;
+  // Arrival times, with the jitter and stalls
+  std::vector<double> readMicros(stream.mNumTicks);
+  double stallEndMicros = 0.0;
+  for (int i = 0; i != stream.mNumTicks; ++i) {
+    double sentMicros = startMicros + i * tickMicros;
+    if (stream.mStallMicros > 0.0 && i != 0 && i % stream.mTicksBetweenStalls == 0)
+      stallEndMicros = sentMicros + stream.mStallMicros;
+    double time = sentMicros + jitter(random);
+    readMicros[i] = std::max(time, stallEndMicros);
+  }
+
+  ClockPll pll;
+  Result result;
+  double rawSquares = 0.0;
+  double smoothSquares = 0.0;
+  int numMeasured = 0;
+  for (int i = 0; i != stream.mNumTicks; ++i) {
+    pll.addTick((uint32_t)std::llround(readMicros[i]));
+    if (pll.getTickIndex() != i)
+      result.mCountOk = false;
+    if (!pll.isLocked()) {
+      if (result.mLockTick >= 0)
+        ++result.mNumUnlocked;
+      continue;
+    }
+    if (result.mLockTick < 0)
+      result.mLockTick = i;
+
+    // Compare with when the tick was really sent. Both are late by the average jitter, so take
+    // that off.
+    double sentMicros = startMicros + i * tickMicros + stream.mJitterMicros / 2;
+    double rawError = readMicros[i] - sentMicros;
+    double smoothError = (double)(int32_t)(pll.getTickTimeMicros(i) - (uint32_t)std::llround(sentMicros));
+    rawSquares += rawError * rawError;
+    smoothSquares += smoothError * smoothError;
+    ++numMeasured;
+  }
+  if (numMeasured != 0) {
+    result.mRawErrorMicros = std::sqrt(rawSquares / numMeasured);
+    result.mSmoothErrorMicros = std::sqrt(smoothSquares / numMeasured);
+  }
+  result.mTempoError = std::fabs(pll.getBeatsPerMinute() / stream.mBeatsPerMinute - 1.0);
+  return result;
+}
+
+//====================================================================================================
+int main() {
+  std::vector<Stream> streams;
+  for (double bpm : { 60.0, 100.0, 120.0, 180.0, 240.0 }) {
+    for (double jitterMicros : { 1000.0, 3000.0 }) {
+      streams.push_back({ bpm, jitterMicros, 0.0, 0, 2000 });
+      streams.push_back({ bpm, jitterMicros, 40000.0, 200, 2000 });
+    }
+  }
+
+  int numFailed = 0;
+  uint32_t seed = 1;
+  for (const Stream& stream : streams) {
+    Result result = runStream(stream, seed++);
+    bool lockOk = result.mLockTick >= 0 && result.mLockTick < MAX_LOCK_TICKS && result.mNumUnlocked == 0;
+    bool tempoOk = result.mTempoError < MAX_TEMPO_ERROR;
+    double reduction = result.mSmoothErrorMicros > 0.0 ? result.mRawErrorMicros / result.mSmoothErrorMicros : 0.0;
+    bool errorOk = reduction >= MIN_ERROR_REDUCTION;
+    bool ok = lockOk && result.mCountOk && tempoOk && errorOk;
+    if (!ok)
+      ++numFailed;
+
+    printf("%s %5.1f bpm jitter %4.0fus stall %3.0fms: locked at tick %d (unlocked %d) count %s tempo %.3f%% "
+           "error %.0fus -> %.0fus (%.1fx)\n",
+           ok ? "ok  " : "FAIL", stream.mBeatsPerMinute, stream.mJitterMicros, stream.mStallMicros / 1000.0,
+           result.mLockTick, result.mNumUnlocked, result.mCountOk ? "ok" : "wrong", result.mTempoError * 100.0,
+           result.mRawErrorMicros, result.mSmoothErrorMicros, reduction);
+  }
+
+  printf("%d of %d streams failed\n", numFailed, (int)streams.size());
+  return numFailed == 0 ? 0 : 1;
+}
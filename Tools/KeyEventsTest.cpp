@@ -0,0 +1,227 @@
+// Drives KeyEventGenerator and SpscQueue from a simulated key matrix, and checks the events that come
+// out.
+//
+// This runs on a computer, not the Teensy. Build and run it with something like:
+//
+//   g++ -O2 -std=c++17 -pthread -IBandonino Tools/KeyEventsTest.cpp -o KeyEventsTest && ./KeyEventsTest
+//
+// The matrix is simulated as the firmware sees it - a bit per row for each column, packed with
+// toKeyMask - with the left side's dimensions from PinInputs.h. It checks:
+//   - order: presses and releases come out in the order they happened, with the time of the scan
+//   - short presses: a key pressed for one scan still gives a press and then a release, both queued
+//     before the loop gets to them
+//   - full queue: events that don't fit are counted as dropped, and generated again on the next scan
+//   - wraparound: the queue keeps its order as the indices go round many times, including with a
+//     producer thread and a consumer thread running at once
+// It prints a line per check, and returns non-zero if any fail.
+
+#include "KeyEvents.h"
+#include "PinInputs.h"
+#include "SpscQueue.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+const int ROW_COUNT = PinInputs::rowCounts[0];
+const int COLUMN_COUNT = PinInputs::columnCounts[0];
+const uint32_t SCAN_MICROS = 500;  // 2kHz, the default scan rate
+
+typedef KeyEventGenerator<ROW_COUNT, COLUMN_COUNT> Generator;
+
+static int sNumFailed = 0;
+
+//====================================================================================================
+static void check(bool ok, const char* name) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok)
+    ++sNumFailed;
+}
+
+//====================================================================================================
+// The keys held down on the simulated matrix
+class Matrix {
+public:
+  void set(int row, int column, bool pressed) {
+    if (pressed)
+      mColumnRowBits[column] |= 1u << row;
+    else
+      mColumnRowBits[column] &= ~(1u << row);
+  }
+
+  KeyMask scan() const {
+    return toKeyMask<ROW_COUNT, COLUMN_COUNT>(mColumnRowBits);
+  }
+
+private:
+  uint32_t mColumnRowBits[COLUMN_COUNT] = {};
+};
+
+//====================================================================================================
+// Runs one scan, pushing into the queue as the scanner interrupt does
+template<typename Queue>
+static int scan(Generator& generator, const Matrix& matrix, uint32_t timeMicros, Queue& queue) {
+  return generator.update(0, matrix.scan(), timeMicros, [&queue](const KeyEvent& event) {
+    return queue.push(event);
+  });
+}
+
+//====================================================================================================
+template<typename Queue>
+static std::vector<KeyEvent> popAll(Queue& queue) {
+  std::vector<KeyEvent> events;
+  KeyEvent event;
+  while (queue.pop(event))
+    events.push_back(event);
+  return events;
+}
+
+//====================================================================================================
+static bool isEvent(const KeyEvent& event, int row, int column, bool pressed, uint32_t timeMicros) {
+  return event.mKey == toKeyIndex(row, column, ROW_COUNT, COLUMN_COUNT) && event.mPressed == pressed
+         && event.mTimeMicros == timeMicros;
+}
+
+//====================================================================================================
+static void testOrder() {
+  Generator generator;
+  generator.setReleaseTicks(1);
+  SpscQueue<KeyEvent, 128> queue;
+  Matrix matrix;
+  uint32_t time = 0;
+
+  // Press A, press B, release A, release B, one change per scan, with the loop only reading the
+  // queue at the end
+  matrix.set(2, 1, true);
+  scan(generator, matrix, time += SCAN_MICROS, queue);
+  matrix.set(5, 3, true);
+  scan(generator, matrix, time += SCAN_MICROS, queue);
+  matrix.set(2, 1, false);
+  scan(generator, matrix, time += SCAN_MICROS, queue);
+  matrix.set(5, 3, false);
+  scan(generator, matrix, time += SCAN_MICROS, queue);
+
+  std::vector<KeyEvent> events = popAll(queue);
+  check(events.size() == 4 && isEvent(events[0], 2, 1, true, 1 * SCAN_MICROS)
+          && isEvent(events[1], 5, 3, true, 2 * SCAN_MICROS) && isEvent(events[2], 2, 1, false, 3 * SCAN_MICROS)
+          && isEvent(events[3], 5, 3, false, 4 * SCAN_MICROS),
+        "order: presses and releases in the order they happened");
+
+  // Two keys changing in the same scan both have that scan's time
+  matrix.set(0, 0, true);
+  matrix.set(7, 4, true);
+  scan(generator, matrix, time += SCAN_MICROS, queue);
+  events = popAll(queue);
+  check(events.size() == 2 && events[0].mPressed && events[1].mPressed && events[0].mTimeMicros == time
+          && events[1].mTimeMicros == time && generator.activeKeys() == matrix.scan(),
+        "order: keys pressed in the same scan");
+}
+
+//====================================================================================================
+static void testShortPress() {
+  for (int releaseTicks : { 1, 4 }) {
+    Generator generator;
+    generator.setReleaseTicks(releaseTicks);
+    SpscQueue<KeyEvent, 128> queue;
+    Matrix matrix;
+    uint32_t time = 0;
+
+    // Down for a single scan, and the loop doesn't read the queue until it's been let go
+    matrix.set(3, 2, true);
+    scan(generator, matrix, time += SCAN_MICROS, queue);
+    matrix.set(3, 2, false);
+    for (int i = 0; i != releaseTicks; ++i)
+      scan(generator, matrix, time += SCAN_MICROS, queue);
+
+    std::vector<KeyEvent> events = popAll(queue);
+    char name[100];
+    snprintf(name, sizeof(name), "short press: pressed for one scan, released after %d", releaseTicks);
+    check(events.size() == 2 && isEvent(events[0], 3, 2, true, SCAN_MICROS)
+            && isEvent(events[1], 3, 2, false, (1 + releaseTicks) * SCAN_MICROS) && generator.activeKeys() == 0,
+          name);
+  }
+}
+
+//====================================================================================================
+static void testQueueFull() {
+  Generator generator;
+  generator.setReleaseTicks(1);
+  SpscQueue<KeyEvent, 4> queue;
+  Matrix matrix;
+  uint32_t time = 0;
+
+  // A chord of 6 into a queue of 4
+  for (int row = 0; row != 6; ++row)
+    matrix.set(row, 0, true);
+  int numPushed = scan(generator, matrix, time += SCAN_MICROS, queue);
+  check(numPushed == 4 && queue.numDropped() == 2 && countKeys(generator.activeKeys()) == 4,
+        "full queue: extra events are dropped and counted");
+
+  // The keys that didn't fit aren't active, so the next scan (with room in the queue) tries again
+  std::vector<KeyEvent> events = popAll(queue);
+  numPushed = scan(generator, matrix, time += SCAN_MICROS, queue);
+  std::vector<KeyEvent> retried = popAll(queue);
+  events.insert(events.end(), retried.begin(), retried.end());
+  bool allPressed = events.size() == 6;
+  for (int i = 0; allPressed && i != 6; ++i)
+    allPressed = events[i].mPressed && events[i].mKey == i;
+  check(numPushed == 2 && allPressed && generator.activeKeys() == matrix.scan() && queue.numDropped() == 2,
+        "full queue: dropped events are generated on the next scan");
+
+  // Nothing more comes out once everything has been reported
+  numPushed = scan(generator, matrix, time += SCAN_MICROS, queue);
+  check(numPushed == 0 && queue.empty(), "full queue: no repeats once caught up");
+}
+
+//====================================================================================================
+static void testWraparound() {
+  // Several items at a time, many times round a small queue
+  SpscQueue<uint32_t, 8> queue;
+  uint32_t next = 0;
+  uint32_t expected = 0;
+  bool ok = true;
+  for (int round = 0; round != 10000 && ok; ++round) {
+    int numPush = 1 + round % 7;
+    for (int i = 0; i != numPush; ++i)
+      ok = ok && queue.push(next++);
+    ok = ok && queue.size() == (uint32_t)numPush;
+    uint32_t value;
+    while (queue.pop(value))
+      ok = ok && value == expected++;
+  }
+  check(ok && queue.empty() && expected == next && queue.numDropped() == 0, "wraparound: order kept going round");
+
+  // The scanner interrupt and the loop, as two threads
+  static SpscQueue<uint32_t, 128> sharedQueue;
+  const uint32_t count = 1000000;
+  std::thread producer([count]() {
+    for (uint32_t i = 0; i != count;) {
+      if (sharedQueue.push(i))
+        ++i;
+      else
+        std::this_thread::yield();
+    }
+  });
+  uint32_t numReceived = 0;
+  bool inOrder = true;
+  while (numReceived != count) {
+    uint32_t value;
+    if (sharedQueue.pop(value))
+      inOrder = inOrder && value == numReceived++;
+    else
+      std::this_thread::yield();
+  }
+  producer.join();
+  check(inOrder && sharedQueue.empty(), "wraparound: order kept between threads");
+}
+
+//====================================================================================================
+int main() {
+  testOrder();
+  testShortPress();
+  testQueueFull();
+  testWraparound();
+  printf("%d checks failed\n", sNumFailed);
+  return sNumFailed == 0 ? 0 : 1;
+}
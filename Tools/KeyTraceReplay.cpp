@@ -0,0 +1,302 @@
+// Replays raw key scans through KeyDebouncer, at a chosen scan rate and debounce time, and checks
+// what comes out.
+//
+// This runs on a computer, not the Teensy. Build and run it with something like:
+//
+//   g++ -O2 -std=c++17 -IBandonino Tools/KeyTraceReplay.cpp -o KeyTraceReplay && ./KeyTraceReplay
+//
+// and to replay a recording:
+//
+//   KeyTraceReplay log.txt [options]
+//
+//     --rate <hz>       Scan rate to replay at. Default: 1000, 2000 and 4000
+//     --debounce <ms>   Debounce time. Default: 0, 1, 2, 5 and 10
+//
+// Recordings are Serial logs with showKeyTrace on - a "Key trace: n scans" line, then a line per
+// scan of the form
+//
+//   <micros> <left keys> <right keys>
+//
+// with the time from the first scan and the raw masks in hex. Other lines are ignored, and each
+// trace in the log is replayed separately. Without a log, a synthetic trace is used - scanned at
+// 4kHz, with bounce as keys are pressed and let go, and short dropouts while they're held.
+//
+// The trace is resampled to the scan rate (each scan sees the latest recorded one), so replaying
+// above the rate it was recorded at just repeats scans. The debounce time is converted to release
+// ticks the same way as updateKeyScanTimer. For each rate and debounce time it checks:
+//   - press: a key that reads pressed is always active, so presses have no added latency
+//   - chatter: a key is only released once it has read released for at least the release ticks
+//     since it was last solidly pressed (pressed for the release ticks in a row), so chatter
+//     shorter than the release window never releases it
+//   - release: a key that reads released for the release ticks in a row is released
+//   - notes (synthetic trace only): once the debounce time is longer than the synthetic bounce,
+//     each note gives exactly one press
+// It prints a line per rate and debounce time, and returns non-zero if any check fails.
+
+#include "KeyDebouncer.h"
+#include "PinInputs.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The synthetic trace
+const uint32_t SYNTHETIC_SCAN_MICROS = 250;
+const uint32_t SYNTHETIC_LENGTH_MICROS = 1000000;
+const uint32_t PRESS_BOUNCE_MICROS = 1000;
+const uint32_t RELEASE_BOUNCE_MICROS = 3000;
+const uint32_t MAX_DROPOUT_MICROS = 1500;
+// Debounce times at least this long should hide all of the synthetic bounce
+const int SYNTHETIC_DEBOUNCE_MILLIS = 5;
+
+struct Scan {
+  uint32_t mTimeMicros;
+  KeyMask mRawKeys[2];
+};
+typedef std::vector<Scan> Trace;
+
+struct Note {
+  int mSide;
+  int mKey;
+  uint32_t mPressMicros;
+  uint32_t mReleaseMicros;
+  std::vector<uint32_t> mDropoutMicros;  // Start of each dropout while held
+  std::vector<uint32_t> mDropoutLengths;
+};
+
+struct Result {
+  int mNumRawPresses = 0;  // Released to pressed, as read
+  int mNumPresses = 0;     // Debounced
+  int mNumReleases = 0;
+  uint32_t mNumBounces = 0;
+  int mNumLatePresses = 0;   // Scans where a key read pressed but wasn't active
+  int mNumEarlyReleases = 0;
+  int mNumLateReleases = 0;
+};
+
+//====================================================================================================
+static std::vector<Trace> readTraces(std::istream& file) {
+  std::vector<Trace> traces;
+  bool newTrace = true;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 10, "Key trace:") == 0) {
+      newTrace = true;
+      continue;
+    }
+    unsigned long timeMicros;
+    unsigned long long left, right;
+    if (sscanf(line.c_str(), "%lu %llx %llx", &timeMicros, &left, &right) != 3)
+      continue;
+    if (!newTrace && timeMicros < traces.back().back().mTimeMicros)
+      newTrace = true;
+    if (newTrace) {
+      traces.push_back({});
+      newTrace = false;
+    }
+    traces.back().push_back({ (uint32_t)timeMicros, { (KeyMask)left, (KeyMask)right } });
+  }
+  return traces;
+}
+
+//====================================================================================================
+static std::vector<Note> makeSyntheticNotes(std::mt19937& random) {
+  std::vector<Note> notes;
+  for (int side = 0; side != 2; ++side) {
+    for (int iKey = 0; iKey < PinInputs::keyCounts[side]; iKey += 3) {
+      uint32_t time = std::uniform_int_distribution<uint32_t>(0, 200000)(random);
+      while (true) {
+        uint32_t length = std::uniform_int_distribution<uint32_t>(20000, 300000)(random);
+        if (time + length + RELEASE_BOUNCE_MICROS >= SYNTHETIC_LENGTH_MICROS)
+          break;
+        Note note = { side, iKey, time, time + length, {}, {} };
+        // Dropouts well apart, after the press bounce
+        for (uint32_t dropout = time + 20000; dropout + 20000 < note.mReleaseMicros; dropout += 60000) {
+          if (random() % 2 == 0)
+            continue;
+          note.mDropoutMicros.push_back(dropout);
+          note.mDropoutLengths.push_back(std::uniform_int_distribution<uint32_t>(100, MAX_DROPOUT_MICROS)(random));
+        }
+        notes.push_back(note);
+        time = note.mReleaseMicros + std::uniform_int_distribution<uint32_t>(40000, 150000)(random);
+      }
+    }
+  }
+  return notes;
+}
+
+//====================================================================================================
+static bool isNotePressed(const Note& note, uint32_t time, std::mt19937& random) {
+  if (time < note.mPressMicros || time >= note.mReleaseMicros + RELEASE_BOUNCE_MICROS)
+    return false;
+  if (time >= note.mReleaseMicros)
+    return random() % 3 == 0;
+  if (time < note.mPressMicros + PRESS_BOUNCE_MICROS && time != note.mPressMicros)
+    return random() % 2 == 0;
+  for (size_t i = 0; i != note.mDropoutMicros.size(); ++i)
+    if (time >= note.mDropoutMicros[i] && time < note.mDropoutMicros[i] + note.mDropoutLengths[i])
+      return false;
+  return true;
+}
+
+//====================================================================================================
+// Prints the synthetic trace as showKeyTrace would, and reads it back, so it goes through the same
+// parsing as a recording
+static Trace makeSyntheticTrace(const std::vector<Note>& notes, std::mt19937& random) {
+  std::stringstream text;
+  uint32_t numScans = SYNTHETIC_LENGTH_MICROS / SYNTHETIC_SCAN_MICROS;
+  text << "Key trace: " << numScans << " scans\n";
+  for (uint32_t i = 0; i != numScans; ++i) {
+    uint32_t time = i * SYNTHETIC_SCAN_MICROS;
+    KeyMask rawKeys[2] = { 0, 0 };
+    for (const Note& note : notes)
+      if (isNotePressed(note, time, random))
+        rawKeys[note.mSide] |= keyBit(note.mKey);
+    char line[64];
+    snprintf(line, sizeof(line), "%lu %012llx %012llx\n", (unsigned long)time, (unsigned long long)rawKeys[0],
+             (unsigned long long)rawKeys[1]);
+    text << line;
+  }
+  std::vector<Trace> traces = readTraces(text);
+  return traces.size() == 1 ? traces[0] : Trace();
+}
+
+//====================================================================================================
+template<int KEY_COUNT>
+static void replaySide(const Trace& trace, int side, int rateHz, int releaseTicks, Result& result) {
+  KeyDebouncer<KEY_COUNT> debouncer;
+  debouncer.setReleaseTicks(releaseTicks);
+
+  // Per key: released reads since it was last solidly pressed, and pressed and released reads in a
+  // row
+  int releasedReads[KEY_COUNT] = {};
+  int pressedRun[KEY_COUNT] = {};
+  int releasedRun[KEY_COUNT] = {};
+  KeyMask previousRaw = 0;
+  KeyMask previousActive = 0;
+  size_t iScan = 0;
+  for (uint64_t tick = 0;; ++tick) {
+    uint64_t time = tick * 1000000 / rateHz;
+    if (time > trace.back().mTimeMicros)
+      break;
+    while (iScan + 1 != trace.size() && trace[iScan + 1].mTimeMicros <= time)
+      ++iScan;
+    KeyMask raw = trace[iScan].mRawKeys[side] & allKeysMask(KEY_COUNT);
+    KeyMask active = debouncer.update(raw);
+
+    result.mNumRawPresses += countKeys(raw & ~previousRaw);
+    result.mNumPresses += countKeys(active & ~previousActive);
+    result.mNumReleases += countKeys(previousActive & ~active);
+    result.mNumLatePresses += countKeys(raw & ~active);
+    for (int iKey = 0; iKey != KEY_COUNT; ++iKey) {
+      bool isRaw = raw & keyBit(iKey);
+      bool isActive = active & keyBit(iKey);
+      bool wasActive = previousActive & keyBit(iKey);
+      if (isRaw) {
+        ++pressedRun[iKey];
+        releasedRun[iKey] = 0;
+        if (!wasActive || pressedRun[iKey] >= releaseTicks)
+          releasedReads[iKey] = 0;
+      } else {
+        pressedRun[iKey] = 0;
+        ++releasedRun[iKey];
+        if (wasActive)
+          ++releasedReads[iKey];
+        if (wasActive && !isActive && releasedReads[iKey] < releaseTicks)
+          ++result.mNumEarlyReleases;
+        if (isActive && releasedRun[iKey] >= releaseTicks)
+          ++result.mNumLateReleases;
+      }
+    }
+    previousRaw = raw;
+    previousActive = active;
+  }
+  result.mNumBounces += debouncer.getNumBounces();
+}
+
+//====================================================================================================
+static Result replay(const std::vector<Trace>& traces, int rateHz, int debounceMillis) {
+  // As updateKeyScanTimer
+  int releaseTicks = std::max((std::max(debounceMillis, 0) * rateHz + 999) / 1000, 1);
+  Result result;
+  for (const Trace& trace : traces) {
+    if (trace.empty())
+      continue;
+    replaySide<PinInputs::keyCounts[0]>(trace, 0, rateHz, releaseTicks, result);
+    replaySide<PinInputs::keyCounts[1]>(trace, 1, rateHz, releaseTicks, result);
+  }
+  return result;
+}
+
+//====================================================================================================
+int main(int argc, char** argv) {
+  const char* logPath = nullptr;
+  std::vector<int> rates = { 1000, 2000, 4000 };
+  std::vector<int> debounceTimes = { 0, 1, 2, 5, 10 };
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+      rates = { std::max(1, atoi(argv[++i])) };
+    else if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc)
+      debounceTimes = { std::max(0, atoi(argv[++i])) };
+    else if (!logPath)
+      logPath = argv[i];
+    else {
+      fprintf(stderr, "Usage: %s [log.txt] [--rate hz] [--debounce ms]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Trace> traces;
+  std::vector<Note> notes;
+  if (logPath) {
+    std::ifstream file(logPath);
+    if (!file) {
+      fprintf(stderr, "Failed to read %s\n", logPath);
+      return 1;
+    }
+    traces = readTraces(file);
+  } else {
+    std::mt19937 random(1);
+    notes = makeSyntheticNotes(random);
+    traces.push_back(makeSyntheticTrace(notes, random));
+  }
+  size_t numScans = 0;
+  for (const Trace& trace : traces)
+    numScans += trace.size();
+  if (numScans == 0) {
+    fprintf(stderr, "No key traces found\n");
+    return 1;
+  }
+  printf("%zu scans in %zu traces%s\n", numScans, traces.size(), logPath ? "" : " (synthetic)");
+
+  int numFailed = 0;
+  int numRuns = 0;
+  for (int rateHz : rates) {
+    for (int debounceMillis : debounceTimes) {
+      Result result = replay(traces, rateHz, debounceMillis);
+      bool notesOk = logPath || debounceMillis < SYNTHETIC_DEBOUNCE_MILLIS || result.mNumPresses == (int)notes.size();
+      bool ok = result.mNumLatePresses == 0 && result.mNumEarlyReleases == 0 && result.mNumLateReleases == 0 && notesOk;
+      if (!ok)
+        ++numFailed;
+      ++numRuns;
+
+      printf("%s %4dHz debounce %2dms: raw presses %4d -> presses %4d releases %4d bounces %4lu "
+             "(late presses %d early releases %d late releases %d%s)\n",
+             ok ? "ok  " : "FAIL", rateHz, debounceMillis, result.mNumRawPresses, result.mNumPresses,
+             result.mNumReleases, (unsigned long)result.mNumBounces, result.mNumLatePresses,
+             result.mNumEarlyReleases, result.mNumLateReleases, notesOk ? "" : ", wrong number of notes");
+    }
+  }
+  if (!logPath)
+    printf("%zu synthetic notes\n", notes.size());
+
+  printf("%d of %d runs failed\n", numFailed, numRuns);
+  return numFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,507 @@
+// Scores bandoneon layouts against recorded playing, and searches for better ones.
+//
+// This runs on a computer, not the Teensy. Build it with something like:
+//
+//   g++ -O2 -std=c++17 -pthread Tools/LayoutOptimiser.cpp -o LayoutOptimiser
+//
+// and run it with:
+//
+//   LayoutOptimiser Bandonino/NoteLayouts.cpp recording.txt [more recordings] [options]
+//
+//     --layout <name>   Layout to start from (e.g. manoury2). Default: the best scoring one
+//     --seconds <n>     How long to search for. Default 10
+//     --threads <n>     Default: all the cores
+//
+// The key to note tables are read from the source of NoteLayouts.cpp, so it always matches the
+// firmware. Recordings are Serial logs with showNoteTrace on - lines of the form
+//
+//   note <timeMillis> <L|R> <open|close> <midiNote>
+//
+// where the note is from the layout (before transpose). Other lines are ignored.
+//
+// The cost model is deliberately simple. Keys are placed on a grid from their row and column in
+// PinInputs.h, with alternate columns offset by half a key (the real plates are close to this, but
+// not exact). Each hand pays for:
+//   - travel: the distance its chord centre moves from one chord to the next
+//   - stretch: how far a chord spans beyond what a hand can comfortably reach
+//   - crossing: notes that the recording played on this side, but the layout only has on the
+//     other side, so the other hand has to take them. Notes the layout can't play at all cost more.
+//
+// The search is simulated annealing, run independently on each thread from the same start. A
+// move swaps two keys on one side (including unused keys, so notes can move to them), or a key
+// on each side. Skipped keys and buttons never move. For unisonoric layouts (where close is the
+// same table as open) open and close move together. The best layout found is printed in the same
+// NOTE(xx, n) table format as NoteLayouts.cpp, so it can be pasted in.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// These match PinInputs.h
+const int ROW_COUNTS[2] = { 8, 8 };
+const int COLUMN_COUNTS[2] = { 5, 6 };
+const int KEY_COUNTS[2] = { ROW_COUNTS[0] * COLUMN_COUNTS[0], ROW_COUNTS[1] * COLUMN_COUNTS[1] };
+const int MAX_KEYS = 48;
+
+enum { LEFT, RIGHT };
+enum { OPEN, CLOSE };
+
+// Cost weights
+const float TRAVEL_WEIGHT = 1.0f;
+const float COMFORTABLE_SPAN = 3.5f;  // In keys
+const float STRETCH_WEIGHT = 4.0f;
+const float CROSSING_COST = 20.0f;
+const float UNPLAYABLE_COST = 200.0f;
+
+// Notes within this long of each other on one side are played as a chord
+const uint32_t CHORD_MILLIS = 30;
+
+enum KeyType : uint8_t {
+  KEY_NOTE,     // NOTE(xx, n) or NOTE_UNUSED - can be moved
+  KEY_SKIPPED,  // SKIPPED_KEY - there's no key there
+  KEY_BUTTON    // NOTE_BUTTON - used for the menu etc
+};
+
+struct Table {
+  uint8_t mNotes[MAX_KEYS] = {};
+  KeyType mTypes[MAX_KEYS] = {};
+};
+
+struct Layout {
+  std::string mName;
+  Table mTables[2][2];  // [side][direction]
+  bool mUnisonoric = false;
+};
+
+struct Chord {
+  int mSide;
+  int mDirection;
+  std::vector<uint8_t> mNotes;
+};
+
+//====================================================================================================
+static void getKeyPosition(int side, int iKey, float& x, float& y) {
+  // Keys are numbered column by column (see toKeyIndex)
+  int column = iKey / ROW_COUNTS[side];
+  int row = iKey % ROW_COUNTS[side];
+  x = row + 0.5f * (column % 2);
+  y = column * 0.87f;
+}
+
+//====================================================================================================
+static std::string readFile(const char* path) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    exit(1);
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+//====================================================================================================
+static const char* NOTE_NAMES[12] = { "CN", "CS", "DN", "DS", "EN", "FN", "FS", "GN", "GS", "AN", "AS", "BN" };
+
+static bool parseTable(const std::string& body, int keyCount, Table& table) {
+  static const std::regex tokenRegex(R"(NOTE\(\s*([A-G][NS])\s*,\s*(-?\d+)\s*\)|NOTE_UNUSED|SKIPPED_KEY|NOTE_BUTTON)");
+  int iKey = 0;
+  for (std::sregex_iterator it(body.begin(), body.end(), tokenRegex), end; it != end; ++it) {
+    if (iKey == keyCount)
+      return false;
+    const std::smatch& match = *it;
+    std::string token = match.str(0);
+    if (token == "SKIPPED_KEY") {
+      table.mTypes[iKey] = KEY_SKIPPED;
+    } else if (token == "NOTE_BUTTON") {
+      table.mTypes[iKey] = KEY_BUTTON;
+    } else if (token != "NOTE_UNUSED") {
+      int semitone = int(std::find(NOTE_NAMES, NOTE_NAMES + 12, match.str(1)) - NOTE_NAMES);
+      table.mNotes[iKey] = (uint8_t)(12 + std::stoi(match.str(2)) * 12 + semitone);
+    }
+    ++iKey;
+  }
+  return iKey == keyCount;
+}
+
+//====================================================================================================
+// Finds tables like "const uint8_t manoury1LayoutLeftOpen[...] = { ... };" and aliases like
+// "const uint8_t* manoury1LayoutLeftClose = manoury1LayoutLeftOpen;"
+static std::vector<Layout> readLayouts(const char* path) {
+  std::string source = readFile(path);
+  // Drop comments, as some rows have them
+  source = std::regex_replace(source, std::regex(R"(//[^\n]*)"), "");
+
+  static const char* SIDE_NAMES[2] = { "Left", "Right" };
+  static const char* DIRECTION_NAMES[2] = { "Open", "Close" };
+  std::map<std::string, Layout> layouts;
+  std::map<std::string, int> numOpenAliases;
+  std::vector<std::string> order;
+
+  std::regex tableRegex(R"(const\s+uint8_t\s+(\w+)Layout(Left|Right)(Open|Close)\s*\[[^=]*\]\s*=\s*\{([^}]*)\})");
+  for (std::sregex_iterator it(source.begin(), source.end(), tableRegex), end; it != end; ++it) {
+    std::string name = (*it)[1];
+    int side = (*it)[2] == "Left" ? LEFT : RIGHT;
+    int direction = (*it)[3] == "Open" ? OPEN : CLOSE;
+    if (!layouts.count(name))
+      order.push_back(name);
+    Layout& layout = layouts[name];
+    layout.mName = name;
+    if (!parseTable((*it)[4], KEY_COUNTS[side], layout.mTables[side][direction])) {
+      fprintf(stderr, "%sLayout%s%s doesn't have %d keys\n", name.c_str(), SIDE_NAMES[side], DIRECTION_NAMES[direction], KEY_COUNTS[side]);
+      exit(1);
+    }
+  }
+
+  std::regex aliasRegex(R"(const\s+uint8_t\s*\*\s*(\w+)Layout(Left|Right)(Open|Close)\s*=\s*(\w+)Layout(Left|Right)(Open|Close)\s*;)");
+  for (std::sregex_iterator it(source.begin(), source.end(), aliasRegex), end; it != end; ++it) {
+    std::string name = (*it)[1];
+    int side = (*it)[2] == "Left" ? LEFT : RIGHT;
+    int direction = (*it)[3] == "Open" ? OPEN : CLOSE;
+    Layout& from = layouts[(*it)[4]];
+    int fromSide = (*it)[5] == "Left" ? LEFT : RIGHT;
+    int fromDirection = (*it)[6] == "Open" ? OPEN : CLOSE;
+    layouts[name].mTables[side][direction] = from.mTables[fromSide][fromDirection];
+    if (direction == CLOSE && fromDirection == OPEN && fromSide == side && name == (*it)[4].str())
+      ++numOpenAliases[name];
+  }
+  // Unisonoric if both sides play the same notes opening and closing
+  for (auto& entry : layouts)
+    entry.second.mUnisonoric = numOpenAliases[entry.first] == 2;
+
+  std::vector<Layout> result;
+  for (const std::string& name : order)
+    result.push_back(layouts[name]);
+  return result;
+}
+
+//====================================================================================================
+static std::vector<Chord> readRecording(const char* path) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    exit(1);
+  }
+  std::vector<Chord> chords;
+  uint32_t lastTimes[2] = { 0, 0 };
+  int lastChord[2] = { -1, -1 };
+  std::string line;
+  while (std::getline(file, line)) {
+    unsigned long timeMillis;
+    char sideName;
+    char directionName[8];
+    int midiNote;
+    if (sscanf(line.c_str(), "note %lu %c %7s %d", &timeMillis, &sideName, directionName, &midiNote) != 4)
+      continue;
+    if (midiNote <= 0 || midiNote > 127 || (sideName != 'L' && sideName != 'R'))
+      continue;
+    int side = sideName == 'L' ? LEFT : RIGHT;
+    int direction = strcmp(directionName, "open") == 0 ? OPEN : CLOSE;
+    int chord = lastChord[side];
+    if (chord < 0 || timeMillis - lastTimes[side] > CHORD_MILLIS || chords[chord].mDirection != direction) {
+      chords.push_back({ side, direction, {} });
+      chord = lastChord[side] = (int)chords.size() - 1;
+    }
+    chords[chord].mNotes.push_back((uint8_t)midiNote);
+    lastTimes[side] = (uint32_t)timeMillis;
+  }
+  return chords;
+}
+
+//====================================================================================================
+// Precomputed key positions, and scratch space, for one thread
+class Evaluator {
+public:
+  explicit Evaluator(const std::vector<Chord>& chords)
+    : mChords(chords) {
+    for (int side = 0; side != 2; ++side)
+      for (int iKey = 0; iKey != KEY_COUNTS[side]; ++iKey)
+        getKeyPosition(side, iKey, mX[side][iKey], mY[side][iKey]);
+  }
+
+  float evaluate(const Layout& layout) {
+    ++mNumEvaluations;
+    // Which keys play each note
+    for (int side = 0; side != 2; ++side) {
+      for (int direction = 0; direction != 2; ++direction) {
+        for (int note = 0; note != 128; ++note)
+          mNumNoteKeys[side][direction][note] = 0;
+        const Table& table = layout.mTables[side][direction];
+        for (int iKey = 0; iKey != KEY_COUNTS[side]; ++iKey) {
+          uint8_t note = table.mNotes[iKey];
+          if (note && table.mTypes[iKey] == KEY_NOTE && mNumNoteKeys[side][direction][note] != MAX_NOTE_KEYS)
+            mNoteKeys[side][direction][note][mNumNoteKeys[side][direction][note]++] = (uint8_t)iKey;
+        }
+      }
+    }
+
+    float cost = 0.0f;
+    bool hasPosition[2] = { false, false };
+    float handX[2] = { 0, 0 };
+    float handY[2] = { 0, 0 };
+    for (const Chord& chord : mChords) {
+      // Each note is played on the side it was recorded on if possible, using the key nearest
+      // where that hand is
+      float sumX[2] = { 0, 0 }, sumY[2] = { 0, 0 };
+      int count[2] = { 0, 0 };
+      float minX[2] = { 1e9f, 1e9f }, maxX[2] = { -1e9f, -1e9f }, minY[2] = { 1e9f, 1e9f }, maxY[2] = { -1e9f, -1e9f };
+      for (uint8_t note : chord.mNotes) {
+        int side = chord.mSide;
+        if (mNumNoteKeys[side][chord.mDirection][note] == 0) {
+          side = 1 - side;
+          if (mNumNoteKeys[side][chord.mDirection][note] == 0) {
+            cost += UNPLAYABLE_COST;
+            continue;
+          }
+          cost += CROSSING_COST;
+        }
+        int bestKey = mNoteKeys[side][chord.mDirection][note][0];
+        if (hasPosition[side]) {
+          float bestDistance = 1e9f;
+          for (int i = 0; i != mNumNoteKeys[side][chord.mDirection][note]; ++i) {
+            int iKey = mNoteKeys[side][chord.mDirection][note][i];
+            float distance = std::hypot(mX[side][iKey] - handX[side], mY[side][iKey] - handY[side]);
+            if (distance < bestDistance) {
+              bestDistance = distance;
+              bestKey = iKey;
+            }
+          }
+        }
+        float x = mX[side][bestKey], y = mY[side][bestKey];
+        sumX[side] += x;
+        sumY[side] += y;
+        ++count[side];
+        minX[side] = std::min(minX[side], x);
+        maxX[side] = std::max(maxX[side], x);
+        minY[side] = std::min(minY[side], y);
+        maxY[side] = std::max(maxY[side], y);
+      }
+
+      for (int side = 0; side != 2; ++side) {
+        if (!count[side])
+          continue;
+        float x = sumX[side] / count[side], y = sumY[side] / count[side];
+        if (hasPosition[side])
+          cost += TRAVEL_WEIGHT * std::hypot(x - handX[side], y - handY[side]);
+        float span = std::hypot(maxX[side] - minX[side], maxY[side] - minY[side]);
+        if (span > COMFORTABLE_SPAN)
+          cost += STRETCH_WEIGHT * (span - COMFORTABLE_SPAN);
+        handX[side] = x;
+        handY[side] = y;
+        hasPosition[side] = true;
+      }
+    }
+    return cost;
+  }
+
+  uint64_t getNumEvaluations() const {
+    return mNumEvaluations;
+  }
+
+private:
+  static const int MAX_NOTE_KEYS = 4;
+
+  const std::vector<Chord>& mChords;
+  float mX[2][MAX_KEYS];
+  float mY[2][MAX_KEYS];
+  uint8_t mNoteKeys[2][2][128][MAX_NOTE_KEYS];
+  uint8_t mNumNoteKeys[2][2][128];
+  uint64_t mNumEvaluations = 0;
+};
+
+//====================================================================================================
+// Swaps two movable keys. Returns false if the chosen keys can't move.
+static bool mutate(Layout& layout, std::mt19937& rng) {
+  int direction = layout.mUnisonoric ? OPEN : (int)(rng() % 2);
+  int sides[2];
+  sides[0] = (int)(rng() % 2);
+  sides[1] = rng() % 5 == 0 ? 1 - sides[0] : sides[0];
+  int keys[2];
+  for (int i = 0; i != 2; ++i)
+    keys[i] = (int)(rng() % KEY_COUNTS[sides[i]]);
+
+  Table& table0 = layout.mTables[sides[0]][direction];
+  Table& table1 = layout.mTables[sides[1]][direction];
+  if (table0.mTypes[keys[0]] != KEY_NOTE || table1.mTypes[keys[1]] != KEY_NOTE)
+    return false;
+  if (table0.mNotes[keys[0]] == table1.mNotes[keys[1]])
+    return false;
+  std::swap(table0.mNotes[keys[0]], table1.mNotes[keys[1]]);
+  if (layout.mUnisonoric) {
+    layout.mTables[sides[0]][CLOSE] = layout.mTables[sides[0]][OPEN];
+    layout.mTables[sides[1]][CLOSE] = layout.mTables[sides[1]][OPEN];
+  }
+  return true;
+}
+
+//====================================================================================================
+struct SearchResult {
+  Layout mLayout;
+  float mCost = 0.0f;
+  uint64_t mNumEvaluations = 0;
+};
+
+static void search(const Layout& start, const std::vector<Chord>& chords, double seconds, unsigned seed, SearchResult& result) {
+  Evaluator evaluator(chords);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+  Layout current = start;
+  float currentCost = evaluator.evaluate(current);
+  result.mLayout = current;
+  result.mCost = currentCost;
+
+  // The temperature falls linearly to zero
+  const float startTemperature = 0.005f * currentCost + 1.0f;
+  auto startTime = std::chrono::steady_clock::now();
+  double elapsed = 0.0;
+  for (uint64_t step = 0; elapsed < seconds; ++step) {
+    if ((step & 255) == 0)
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    float temperature = startTemperature * (float)(1.0 - elapsed / seconds);
+
+    Layout candidate = current;
+    if (!mutate(candidate, rng))
+      continue;
+    float cost = evaluator.evaluate(candidate);
+    if (cost <= currentCost || (temperature > 0 && uniform(rng) < std::exp((currentCost - cost) / temperature))) {
+      current = candidate;
+      currentCost = cost;
+      if (cost < result.mCost) {
+        result.mLayout = candidate;
+        result.mCost = cost;
+      }
+    }
+  }
+  result.mNumEvaluations = evaluator.getNumEvaluations();
+}
+
+//====================================================================================================
+static void printTable(const Layout& layout, int side, int direction) {
+  static const char* SIDE_NAMES[2] = { "Left", "Right" };
+  static const char* DIRECTION_NAMES[2] = { "Open", "Close" };
+  static const char* SIDE_INDICES[2] = { "LEFT", "RIGHT" };
+  printf("const uint8_t %sLayout%s%s[PinInputs::keyCounts[%s]] = {\n",
+         layout.mName.c_str(), SIDE_NAMES[side], DIRECTION_NAMES[direction], SIDE_INDICES[side]);
+  const Table& table = layout.mTables[side][direction];
+  for (int iKey = 0; iKey != KEY_COUNTS[side]; ++iKey) {
+    bool lineStart = iKey % ROW_COUNTS[side] == 0;
+    bool lineEnd = (iKey + 1) % ROW_COUNTS[side] == 0;
+    printf("%s", lineStart ? "  " : " ");
+    if (table.mTypes[iKey] == KEY_SKIPPED)
+      printf("SKIPPED_KEY");
+    else if (table.mTypes[iKey] == KEY_BUTTON)
+      printf("NOTE_BUTTON");
+    else if (table.mNotes[iKey] == 0)
+      printf("NOTE_UNUSED");
+    else
+      printf("NOTE(%s, %d)", NOTE_NAMES[table.mNotes[iKey] % 12], table.mNotes[iKey] / 12 - 1);
+    printf("%s", iKey + 1 == KEY_COUNTS[side] ? "\n" : (lineEnd ? ",\n" : ","));
+  }
+  printf("};\n\n");
+}
+
+//====================================================================================================
+static void printLayout(const Layout& layout) {
+  for (int side = 0; side != 2; ++side)
+    printTable(layout, side, OPEN);
+  if (layout.mUnisonoric) {
+    printf("const uint8_t* %sLayoutLeftClose = %sLayoutLeftOpen;\n", layout.mName.c_str(), layout.mName.c_str());
+    printf("const uint8_t* %sLayoutRightClose = %sLayoutRightOpen;\n", layout.mName.c_str(), layout.mName.c_str());
+  } else {
+    for (int side = 0; side != 2; ++side)
+      printTable(layout, side, CLOSE);
+  }
+}
+
+//====================================================================================================
+int main(int argc, char** argv) {
+  const char* layoutsPath = nullptr;
+  std::vector<const char*> recordingPaths;
+  std::string startName;
+  double seconds = 10.0;
+  unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+      startName = argv[++i];
+    else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+      seconds = atof(argv[++i]);
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      numThreads = std::max(1, atoi(argv[++i]));
+    else if (!layoutsPath)
+      layoutsPath = argv[i];
+    else
+      recordingPaths.push_back(argv[i]);
+  }
+  if (!layoutsPath || recordingPaths.empty()) {
+    fprintf(stderr, "Usage: %s NoteLayouts.cpp recording.txt [...] [--layout name] [--seconds n] [--threads n]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<Layout> layouts = readLayouts(layoutsPath);
+  std::vector<Chord> chords;
+  for (const char* path : recordingPaths) {
+    std::vector<Chord> recording = readRecording(path);
+    chords.insert(chords.end(), recording.begin(), recording.end());
+  }
+  if (layouts.empty() || chords.empty()) {
+    fprintf(stderr, "Found %zu layouts and %zu chords - nothing to do\n", layouts.size(), chords.size());
+    return 1;
+  }
+  fprintf(stderr, "%zu chords from %zu recordings\n", chords.size(), recordingPaths.size());
+
+  // Score the existing layouts
+  Evaluator evaluator(chords);
+  const Layout* start = nullptr;
+  float startCost = 0.0f;
+  for (const Layout& layout : layouts) {
+    float cost = evaluator.evaluate(layout);
+    fprintf(stderr, "%-12s cost %10.1f (%.2f per chord)\n", layout.mName.c_str(), cost, cost / chords.size());
+    if (startName.empty() ? (!start || cost < startCost) : layout.mName == startName) {
+      start = &layout;
+      startCost = cost;
+    }
+  }
+  if (!start) {
+    fprintf(stderr, "No layout called %s\n", startName.c_str());
+    return 1;
+  }
+
+  fprintf(stderr, "Searching from %s on %u threads for %.0f seconds\n", start->mName.c_str(), numThreads, seconds);
+  std::vector<SearchResult> results(numThreads);
+  std::vector<std::thread> threads;
+  auto startTime = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i != numThreads; ++i)
+    threads.emplace_back(search, std::cref(*start), std::cref(chords), seconds, 1234u + i, std::ref(results[i]));
+  for (std::thread& thread : threads)
+    thread.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+  uint64_t numEvaluations = 0;
+  const SearchResult* best = &results[0];
+  for (const SearchResult& result : results) {
+    numEvaluations += result.mNumEvaluations;
+    if (result.mCost < best->mCost)
+      best = &result;
+  }
+  fprintf(stderr, "%llu evaluations in %.1fs: %.0f per second\n",
+          (unsigned long long)numEvaluations, elapsed, numEvaluations / elapsed);
+  fprintf(stderr, "Best cost %.1f (%.2f per chord), from %.1f\n", best->mCost, best->mCost / chords.size(), startCost);
+
+  Layout improved = best->mLayout;
+  improved.mName = start->mName + "Opt";
+  printLayout(improved);
+  return 0;
+}
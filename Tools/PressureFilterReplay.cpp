@@ -0,0 +1,169 @@
+// Runs a bellows pressure trace through every PressureFilter type, with and without prediction, and
+// reports the latency and noise of each.
+//
+// This runs on a computer, not the Teensy. Build and run it with something like:
+//
+//   g++ -O2 -std=c++17 -IBandonino Tools/PressureFilterReplay.cpp -o PressureFilterReplay && ./PressureFilterReplay
+//
+// and to replay a recording:
+//
+//   PressureFilterReplay log.txt [options]
+//
+//     --smoothing <n>   Pressure smoothing setting, 0 to 100. Default: the settings default, 40
+//     --noise <x>       Load cell noise (standard deviation). Default: 0.01, as the firmware
+//
+// Recordings are Serial logs with showPressureFilter on - a "Pressure trace (us, pressure)" line,
+// then a line per load cell sample of the form
+//
+//   <micros>, <pressure>
+//
+// Other lines are ignored, and if there are several traces the last one is used. Without a log, a
+// synthetic trace is used - about 5s at 80Hz with jittered sample times, the bellows opening and
+// closing (through zero) at a couple of speeds, and noise of the given size.
+//
+// Each filter goes through measurePressureFilter, reading the output at 1kHz as the firmware's
+// report does. It checks:
+//   - zero: with prediction, the output never has the opposite sign to the filter's estimate at the
+//     last sample, so a reversal is never reported before a sample shows it
+//   - noise: the 1 Euro and Kalman filters are quieter than None, with and without prediction
+// It prints a line per filter, and returns non-zero if any check fails.
+
+#include "PressureFilter.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// These match Settings.cpp
+const char* const FILTER_NAMES[PRESSURE_FILTER_NUM] = { "None", "1 Euro", "Kalman" };
+
+const uint32_t OUTPUT_INTERVAL_MICROS = 1000;
+
+// The synthetic trace
+const int SYNTHETIC_LENGTH = 400;
+const uint32_t SYNTHETIC_INTERVAL_MICROS = 12500;
+const uint32_t SYNTHETIC_JITTER_MICROS = 1000;
+
+struct Trace {
+  std::vector<float> mPressures;
+  std::vector<uint32_t> mTimesMicros;
+};
+
+//====================================================================================================
+static Trace readTrace(const char* path) {
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    exit(1);
+  }
+  Trace trace;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 15, "Pressure trace ") == 0) {
+      trace = Trace();
+      continue;
+    }
+    unsigned long timeMicros;
+    float pressure;
+    if (sscanf(line.c_str(), "%lu, %f", &timeMicros, &pressure) != 2)
+      continue;
+    trace.mPressures.push_back(pressure);
+    trace.mTimesMicros.push_back((uint32_t)timeMicros);
+  }
+  return trace;
+}
+
+//====================================================================================================
+static Trace makeSyntheticTrace(float noise) {
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int> jitter(-(int)SYNTHETIC_JITTER_MICROS / 2, SYNTHETIC_JITTER_MICROS / 2);
+  std::normal_distribution<float> noiseDistribution(0.0f, noise);
+  Trace trace;
+  uint32_t startMicros = 3000000;
+  for (int i = 0; i != SYNTHETIC_LENGTH; ++i) {
+    uint32_t time = startMicros + i * SYNTHETIC_INTERVAL_MICROS + jitter(random);
+    double seconds = (time - startMicros) * 1e-6;
+    // A slow push and pull, with a quicker wobble on top
+    double pressure = 0.5 * sin(2.0 * M_PI * 0.4 * seconds) + 0.15 * sin(2.0 * M_PI * 1.7 * seconds);
+    trace.mPressures.push_back((float)pressure + noiseDistribution(random));
+    trace.mTimesMicros.push_back(time);
+  }
+  return trace;
+}
+
+//====================================================================================================
+// Reads the output at the output rate, as measurePressureFilter does, and counts the outputs that
+// have the opposite sign to the estimate at the last sample
+static int countZeroCrossings(PressureFilter filter, const Trace& trace) {
+  filter.reset();
+  int numCrossings = 0;
+  for (size_t i = 0; i != trace.mPressures.size(); ++i) {
+    filter.addSample(trace.mPressures[i], trace.mTimesMicros[i]);
+    uint32_t end = i + 1 != trace.mPressures.size() ? trace.mTimesMicros[i + 1] : trace.mTimesMicros[i] + 50000;
+    for (uint32_t t = trace.mTimesMicros[i]; (int32_t)(end - t) > 0; t += OUTPUT_INTERVAL_MICROS) {
+      if (filter.getPressure(t, true) * filter.getPressure(t, false) < 0.0f)
+        ++numCrossings;
+    }
+  }
+  return numCrossings;
+}
+
+//====================================================================================================
+int main(int argc, char** argv) {
+  const char* logPath = nullptr;
+  int smoothing = 40;
+  float noise = 0.01f;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--smoothing") == 0 && i + 1 < argc)
+      smoothing = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--noise") == 0 && i + 1 < argc)
+      noise = (float)atof(argv[++i]);
+    else if (!logPath)
+      logPath = argv[i];
+    else {
+      fprintf(stderr, "Usage: %s [log.txt] [--smoothing n] [--noise x]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Trace trace = logPath ? readTrace(logPath) : makeSyntheticTrace(noise);
+  int count = (int)trace.mPressures.size();
+  if (count < 3) {
+    fprintf(stderr, "No pressure trace found\n");
+    return 1;
+  }
+  printf("%d samples over %.1fs%s, smoothing %d\n", count,
+         (trace.mTimesMicros.back() - trace.mTimesMicros.front()) * 1e-6, logPath ? "" : " (synthetic)", smoothing);
+
+  int numFailed = 0;
+  PressureFilterReport reports[PRESSURE_FILTER_NUM][2];
+  for (int type = 0; type != PRESSURE_FILTER_NUM; ++type) {
+    for (int predict = 0; predict != 2; ++predict) {
+      PressureFilter filter;
+      filter.setType(type);
+      filter.setSmoothing(smoothing / 100.0f);
+      filter.setNoise(noise);
+      PressureFilterReport& report = reports[type][predict];
+      report = measurePressureFilter(filter, trace.mPressures.data(), trace.mTimesMicros.data(), count,
+                                     OUTPUT_INTERVAL_MICROS, predict != 0);
+      int numCrossings = predict ? countZeroCrossings(filter, trace) : 0;
+      bool noiseOk = type == PRESSURE_FILTER_NONE || report.mNoise < reports[PRESSURE_FILTER_NONE][predict].mNoise;
+      bool ok = numCrossings == 0 && noiseOk;
+      if (!ok)
+        ++numFailed;
+
+      printf("%s %-7s predict %d: latency %4.1fms noise %4.2f largest step %6.4f zero crossings %d%s\n",
+             ok ? "ok  " : "FAIL", FILTER_NAMES[type], predict, report.mLatencyMillis, report.mNoise,
+             report.mMaxStep, numCrossings, noiseOk ? "" : " (noisier than None)");
+    }
+  }
+
+  printf("%d of %d filters failed\n", numFailed, PRESSURE_FILTER_NUM * 2);
+  return numFailed == 0 ? 0 : 1;
+}